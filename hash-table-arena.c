@@ -0,0 +1,143 @@
+#include "hash-table-arena.h"
+
+#include "hash-table-common.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+//threads past this many share shards, still correct but they contend
+#define ARENA_SHARDS 64
+#define ARENA_ALIGNMENT 8
+//freed blocks up to this size are kept for reuse, larger ones wait for destroy
+#define ARENA_MAX_FREE_SIZE 256
+#define ARENA_FREE_BINS (ARENA_MAX_FREE_SIZE / ARENA_ALIGNMENT)
+
+struct chunk {
+	struct chunk *previous;
+	size_t size;
+	size_t used;
+	_Alignas(ARENA_ALIGNMENT) char data[];
+};
+
+/* Lives in the first bytes of a freed block */
+struct free_block {
+	struct free_block *next;
+};
+
+struct shard {
+	_Alignas(CACHE_LINE_SIZE) atomic_bool locked;
+	struct chunk *current;
+	//bin i holds freed blocks of (i + 1) * ARENA_ALIGNMENT bytes
+	struct free_block *free[ARENA_FREE_BINS];
+};
+
+struct arena {
+	struct shard shards[ARENA_SHARDS];
+};
+
+struct arena *arena_create()
+{
+	struct arena *arena = calloc(1, sizeof(struct arena));
+	assert(arena != NULL);
+	return arena;
+}
+
+/* The same thread always lands on the same shard */
+static struct shard *get_shard(struct arena *arena)
+{
+	return &arena->shards[hash_table_thread_index() % ARENA_SHARDS];
+}
+
+static struct chunk *chunk_create(struct chunk *previous, size_t size)
+{
+	struct chunk *chunk = calloc(1, sizeof(struct chunk) + size);
+	assert(chunk != NULL);
+	chunk->previous = previous;
+	chunk->size = size;
+	return chunk;
+}
+
+static size_t round_size(size_t size)
+{
+	//every block can hold a free_block once it is freed
+	if (size < sizeof(struct free_block)) {
+		size = sizeof(struct free_block);
+	}
+	return (size + ARENA_ALIGNMENT - 1) & ~(size_t) (ARENA_ALIGNMENT - 1);
+}
+
+static void lock_shard(struct shard *shard)
+{
+	//only ever contended when more threads than shards are allocating
+	while (atomic_exchange_explicit(&shard->locked, true, memory_order_acquire)) {
+		while (atomic_load_explicit(&shard->locked, memory_order_relaxed)) {
+			cpu_relax();
+		}
+	}
+}
+
+static void unlock_shard(struct shard *shard)
+{
+	atomic_store_explicit(&shard->locked, false, memory_order_release);
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size = round_size(size);
+	struct shard *shard = get_shard(arena);
+	lock_shard(shard);
+
+	if (size <= ARENA_MAX_FREE_SIZE) {
+		struct free_block **bin = &shard->free[size / ARENA_ALIGNMENT - 1];
+		struct free_block *block = *bin;
+		if (block != NULL) {
+			*bin = block->next;
+			unlock_shard(shard);
+			memset(block, 0, size);
+			return block;
+		}
+	}
+
+	struct chunk *chunk = shard->current;
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk = chunk_create(chunk, size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+		shard->current = chunk;
+	}
+	void *memory = chunk->data + chunk->used;
+	chunk->used += size;
+
+	unlock_shard(shard);
+	return memory;
+}
+
+void arena_free(struct arena *arena, void *memory, size_t size)
+{
+	size = round_size(size);
+	if (size > ARENA_MAX_FREE_SIZE) {
+		return;
+	}
+	struct shard *shard = get_shard(arena);
+	struct free_block *block = memory;
+	lock_shard(shard);
+	block->next = shard->free[size / ARENA_ALIGNMENT - 1];
+	shard->free[size / ARENA_ALIGNMENT - 1] = block;
+	unlock_shard(shard);
+}
+
+void arena_destroy(struct arena *arena)
+{
+	for (size_t i = 0; i < ARENA_SHARDS; ++i) {
+		struct chunk *chunk = arena->shards[i].current;
+		while (chunk != NULL) {
+			struct chunk *previous = chunk->previous;
+			free(chunk);
+			chunk = previous;
+		}
+	}
+	free(arena);
+}
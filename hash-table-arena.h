@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+
+/* Bump allocator the tables carve their entries out of. Each thread
+ * allocates from its own shard of large chunks, so inserts never contend
+ * on a global allocator lock, and everything is released at once by
+ * arena_destroy. */
+struct arena;
+struct arena *arena_create();
+/* Returns zeroed memory, aligned for pointers and 64-bit atomics */
+void *arena_alloc(struct arena *arena, size_t size);
+/* Hands a block back for reuse by later allocations of the same size from
+ * this thread's shard, size is what it was allocated with */
+void arena_free(struct arena *arena, void *memory, size_t size);
+void arena_destroy(struct arena *arena);
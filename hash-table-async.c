@@ -0,0 +1,267 @@
+#include "hash-table-async.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+//most lookups a worker hands to one lookup_many
+#define HASH_TABLE_ASYNC_BATCH 16
+//cpu_relax rounds before an idle worker yields its cpu
+#define HASH_TABLE_ASYNC_SPINS 64
+
+struct request {
+	enum hash_table_async_kind kind;
+	const char *key;
+	uint64_t value;
+	uint64_t tag;
+};
+
+/* Operation n of the queue uses slot n % HASH_TABLE_ASYNC_RING_SIZE of
+ * both rings. submit refuses an operation until the completion of the one
+ * a ring size before it was polled, so the worker is done with every slot
+ * the caller writes and neither ring can be overrun. */
+struct hash_table_async_queue {
+	//only the caller writes these
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t submitted;
+	size_t polled;
+	//only the worker writes this
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t completed;
+	//the worker's next queue, set before the queue is published
+	struct hash_table_async_queue *next;
+	struct request requests[HASH_TABLE_ASYNC_RING_SIZE];
+	struct hash_table_async_completion completions[HASH_TABLE_ASYNC_RING_SIZE];
+};
+
+struct worker {
+	struct hash_table_async *async;
+	pthread_t thread;
+	//queues this worker drains, new ones are pushed at the front
+	_Alignas(CACHE_LINE_SIZE) struct hash_table_async_queue *_Atomic queues;
+};
+
+struct hash_table_async {
+	struct hash_table_v2 *hash_table;
+	size_t worker_count;
+	struct worker *workers;
+	//queue_create deals queues out to the workers in turn
+	atomic_size_t next_worker;
+	atomic_bool stopping;
+};
+
+static void backoff(unsigned *spins)
+{
+	if (++*spins < HASH_TABLE_ASYNC_SPINS) {
+		cpu_relax();
+	}
+	else {
+		*spins = 0;
+		sched_yield();
+	}
+}
+
+/* Runs one write */
+static void run_request(struct hash_table_v2 *hash_table,
+                        const struct request *request,
+                        struct hash_table_async_completion *completion)
+{
+	completion->tag = request->tag;
+	completion->found = false;
+	completion->value = 0;
+	switch (request->kind) {
+	case HASH_TABLE_ASYNC_ADD:
+		hash_table_v2_add_entry64(hash_table, request->key, request->value);
+		break;
+	case HASH_TABLE_ASYNC_LOOKUP:
+		//lookups are batched by run_lookups
+		assert(false);
+		break;
+	case HASH_TABLE_ASYNC_REMOVE:
+		completion->found = hash_table_v2_remove(hash_table, request->key);
+		break;
+	case HASH_TABLE_ASYNC_FETCH_ADD:
+		completion->found = true;
+		completion->value = hash_table_v2_fetch_add(hash_table, request->key, request->value);
+		break;
+	}
+}
+
+/* Runs a run of up to HASH_TABLE_ASYNC_BATCH lookups starting at operation
+ * first as one batch, returns how many it took */
+static size_t run_lookups(struct hash_table_v2 *hash_table,
+                          struct hash_table_async_queue *queue,
+                          size_t first,
+                          size_t submitted)
+{
+	const char *keys[HASH_TABLE_ASYNC_BATCH];
+	bool found[HASH_TABLE_ASYNC_BATCH];
+	uint64_t values[HASH_TABLE_ASYNC_BATCH];
+	size_t count = 0;
+	while (count < HASH_TABLE_ASYNC_BATCH && first + count < submitted) {
+		const struct request *request = &queue->requests[(first + count) % HASH_TABLE_ASYNC_RING_SIZE];
+		if (request->kind != HASH_TABLE_ASYNC_LOOKUP) {
+			break;
+		}
+		keys[count++] = request->key;
+	}
+	hash_table_v2_lookup_many(hash_table, keys, found, values, count);
+	for (size_t i = 0; i < count; ++i) {
+		size_t slot = (first + i) % HASH_TABLE_ASYNC_RING_SIZE;
+		struct hash_table_async_completion *completion = &queue->completions[slot];
+		completion->tag = queue->requests[slot].tag;
+		completion->found = found[i];
+		completion->value = found[i] ? values[i] : 0;
+	}
+	return count;
+}
+
+/* Runs everything submitted to the queue so far, returns how much */
+static size_t drain(struct hash_table_v2 *hash_table, struct hash_table_async_queue *queue)
+{
+	size_t completed = atomic_load_explicit(&queue->completed, memory_order_relaxed);
+	size_t submitted = atomic_load_explicit(&queue->submitted, memory_order_acquire);
+	size_t first = completed;
+	while (completed < submitted) {
+		size_t slot = completed % HASH_TABLE_ASYNC_RING_SIZE;
+		if (queue->requests[slot].kind == HASH_TABLE_ASYNC_LOOKUP) {
+			completed += run_lookups(hash_table, queue, completed, submitted);
+		}
+		else {
+			run_request(hash_table, &queue->requests[slot], &queue->completions[slot]);
+			++completed;
+		}
+		//let the caller see every batch as soon as it is done
+		atomic_store_explicit(&queue->completed, completed, memory_order_release);
+	}
+	return completed - first;
+}
+
+/* Drains its queues round robin until destroy, stopping is read before a
+ * pass so a pass that finds nothing saw everything submitted before it */
+static void *run_worker(void *arg)
+{
+	struct worker *worker = arg;
+	struct hash_table_async *async = worker->async;
+	unsigned spins = 0;
+	while (true) {
+		bool stopping = atomic_load_explicit(&async->stopping, memory_order_acquire);
+		size_t done = 0;
+		struct hash_table_async_queue *queue = atomic_load_explicit(&worker->queues,
+		                                                            memory_order_acquire);
+		for (; queue != NULL; queue = queue->next) {
+			done += drain(async->hash_table, queue);
+		}
+		if (done != 0) {
+			spins = 0;
+			continue;
+		}
+		if (stopping) {
+			return NULL;
+		}
+		backoff(&spins);
+	}
+}
+
+struct hash_table_async *hash_table_async_create(struct hash_table_v2 *hash_table,
+                                                 size_t workers)
+{
+	assert(hash_table != NULL && workers > 0);
+	struct hash_table_async *async = calloc(1, sizeof(struct hash_table_async));
+	assert(async != NULL);
+	async->hash_table = hash_table;
+	async->worker_count = workers;
+	async->workers = aligned_alloc(CACHE_LINE_SIZE, workers * sizeof(struct worker));
+	assert(async->workers != NULL);
+	memset(async->workers, 0, workers * sizeof(struct worker));
+	for (size_t i = 0; i < workers; ++i) {
+		struct worker *worker = &async->workers[i];
+		worker->async = async;
+		atomic_init(&worker->queues, NULL);
+		if (pthread_create(&worker->thread, NULL, run_worker, worker) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return async;
+}
+
+struct hash_table_async_queue *hash_table_async_queue_create(struct hash_table_async *async)
+{
+	struct hash_table_async_queue *queue = aligned_alloc(CACHE_LINE_SIZE,
+	                                                     sizeof(struct hash_table_async_queue));
+	assert(queue != NULL);
+	memset(queue, 0, sizeof(struct hash_table_async_queue));
+	atomic_init(&queue->submitted, 0);
+	atomic_init(&queue->completed, 0);
+
+	size_t index = atomic_fetch_add_explicit(&async->next_worker, 1, memory_order_relaxed);
+	struct worker *worker = &async->workers[index % async->worker_count];
+	struct hash_table_async_queue *first = atomic_load_explicit(&worker->queues,
+	                                                            memory_order_relaxed);
+	do {
+		queue->next = first;
+	} while (!atomic_compare_exchange_weak_explicit(&worker->queues, &first, queue,
+	                                                memory_order_release,
+	                                                memory_order_relaxed));
+	return queue;
+}
+
+bool hash_table_async_submit(struct hash_table_async_queue *queue,
+                             enum hash_table_async_kind kind,
+                             const char *key,
+                             uint64_t value,
+                             uint64_t tag)
+{
+	assert(key != NULL);
+	size_t submitted = atomic_load_explicit(&queue->submitted, memory_order_relaxed);
+	if (submitted - queue->polled >= HASH_TABLE_ASYNC_RING_SIZE) {
+		return false;
+	}
+	queue->requests[submitted % HASH_TABLE_ASYNC_RING_SIZE] = (struct request) {
+		kind, key, value, tag
+	};
+	atomic_store_explicit(&queue->submitted, submitted + 1, memory_order_release);
+	return true;
+}
+
+size_t hash_table_async_poll(struct hash_table_async_queue *queue,
+                             struct hash_table_async_completion *completions,
+                             size_t count)
+{
+	size_t completed = atomic_load_explicit(&queue->completed, memory_order_acquire);
+	size_t polled = 0;
+	while (polled < count && queue->polled < completed) {
+		completions[polled++] = queue->completions[queue->polled++ % HASH_TABLE_ASYNC_RING_SIZE];
+	}
+	return polled;
+}
+
+size_t hash_table_async_pending(const struct hash_table_async_queue *queue)
+{
+	return atomic_load_explicit(&queue->submitted, memory_order_relaxed) - queue->polled;
+}
+
+void hash_table_async_destroy(struct hash_table_async *async)
+{
+	atomic_store_explicit(&async->stopping, true, memory_order_release);
+	for (size_t i = 0; i < async->worker_count; ++i) {
+		struct worker *worker = &async->workers[i];
+		if (pthread_join(worker->thread, NULL) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+		struct hash_table_async_queue *queue = atomic_load(&worker->queues);
+		while (queue != NULL) {
+			struct hash_table_async_queue *next = queue->next;
+			free(queue);
+			queue = next;
+		}
+	}
+	free(async->workers);
+	free(async);
+}
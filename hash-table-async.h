@@ -0,0 +1,63 @@
+#pragma once
+
+#include "hash-table-v2.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Asynchronous front end over a shared hash_table_v2. Every calling thread
+ * gets its own queue, a submission ring and a completion ring that only it
+ * and one worker thread touch, so submitting and collecting never take a
+ * lock or wait on one. The workers run the operations against the table
+ * and take the cache misses and bucket locks for the callers, lookups
+ * that are queued back to back run as one prefetching batch.
+ *
+ * A queue's operations run in the order they were submitted, so a lookup
+ * submitted after an add of the same key finds it. Operations of
+ * different queues may run in any order. */
+#define HASH_TABLE_ASYNC_RING_SIZE 256
+
+enum hash_table_async_kind {
+	/* add_entry64, found and value are always false and 0 */
+	HASH_TABLE_ASYNC_ADD,
+	/* found tells if the key is there, value is the key's value */
+	HASH_TABLE_ASYNC_LOOKUP,
+	/* found tells if the key was there */
+	HASH_TABLE_ASYNC_REMOVE,
+	/* value is the value before the add, found is always true */
+	HASH_TABLE_ASYNC_FETCH_ADD,
+};
+
+struct hash_table_async_completion {
+	/* Whatever the caller submitted the operation with */
+	uint64_t tag;
+	bool found;
+	uint64_t value;
+};
+
+struct hash_table_async;
+struct hash_table_async_queue;
+/* The table has to outlive the front end */
+struct hash_table_async *hash_table_async_create(struct hash_table_v2 *hash_table,
+                                                 size_t workers);
+/* A queue for one submitting thread, it lives as long as the front end */
+struct hash_table_async_queue *hash_table_async_queue_create(struct hash_table_async *async);
+/* Queues one operation, value is the value of an add or the delta of a
+ * fetch_add. Returns false without queueing it once the queue holds
+ * HASH_TABLE_ASYNC_RING_SIZE operations whose completions weren't polled
+ * yet. Keys have to stay valid until their operation completes. */
+bool hash_table_async_submit(struct hash_table_async_queue *queue,
+                             enum hash_table_async_kind kind,
+                             const char *key,
+                             uint64_t value,
+                             uint64_t tag);
+/* Copies out up to count finished operations in submission order and
+ * returns how many, 0 if none finished yet. Never waits. */
+size_t hash_table_async_poll(struct hash_table_async_queue *queue,
+                             struct hash_table_async_completion *completions,
+                             size_t count);
+/* Operations submitted on the queue that weren't polled yet */
+size_t hash_table_async_pending(const struct hash_table_async_queue *queue);
+/* Runs every operation still queued, then stops the workers and frees the
+ * queues. The table itself is left alone. */
+void hash_table_async_destroy(struct hash_table_async *async);
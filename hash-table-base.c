@@ -1,5 +1,7 @@
 #include "hash-table-base.h"
 
+#include "hash-table-arena.h"
+
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,12 +21,15 @@ struct hash_table_entry {
 
 struct hash_table_base {
 	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
+	/* Every list_entry is carved out of here */
+	struct arena *arena;
 };
 
 struct hash_table_base *hash_table_base_create()
 {
 	struct hash_table_base *hash_table = calloc(1, sizeof(struct hash_table_base));
 	assert(hash_table != NULL);
+	hash_table->arena = arena_create();
 	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
 		struct hash_table_entry *entry = &hash_table->entries[i];
 		SLIST_INIT(&entry->list_head);
@@ -80,7 +85,7 @@ void hash_table_base_add_entry(struct hash_table_base *hash_table,
 		return;
 	}
 
-	list_entry = calloc(1, sizeof(struct list_entry));
+	list_entry = arena_alloc(hash_table->arena, sizeof(struct list_entry));
 	list_entry->key = key;
 	list_entry->value = value;
 	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
@@ -98,15 +103,7 @@ uint32_t hash_table_base_get_value(struct hash_table_base *hash_table,
 
 void hash_table_base_destroy(struct hash_table_base *hash_table)
 {
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
-		}
-	}
+	/* Entries are released with their arena chunks, no need to walk the lists */
+	arena_destroy(hash_table->arena);
 	free(hash_table);
 }
@@ -1,7 +1,9 @@
 #include "hash-table-common.h"
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
 uint32_t bernstein_hash(const char *string)
 {
@@ -17,3 +19,112 @@ uint32_t bernstein_hash(const char *string)
 	}
 	return hash;
 }
+
+static atomic_size_t next_thread_index;
+//one more than the thread's index, 0 until it asks for one
+static _Thread_local size_t thread_index;
+
+size_t hash_table_thread_index(void)
+{
+	if (thread_index == 0) {
+		thread_index = atomic_fetch_add_explicit(&next_thread_index, 1,
+		                                         memory_order_relaxed) + 1;
+	}
+	return thread_index - 1;
+}
+
+uint32_t bernstein_hash_length(const char *key, size_t length)
+{
+	uint32_t hash = 0;
+	for (size_t i = 0; i < length; ++i) {
+		hash = (33 * hash) + key[i];
+	}
+	return hash;
+}
+
+static const uint64_t wyhash_secret[4] = {
+	0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+	0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+static inline void wyhash_mum(uint64_t *a, uint64_t *b)
+{
+	__uint128_t r = (__uint128_t) *a * *b;
+	*a = (uint64_t) r;
+	*b = (uint64_t) (r >> 64);
+}
+
+static inline uint64_t wyhash_mix(uint64_t a, uint64_t b)
+{
+	wyhash_mum(&a, &b);
+	return a ^ b;
+}
+
+/* Unaligned little endian reads, compilers turn these into single loads */
+static inline uint64_t wyhash_read8(const char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t wyhash_read4(const char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t wyhash_read3(const char *p, size_t k)
+{
+	return (((uint64_t) (uint8_t) p[0]) << 16)
+	       | (((uint64_t) (uint8_t) p[k >> 1]) << 8)
+	       | (uint8_t) p[k - 1];
+}
+
+uint32_t wyhash(const char *key, size_t length)
+{
+	const char *p = key;
+	uint64_t seed = wyhash_mix(wyhash_secret[0], wyhash_secret[1]);
+	uint64_t a, b;
+	if (length <= 16) {
+		if (length >= 4) {
+			a = (wyhash_read4(p) << 32) | wyhash_read4(p + ((length >> 3) << 2));
+			b = (wyhash_read4(p + length - 4) << 32)
+			    | wyhash_read4(p + length - 4 - ((length >> 3) << 2));
+		}
+		else if (length > 0) {
+			a = wyhash_read3(p, length);
+			b = 0;
+		}
+		else {
+			a = b = 0;
+		}
+	}
+	else {
+		size_t i = length;
+		if (i > 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = wyhash_mix(wyhash_read8(p) ^ wyhash_secret[1], wyhash_read8(p + 8) ^ seed);
+				see1 = wyhash_mix(wyhash_read8(p + 16) ^ wyhash_secret[2], wyhash_read8(p + 24) ^ see1);
+				see2 = wyhash_mix(wyhash_read8(p + 32) ^ wyhash_secret[3], wyhash_read8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while (i > 16) {
+			seed = wyhash_mix(wyhash_read8(p) ^ wyhash_secret[1], wyhash_read8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = wyhash_read8(p + i - 16);
+		b = wyhash_read8(p + i - 8);
+	}
+	a ^= wyhash_secret[1];
+	b ^= seed;
+	wyhash_mum(&a, &b);
+	uint64_t hash = wyhash_mix(a ^ wyhash_secret[0] ^ length, b ^ wyhash_secret[1]);
+	return (uint32_t) (hash ^ (hash >> 32));
+}
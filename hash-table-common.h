@@ -1,7 +1,31 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define HASH_TABLE_CAPACITY 4096
 
+#define CACHE_LINE_SIZE 64
+
 uint32_t bernstein_hash(const char *string);
+
+/* Hashers the tables can be created with, key is length bytes long */
+typedef uint32_t (*hash_function)(const char *key, size_t length);
+/* djb2, one byte per step, kept around for comparison */
+uint32_t bernstein_hash_length(const char *key, size_t length);
+/* wyhash (final version 4) folded to 32 bits, takes 8 bytes per step */
+uint32_t wyhash(const char *key, size_t length);
+
+/* Small number unique to the calling thread, handed out on first use.
+ * Per-thread structures index their slots with it. */
+size_t hash_table_thread_index(void);
+
+/* Tells the core we are busy waiting, keeps spin loops off the memory bus */
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
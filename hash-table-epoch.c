@@ -0,0 +1,107 @@
+#include "hash-table-epoch.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//a slot tries to advance the epoch every time this many objects piled up
+#define EPOCH_ADVANCE_BATCH 64
+
+void epoch_init(struct epoch *epoch, void *context)
+{
+	memset(epoch, 0, sizeof(struct epoch));
+	epoch->context = context;
+	if (pthread_mutex_init(&epoch->advance_mutex, NULL) != 0) {
+		perror("pthread_mutex_init");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void lock_slot(struct epoch_slot *slot)
+{
+	while (atomic_exchange_explicit(&slot->locked, true, memory_order_acquire)) {
+		while (atomic_load_explicit(&slot->locked, memory_order_relaxed)) {
+			cpu_relax();
+		}
+	}
+}
+
+static void unlock_slot(struct epoch_slot *slot)
+{
+	atomic_store_explicit(&slot->locked, false, memory_order_release);
+}
+
+/* Called with the slot locked */
+static void reclaim_limbo(struct epoch *epoch, struct epoch_limbo *limbo)
+{
+	for (size_t i = 0; i < limbo->count; ++i) {
+		limbo->objects[i].reclaim(epoch->context, limbo->objects[i].object);
+	}
+	limbo->count = 0;
+}
+
+/* Moves the epoch on by one if no reader of the one before is left, and
+ * reclaims what was retired two epochs before the new one */
+static void try_advance(struct epoch *epoch)
+{
+	if (pthread_mutex_trylock(&epoch->advance_mutex) != 0) {
+		return;
+	}
+	size_t global = atomic_load(&epoch->global);
+	size_t previous = (global + EPOCH_BUCKETS - 1) % EPOCH_BUCKETS;
+	bool quiet = true;
+	for (size_t i = 0; i < EPOCH_SLOTS && quiet; ++i) {
+		quiet = atomic_load(&epoch->slots[i].readers[previous]) == 0;
+	}
+	if (quiet) {
+		atomic_store(&epoch->global, global + 1);
+		//global - 1 shares its bucket with global + 2
+		for (size_t i = 0; i < EPOCH_SLOTS; ++i) {
+			struct epoch_slot *slot = &epoch->slots[i];
+			lock_slot(slot);
+			reclaim_limbo(epoch, &slot->limbo[previous]);
+			unlock_slot(slot);
+		}
+	}
+	if (pthread_mutex_unlock(&epoch->advance_mutex) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void epoch_retire(struct epoch *epoch, void *object, epoch_reclaim reclaim)
+{
+	struct epoch_slot *slot = &epoch->slots[hash_table_thread_index() % EPOCH_SLOTS];
+	//the unlink has to be visible before the epoch it is retired in is read
+	atomic_thread_fence(memory_order_seq_cst);
+	lock_slot(slot);
+	struct epoch_limbo *limbo = &slot->limbo[atomic_load(&epoch->global) % EPOCH_BUCKETS];
+	if (limbo->count == limbo->capacity) {
+		limbo->capacity = limbo->capacity == 0 ? EPOCH_ADVANCE_BATCH : limbo->capacity * 2;
+		limbo->objects = realloc(limbo->objects, limbo->capacity * sizeof(struct epoch_retired));
+		assert(limbo->objects != NULL);
+	}
+	limbo->objects[limbo->count++] = (struct epoch_retired) { object, reclaim };
+	bool advance = limbo->count % EPOCH_ADVANCE_BATCH == 0;
+	unlock_slot(slot);
+
+	if (advance) {
+		try_advance(epoch);
+	}
+}
+
+void epoch_destroy(struct epoch *epoch)
+{
+	for (size_t i = 0; i < EPOCH_SLOTS; ++i) {
+		for (size_t j = 0; j < EPOCH_BUCKETS; ++j) {
+			struct epoch_limbo *limbo = &epoch->slots[i].limbo[j];
+			reclaim_limbo(epoch, limbo);
+			free(limbo->objects);
+		}
+	}
+	if (pthread_mutex_destroy(&epoch->advance_mutex) != 0) {
+		perror("pthread_mutex_destroy");
+		exit(EXIT_FAILURE);
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <pthread.h>
+
+/* Epoch based reclamation for memory that lock-free readers may still be
+ * walking. Readers bracket every access with epoch_enter and epoch_exit,
+ * writers unlink an object and then hand it to epoch_retire, which calls
+ * reclaim once every reader that could have seen it has left.
+ *
+ * Readers count themselves into one of three per-epoch counters of their
+ * thread's slot instead of publishing a per-thread epoch, so threads that
+ * share a slot stay correct. The global epoch only moves from e to e + 1
+ * once no reader of e - 1 is left, objects retired in e are reclaimed when
+ * it reaches e + 2. */
+#define EPOCH_SLOTS 64
+#define EPOCH_BUCKETS 3
+
+typedef void (*epoch_reclaim)(void *context, void *object);
+
+struct epoch_retired {
+	void *object;
+	epoch_reclaim reclaim;
+};
+
+struct epoch_limbo {
+	struct epoch_retired *objects;
+	size_t count;
+	size_t capacity;
+};
+
+struct epoch_slot {
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t readers[EPOCH_BUCKETS];
+	//guards limbo, retiring threads of this slot share it
+	atomic_bool locked;
+	//objects retired at epoch e wait in limbo[e % EPOCH_BUCKETS]
+	struct epoch_limbo limbo[EPOCH_BUCKETS];
+};
+
+struct epoch {
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t global;
+	//passed to every reclaim call
+	void *context;
+	//only one thread at a time advances the epoch and reclaims
+	pthread_mutex_t advance_mutex;
+	struct epoch_slot slots[EPOCH_SLOTS];
+};
+
+void epoch_init(struct epoch *epoch, void *context);
+
+/* Returns what epoch_exit needs, calls may nest */
+static inline size_t epoch_enter(struct epoch *epoch)
+{
+	size_t index = hash_table_thread_index() % EPOCH_SLOTS;
+	struct epoch_slot *slot = &epoch->slots[index];
+	while (true) {
+		size_t global = atomic_load(&epoch->global);
+		size_t bucket = global % EPOCH_BUCKETS;
+		atomic_fetch_add(&slot->readers[bucket], 1);
+		//only counts if the epoch didn't move on before we were counted,
+		//otherwise an advance may not have waited for us
+		if (atomic_load(&epoch->global) == global) {
+			return index * EPOCH_BUCKETS + bucket;
+		}
+		atomic_fetch_sub(&slot->readers[bucket], 1);
+	}
+}
+
+static inline void epoch_exit(struct epoch *epoch, size_t token)
+{
+	struct epoch_slot *slot = &epoch->slots[token / EPOCH_BUCKETS];
+	atomic_fetch_sub_explicit(&slot->readers[token % EPOCH_BUCKETS], 1, memory_order_release);
+}
+
+/* object has to be unreachable for readers that enter from now on */
+void epoch_retire(struct epoch *epoch, void *object, epoch_reclaim reclaim);
+/* Reclaims everything still retired, no reader may be inside */
+void epoch_destroy(struct epoch *epoch);
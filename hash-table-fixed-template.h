@@ -0,0 +1,257 @@
+/* One fixed width table, included by hash-table-fixed.c once per width with
+ * HASH_TABLE_FIXED_WIDTH defined. Everything it defines is named after the
+ * width, so the includes don't clash. */
+#ifndef HASH_TABLE_FIXED_WIDTH
+#error "define HASH_TABLE_FIXED_WIDTH before including this file"
+#endif
+
+#if HASH_TABLE_FIXED_WIDTH % 8 != 0
+#error "HASH_TABLE_FIXED_WIDTH has to be a multiple of 8"
+#endif
+
+#define FIXED_PASTE(a, b) a##b
+#define FIXED_EXPAND(a, b) FIXED_PASTE(a, b)
+//hash_table_fixed8 for a width of 8
+#define FIXED_TABLE FIXED_EXPAND(hash_table_fixed, HASH_TABLE_FIXED_WIDTH)
+//hash_table_fixed8_name
+#define FIXED(name) FIXED_EXPAND(FIXED_TABLE, _##name)
+#define FIXED_WORDS (HASH_TABLE_FIXED_WIDTH / 8)
+
+/* The key is inline behind the hash and value, so a probe that matches
+ * the hash compares bytes of the cache line it already loaded */
+struct FIXED(slot) {
+	atomic_uint_least32_t hash;
+	atomic_uint_least32_t value;
+	char key[HASH_TABLE_FIXED_WIDTH];
+};
+
+struct FIXED(slot_array) {
+	//always a power of two
+	size_t capacity;
+	struct FIXED(slot) slots[];
+};
+
+/* Writers lock a segment, readers never do. Like in v3 a segment only
+ * changes arrays by publishing a new, complete one and retiring the old
+ * one to the epoch. A key is written before the hash that makes its slot
+ * visible and never changes afterwards, removing only sets the hash to
+ * HASH_TABLE_FIXED_REMOVED. */
+struct FIXED(segment) {
+	_Alignas(CACHE_LINE_SIZE) struct FIXED(slot_array) *_Atomic slots;
+	//slots holding a key or a tombstone
+	size_t used;
+	//slots holding a key
+	size_t live;
+	pthread_mutex_t mutex;
+};
+
+struct FIXED_TABLE {
+	struct FIXED(segment) segments[HASH_TABLE_FIXED_SEGMENTS];
+	struct epoch epoch;
+};
+
+static struct FIXED(slot_array) *FIXED(slot_array_create)(size_t capacity)
+{
+	struct FIXED(slot_array) *array = calloc(1, sizeof(struct FIXED(slot_array))
+	                                            + capacity * sizeof(struct FIXED(slot)));
+	assert(array != NULL);
+	array->capacity = capacity;
+	return array;
+}
+
+struct FIXED_TABLE *FIXED(create)(void)
+{
+	struct FIXED_TABLE *hash_table = calloc(1, sizeof(struct FIXED_TABLE));
+	assert(hash_table != NULL);
+	for (size_t i = 0; i < HASH_TABLE_FIXED_SEGMENTS; ++i) {
+		struct FIXED(segment) *segment = &hash_table->segments[i];
+		atomic_init(&segment->slots,
+		            FIXED(slot_array_create)(HASH_TABLE_CAPACITY / HASH_TABLE_FIXED_SEGMENTS));
+		if (pthread_mutex_init(&segment->mutex, NULL) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+	}
+	epoch_init(&hash_table->epoch, hash_table);
+	return hash_table;
+}
+
+static struct FIXED(segment) *FIXED(get_segment)(struct FIXED_TABLE *hash_table, uint32_t hash)
+{
+	return &hash_table->segments[hash >> (32 - HASH_TABLE_FIXED_SEGMENT_BITS)];
+}
+
+/* Linear probe for the key, returns its slot or NULL once an empty slot
+ * ends the probe sequence. Found or not is decided by the one load of each
+ * slot's hash, an insert may fill the empty slot right after. */
+static struct FIXED(slot) *FIXED(get_slot)(struct FIXED(slot_array) *array,
+                                           const char *key,
+                                           uint32_t hash)
+{
+	size_t mask = array->capacity - 1;
+	size_t index = hash & mask;
+	while (true) {
+		struct FIXED(slot) *slot = &array->slots[index];
+		uint32_t slot_hash = atomic_load_explicit(&slot->hash, memory_order_acquire);
+		if (slot_hash == HASH_TABLE_FIXED_EMPTY) {
+			return NULL;
+		}
+		if (slot_hash == hash && fixed_equal(slot->key, key, FIXED_WORDS)) {
+			return slot;
+		}
+		index = (index + 1) & mask;
+	}
+}
+
+/* Called with the segment locked and the key known to be missing. Returns
+ * the empty slot that ends the key's probe sequence, the array always has
+ * one since it is rebuilt before it fills up. */
+static struct FIXED(slot) *FIXED(get_empty_slot)(struct FIXED(slot_array) *array, uint32_t hash)
+{
+	size_t mask = array->capacity - 1;
+	size_t index = hash & mask;
+	while (atomic_load_explicit(&array->slots[index].hash, memory_order_relaxed)
+	       != HASH_TABLE_FIXED_EMPTY) {
+		index = (index + 1) & mask;
+	}
+	return &array->slots[index];
+}
+
+/* Called with the segment locked. Copies the keys into a fresh array,
+ * twice the size unless tombstones rather than keys filled this one. */
+static void FIXED(rebuild_segment)(struct FIXED_TABLE *hash_table,
+                                   struct FIXED(segment) *segment)
+{
+	struct FIXED(slot_array) *array = atomic_load_explicit(&segment->slots,
+	                                                       memory_order_relaxed);
+	size_t capacity = array->capacity;
+	if (segment->live * 2 > capacity) {
+		capacity *= 2;
+	}
+	struct FIXED(slot_array) *next = FIXED(slot_array_create)(capacity);
+	for (size_t i = 0; i < array->capacity; ++i) {
+		struct FIXED(slot) *slot = &array->slots[i];
+		uint32_t hash = atomic_load_explicit(&slot->hash, memory_order_relaxed);
+		if (hash == HASH_TABLE_FIXED_EMPTY || hash == HASH_TABLE_FIXED_REMOVED) {
+			continue;
+		}
+		struct FIXED(slot) *destination = FIXED(get_empty_slot)(next, hash);
+		memcpy(destination->key, slot->key, HASH_TABLE_FIXED_WIDTH);
+		atomic_store_explicit(&destination->value,
+		                      atomic_load_explicit(&slot->value, memory_order_relaxed),
+		                      memory_order_relaxed);
+		atomic_store_explicit(&destination->hash, hash, memory_order_relaxed);
+	}
+	segment->used = segment->live;
+	atomic_store_explicit(&segment->slots, next, memory_order_release);
+	epoch_retire(&hash_table->epoch, array, reclaim_slot_array);
+}
+
+void FIXED(add_entry)(struct FIXED_TABLE *hash_table,
+                      const char *key,
+                      uint32_t value)
+{
+	assert(key != NULL);
+	uint32_t hash = fixed_hash(key, FIXED_WORDS);
+	struct FIXED(segment) *segment = FIXED(get_segment)(hash_table, hash);
+	lock_mutex(&segment->mutex);
+
+	struct FIXED(slot_array) *array = atomic_load_explicit(&segment->slots,
+	                                                       memory_order_relaxed);
+	struct FIXED(slot) *slot = FIXED(get_slot)(array, key, hash);
+
+	/* Update the value if it already exists */
+	if (slot != NULL) {
+		atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+		unlock_mutex(&segment->mutex);
+		return;
+	}
+
+	//fill in the slot before the hash makes it visible to readers
+	slot = FIXED(get_empty_slot)(array, hash);
+	memcpy(slot->key, key, HASH_TABLE_FIXED_WIDTH);
+	atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+	atomic_store_explicit(&slot->hash, hash, memory_order_release);
+
+	++segment->used;
+	++segment->live;
+	if (segment->used * HASH_TABLE_FIXED_MAX_LOAD_DENOMINATOR
+	    > array->capacity * HASH_TABLE_FIXED_MAX_LOAD_NUMERATOR) {
+		FIXED(rebuild_segment)(hash_table, segment);
+	}
+
+	unlock_mutex(&segment->mutex);
+}
+
+bool FIXED(contains)(struct FIXED_TABLE *hash_table,
+                     const char *key)
+{
+	assert(key != NULL);
+	uint32_t hash = fixed_hash(key, FIXED_WORDS);
+	struct FIXED(segment) *segment = FIXED(get_segment)(hash_table, hash);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct FIXED(slot_array) *array = atomic_load_explicit(&segment->slots,
+	                                                       memory_order_acquire);
+	bool found = FIXED(get_slot)(array, key, hash) != NULL;
+	epoch_exit(&hash_table->epoch, epoch);
+	return found;
+}
+
+uint32_t FIXED(get_value)(struct FIXED_TABLE *hash_table,
+                          const char *key)
+{
+	assert(key != NULL);
+	uint32_t hash = fixed_hash(key, FIXED_WORDS);
+	struct FIXED(segment) *segment = FIXED(get_segment)(hash_table, hash);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct FIXED(slot_array) *array = atomic_load_explicit(&segment->slots,
+	                                                       memory_order_acquire);
+	struct FIXED(slot) *slot = FIXED(get_slot)(array, key, hash);
+	assert(slot != NULL);
+	uint32_t value = atomic_load_explicit(&slot->value, memory_order_relaxed);
+	epoch_exit(&hash_table->epoch, epoch);
+	return value;
+}
+
+bool FIXED(remove)(struct FIXED_TABLE *hash_table,
+                   const char *key)
+{
+	assert(key != NULL);
+	uint32_t hash = fixed_hash(key, FIXED_WORDS);
+	struct FIXED(segment) *segment = FIXED(get_segment)(hash_table, hash);
+	lock_mutex(&segment->mutex);
+
+	struct FIXED(slot_array) *array = atomic_load_explicit(&segment->slots,
+	                                                       memory_order_relaxed);
+	struct FIXED(slot) *slot = FIXED(get_slot)(array, key, hash);
+	bool found = slot != NULL;
+	//the key bytes stay, a reader that already matched the hash may still
+	//compare against them
+	if (found) {
+		atomic_store_explicit(&slot->hash, HASH_TABLE_FIXED_REMOVED, memory_order_release);
+		--segment->live;
+	}
+
+	unlock_mutex(&segment->mutex);
+	return found;
+}
+
+void FIXED(destroy)(struct FIXED_TABLE *hash_table)
+{
+	epoch_destroy(&hash_table->epoch);
+	for (size_t i = 0; i < HASH_TABLE_FIXED_SEGMENTS; ++i) {
+		struct FIXED(segment) *segment = &hash_table->segments[i];
+		free(atomic_load(&segment->slots));
+		if (pthread_mutex_destroy(&segment->mutex) != 0) {
+			perror("pthread_mutex_destroy");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(hash_table);
+}
+
+#undef FIXED_PASTE
+#undef FIXED_EXPAND
+#undef FIXED
+#undef FIXED_TABLE
+#undef FIXED_WORDS
@@ -0,0 +1,91 @@
+#include "hash-table-fixed.h"
+
+#include "hash-table-epoch.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+//the top bits of the hash pick a segment, the low bits a slot inside it
+#define HASH_TABLE_FIXED_SEGMENT_BITS 6
+#define HASH_TABLE_FIXED_SEGMENTS (1 << HASH_TABLE_FIXED_SEGMENT_BITS)
+//a segment doubles once it is more than 3/4 full
+#define HASH_TABLE_FIXED_MAX_LOAD_NUMERATOR 3
+#define HASH_TABLE_FIXED_MAX_LOAD_DENOMINATOR 4
+
+//stored hashes 0 and 1 are reserved for empty and removed slots
+#define HASH_TABLE_FIXED_EMPTY 0
+#define HASH_TABLE_FIXED_REMOVED 1
+
+static inline uint64_t load_word(const char *key, size_t word)
+{
+	uint64_t value;
+	memcpy(&value, key + word * sizeof(uint64_t), sizeof(uint64_t));
+	return value;
+}
+
+/* Multiplies every word in, then runs the splitmix64 finalizer so the top
+ * bits that pick the segment depend on all of the key. words is a
+ * constant in every caller, so the loop unrolls into straight line code. */
+static inline uint32_t fixed_hash(const char *key, size_t words)
+{
+	uint64_t hash = 0x9e3779b97f4a7c15ull;
+	for (size_t i = 0; i < words; ++i) {
+		hash = (hash ^ load_word(key, i)) * 0xff51afd7ed558ccdull;
+	}
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+	hash ^= hash >> 31;
+	uint32_t folded = hash >> 32;
+	/* 0 and 1 are reserved for empty and removed slots */
+	return folded > HASH_TABLE_FIXED_REMOVED ? folded : folded + 2;
+}
+
+/* Ors the differences of all words together instead of stopping at the
+ * first one that differs, a single compare for 8 byte keys */
+static inline bool fixed_equal(const char *a, const char *b, size_t words)
+{
+	uint64_t difference = 0;
+	for (size_t i = 0; i < words; ++i) {
+		difference |= load_word(a, i) ^ load_word(b, i);
+	}
+	return difference == 0;
+}
+
+static void lock_mutex(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_lock(mutex) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_mutex(pthread_mutex_t *mutex)
+{
+	if (pthread_mutex_unlock(mutex) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void reclaim_slot_array(void *context, void *object)
+{
+	(void) context;
+	free(object);
+}
+
+#define HASH_TABLE_FIXED_WIDTH 8
+#include "hash-table-fixed-template.h"
+#undef HASH_TABLE_FIXED_WIDTH
+
+#define HASH_TABLE_FIXED_WIDTH 16
+#include "hash-table-fixed-template.h"
+#undef HASH_TABLE_FIXED_WIDTH
+
+#define HASH_TABLE_FIXED_WIDTH 32
+#include "hash-table-fixed-template.h"
+#undef HASH_TABLE_FIXED_WIDTH
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+
+/* Tables for keys that are all exactly the same width. The API is the one
+ * of hash_table_v2, but key always points at width bytes, shorter keys have
+ * to be NUL padded by the caller. Keys are copied into the slots, so a
+ * probe compares whole words instead of calling strcmp and hashing never
+ * looks for a terminator. Built like v3: locked segments of linear probing
+ * slots that readers walk without a lock. */
+#define HASH_TABLE_FIXED_DECLARE(width)                                                          \
+	struct hash_table_fixed##width;                                                          \
+	struct hash_table_fixed##width *hash_table_fixed##width##_create(void);                  \
+	void hash_table_fixed##width##_add_entry(struct hash_table_fixed##width *hash_table,     \
+	                                         const char *key,                                \
+	                                         uint32_t value);                                \
+	bool hash_table_fixed##width##_contains(struct hash_table_fixed##width *hash_table,      \
+	                                        const char *key);                                \
+	uint32_t hash_table_fixed##width##_get_value(struct hash_table_fixed##width *hash_table, \
+	                                             const char *key);                           \
+	/* Returns false if the key wasn't there */                                              \
+	bool hash_table_fixed##width##_remove(struct hash_table_fixed##width *hash_table,        \
+	                                      const char *key);                                  \
+	void hash_table_fixed##width##_destroy(struct hash_table_fixed##width *hash_table);
+
+HASH_TABLE_FIXED_DECLARE(8)
+HASH_TABLE_FIXED_DECLARE(16)
+HASH_TABLE_FIXED_DECLARE(32)
@@ -0,0 +1,356 @@
+#include "hash-table-keys.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//what KEYS_RANDOM keys take, 7 letters and the NUL
+#define RANDOM_KEY_BYTES 8
+//longest generated key with its NUL
+#define GENERATED_KEY_BYTES 64
+//what key_set_read asks read for at once
+#define READ_BLOCK_SIZE (1 << 20)
+
+const char *key_distribution_names[] = {
+	[KEYS_RANDOM] = "random",
+	[KEYS_SEQUENTIAL] = "sequential",
+	[KEYS_SHARED_PREFIX] = "shared-prefix",
+	[KEYS_ZIPF] = "zipf",
+};
+
+static const char *shared_prefixes[] = {
+	"com.example.accounts.session/",
+	"com.example.accounts.profile.avatar/",
+	"com.example.billing.invoices.2024/",
+	"/var/cache/objects/",
+	"https://api.example.org/v2/items/",
+	"tenant-0042:orders:",
+};
+
+#define SHARED_PREFIXES (sizeof(shared_prefixes) / sizeof(shared_prefixes[0]))
+
+/* splitmix64, a bijection, so distinct ranks stay distinct. Also expands
+ * a seed into the xoshiro state. */
+static uint64_t mix(uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ull;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
+/* xoshiro256**, one per slice */
+struct random {
+	uint64_t s[4];
+};
+
+static void random_seed(struct random *random, uint64_t seed)
+{
+	for (size_t i = 0; i < 4; ++i) {
+		seed = mix(seed);
+		random->s[i] = seed;
+	}
+}
+
+static uint64_t rotate_left(uint64_t x, int bits)
+{
+	return (x << bits) | (x >> (64 - bits));
+}
+
+static uint64_t next_random(struct random *random)
+{
+	uint64_t *s = random->s;
+	uint64_t result = rotate_left(s[1] * 5, 7) * 9;
+	uint64_t t = s[1] << 17;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = rotate_left(s[3], 45);
+	return result;
+}
+
+/* Cumulative Zipf probabilities of ranks 0 to count - 1 */
+static double *zipf_cdf(size_t count, double exponent)
+{
+	double *cdf = malloc(count * sizeof(double));
+	assert(cdf != NULL);
+	double sum = 0;
+	for (size_t i = 0; i < count; ++i) {
+		sum += pow(i + 1, -exponent);
+		cdf[i] = sum;
+	}
+	for (size_t i = 0; i < count; ++i) {
+		cdf[i] /= sum;
+	}
+	return cdf;
+}
+
+static size_t zipf_rank(const double *cdf, size_t count, struct random *random)
+{
+	double u = (next_random(random) >> 11) * 0x1p-53;
+	size_t low = 0;
+	size_t high = count - 1;
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+		if (cdf[middle] < u) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	return low;
+}
+
+void key_set_create(struct key_set *set,
+                    enum key_distribution distribution,
+                    size_t count,
+                    size_t slices,
+                    double zipf_exponent)
+{
+	assert(slices > 0);
+	memset(set, 0, sizeof(struct key_set));
+	set->count = count;
+	set->distribution = distribution;
+	//malloc rather than calloc, every slice first touches its own part
+	set->keys = malloc(count * sizeof(char *) + 1);
+	assert(set->keys != NULL);
+	set->slice_count = slices;
+	set->slices = calloc(slices, sizeof(char *));
+	assert(set->slices != NULL);
+	if (distribution == KEYS_ZIPF && count > 0) {
+		set->zipf_cdf = zipf_cdf(count, zipf_exponent);
+	}
+}
+
+static void generate_random(struct key_set *set, size_t slice, size_t first, size_t end,
+                            struct random *random)
+{
+	char *storage = malloc((end - first) * RANDOM_KEY_BYTES);
+	assert(storage != NULL);
+	set->slices[slice] = storage;
+	for (size_t i = first; i < end; ++i) {
+		char *string = storage + (i - first) * RANDOM_KEY_BYTES;
+		//every letter takes the top of x * 52 as its digit, one draw
+		//has enough bits for the whole key
+		uint64_t x = next_random(random);
+		for (uint32_t k = 0; k < (RANDOM_KEY_BYTES - 1); ++k) {
+			unsigned __int128 product = (unsigned __int128) x * 52;
+			int r = product >> 64;
+			x = product;
+			if (r < 26) {
+				string[k] = r + 0x41;
+			}
+			else {
+				string[k] = r + 0x47;
+			}
+		}
+		string[RANDOM_KEY_BYTES - 1] = 0;
+		set->keys[i] = string;
+	}
+}
+
+void key_set_generate_slice(struct key_set *set, size_t slice, uint64_t seed)
+{
+	size_t first = slice * set->count / set->slice_count;
+	size_t end = (slice + 1) * set->count / set->slice_count;
+	struct random random;
+	random_seed(&random, seed ^ mix(slice));
+	if (set->distribution == KEYS_RANDOM) {
+		generate_random(set, slice, first, end, &random);
+		return;
+	}
+
+	//keys are appended to storage, which may move, so offsets are kept
+	//until it is complete
+	size_t *offsets = malloc((end - first) * sizeof(size_t) + 1);
+	assert(offsets != NULL);
+	size_t capacity = (end - first) * 16 + GENERATED_KEY_BYTES;
+	size_t size = 0;
+	char *storage = malloc(capacity);
+	assert(storage != NULL);
+	for (size_t i = first; i < end; ++i) {
+		if (capacity - size < GENERATED_KEY_BYTES) {
+			capacity *= 2;
+			storage = realloc(storage, capacity);
+			assert(storage != NULL);
+		}
+		char *string = storage + size;
+		int length = 0;
+		switch (set->distribution) {
+		case KEYS_RANDOM:
+			break;
+		case KEYS_SEQUENTIAL:
+			length = snprintf(string, GENERATED_KEY_BYTES, "%zu", i);
+			break;
+		case KEYS_SHARED_PREFIX:
+			length = snprintf(string, GENERATED_KEY_BYTES, "%s%zu",
+			                  shared_prefixes[next_random(&random) % SHARED_PREFIXES], i);
+			break;
+		case KEYS_ZIPF:
+			//ranks are scattered so the popular keys aren't neighbours
+			length = snprintf(string, GENERATED_KEY_BYTES, "%" PRIx64,
+			                  mix(zipf_rank(set->zipf_cdf, set->count, &random) ^ seed));
+			break;
+		}
+		offsets[i - first] = size;
+		size += length + 1;
+	}
+	for (size_t i = first; i < end; ++i) {
+		set->keys[i] = storage + offsets[i - first];
+	}
+	set->slices[slice] = storage;
+	free(offsets);
+}
+
+void key_set_generated(struct key_set *set)
+{
+	free(set->zipf_cdf);
+	set->zipf_cdf = NULL;
+}
+
+/* Cuts storage into keys where the newlines are */
+static void split_lines(struct key_set *set, size_t limit)
+{
+	size_t capacity = 0;
+	char *line = set->storage;
+	char *end = set->storage + set->storage_size;
+	while (line < end && (limit == 0 || set->count < limit)) {
+		char *newline = memchr(line, '\n', end - line);
+		char *next = newline != NULL ? newline + 1 : end;
+		char *stop = newline != NULL ? newline : end;
+		if (stop > line && stop[-1] == '\r') {
+			--stop;
+		}
+		if (stop > line) {
+			if (set->count == capacity) {
+				capacity = capacity == 0 ? 4096 : capacity * 2;
+				set->keys = realloc(set->keys, capacity * sizeof(char *));
+				assert(set->keys != NULL);
+			}
+			if (stop == end && set->mapped) {
+				//a mapping is zero filled to the end of its last page,
+				//unless the file ends right at a page boundary
+				if ((set->storage_size % sysconf(_SC_PAGESIZE)) != 0) {
+					set->keys[set->count++] = line;
+					break;
+				}
+				set->tail = strndup(line, stop - line);
+				assert(set->tail != NULL);
+				set->keys[set->count++] = set->tail;
+				break;
+			}
+			*stop = 0;
+			set->keys[set->count++] = line;
+		}
+		line = next;
+	}
+}
+
+/* Reads everything fd has left into a growing heap buffer, with a spare
+ * byte to terminate the last key */
+static int read_all(struct key_set *set, int fd)
+{
+	size_t capacity = READ_BLOCK_SIZE;
+	set->storage = malloc(capacity + 1);
+	assert(set->storage != NULL);
+	while (true) {
+		if (capacity - set->storage_size < READ_BLOCK_SIZE) {
+			capacity *= 2;
+			set->storage = realloc(set->storage, capacity + 1);
+			assert(set->storage != NULL);
+		}
+		ssize_t length = read(fd, set->storage + set->storage_size, READ_BLOCK_SIZE);
+		if (length < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+		if (length == 0) {
+			break;
+		}
+		set->storage_size += length;
+	}
+	set->storage[set->storage_size] = 0;
+	return 0;
+}
+
+int key_set_read(struct key_set *set, const char *path, size_t limit)
+{
+	memset(set, 0, sizeof(struct key_set));
+	bool standard_input = strcmp(path, "-") == 0;
+	int fd = standard_input ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd < 0) {
+		return errno;
+	}
+
+	int err = 0;
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		err = errno;
+	}
+	else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		//private, so the NULs we write never reach the file
+		void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (mapping == MAP_FAILED) {
+			err = errno;
+		}
+		else {
+			madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+			set->storage = mapping;
+			set->storage_size = st.st_size;
+			set->mapped = true;
+		}
+	}
+	else {
+		err = read_all(set, fd);
+	}
+	if (!standard_input) {
+		close(fd);
+	}
+	if (err == 0) {
+		split_lines(set, limit);
+	}
+	else {
+		key_set_destroy(set);
+	}
+	return err;
+}
+
+size_t key_set_bytes(const struct key_set *set)
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < set->count; ++i) {
+		bytes += strlen(set->keys[i]);
+	}
+	return bytes;
+}
+
+void key_set_destroy(struct key_set *set)
+{
+	if (set->mapped) {
+		munmap(set->storage, set->storage_size);
+	}
+	else {
+		free(set->storage);
+	}
+	for (size_t i = 0; i < set->slice_count; ++i) {
+		free(set->slices[i]);
+	}
+	free(set->slices);
+	free(set->zipf_cdf);
+	free(set->tail);
+	free(set->keys);
+	memset(set, 0, sizeof(struct key_set));
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The keys the tester feeds to the tables, either generated or read from a
+ * file. Every key is NUL terminated and stays where it is until
+ * key_set_destroy, so tables that don't copy keys can point into it. */
+enum key_distribution {
+	/* 7 random letters */
+	KEYS_RANDOM,
+	/* The decimal numbers 0, 1, 2, ... */
+	KEYS_SEQUENTIAL,
+	/* A number behind one of a few long, path like prefixes */
+	KEYS_SHARED_PREFIX,
+	/* Zipf distributed draws from as many distinct keys as are drawn, so
+	 * the popular ones repeat */
+	KEYS_ZIPF,
+};
+
+extern const char *key_distribution_names[];
+#define KEY_DISTRIBUTIONS 4
+
+struct key_set {
+	char **keys;
+	size_t count;
+	//generated keys live in one buffer per slice
+	char **slices;
+	size_t slice_count;
+	enum key_distribution distribution;
+	//only while generating zipf keys
+	double *zipf_cdf;
+	//read keys point into a heap buffer or the mapped file
+	char *storage;
+	size_t storage_size;
+	bool mapped;
+	//the last key of a mapped file that ends on a page boundary without a
+	//newline, there is no byte left in the mapping to terminate it
+	char *tail;
+};
+
+/* Sets up count keys in slices equal slices, which key_set_generate_slice
+ * fills. zipf_exponent is only used by KEYS_ZIPF, 1.0 is the classic skew. */
+void key_set_create(struct key_set *set,
+                    enum key_distribution distribution,
+                    size_t count,
+                    size_t slices,
+                    double zipf_exponent);
+/* Generates keys[slice * count / slices] up to the first key of the next
+ * slice from its own seeded generator, so the keys only depend on seed and
+ * the number of slices. Slices can be generated concurrently, the memory
+ * of a slice is first touched by the thread that generates it. */
+void key_set_generate_slice(struct key_set *set, size_t slice, uint64_t seed);
+/* Drops what only generation needed, call once every slice is generated */
+void key_set_generated(struct key_set *set);
+/* Reads newline separated keys from path, "-" reads stdin, and stops after
+ * limit keys unless limit is 0. Regular files are mapped copy-on-write and
+ * every newline becomes the NUL of the key before it, anything else is
+ * read in large blocks and split the same way. Empty lines are skipped and
+ * a '\r' before the newline is dropped. Returns 0 or an errno value. */
+int key_set_read(struct key_set *set, const char *path, size_t limit);
+/* Length of all keys together, without their terminators */
+size_t key_set_bytes(const struct key_set *set);
+void key_set_destroy(struct key_set *set);
@@ -0,0 +1,292 @@
+#include "hash-table-lock.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+//most spins an adaptive waiter tries before it sleeps
+#define HASH_TABLE_LOCK_MAX_SPINS 1000
+//spins an MCS waiter tries on its node before it sleeps
+#define HASH_TABLE_LOCK_MCS_SPINS 200
+//MCS locks one thread can hold at the same time
+#define HASH_TABLE_LOCK_MCS_NODES 8
+
+struct hash_table_mcs_node {
+	_Alignas(CACHE_LINE_SIZE) struct hash_table_mcs_node *_Atomic next;
+	//1 while waiting, 2 once asleep, 0 when handed the lock
+	atomic_uint waiting;
+};
+
+//a thread's queue nodes, used marks the ones in a line or holding a lock
+static _Thread_local struct hash_table_mcs_node mcs_nodes[HASH_TABLE_LOCK_MCS_NODES];
+static _Thread_local unsigned mcs_used;
+
+/* Sleeps while *word is value, every caller checks its condition again
+ * after returning. Without futexes it only yields. */
+static void futex_wait(atomic_uint *word, unsigned value)
+{
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+#else
+	(void) word;
+	(void) value;
+	sched_yield();
+#endif
+}
+
+/* word may already belong to a thread that stopped waiting, a spurious
+ * wake up is harmless since every waiter checks again */
+static void futex_wake(atomic_uint *word)
+{
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	(void) word;
+#endif
+}
+
+static bool adaptive_try(struct hash_table_adaptive_lock *lock)
+{
+	unsigned expected = 0;
+	return atomic_compare_exchange_strong_explicit(&lock->state, &expected, 1,
+	                                               memory_order_acquire,
+	                                               memory_order_relaxed);
+}
+
+/* The spin limit follows the spins recent waits needed, like glibc's
+ * adaptive mutexes. Sleepers mark the lock 2 so the holder wakes one. */
+static bool adaptive_acquire(struct hash_table_adaptive_lock *lock)
+{
+	if (adaptive_try(lock)) {
+		return false;
+	}
+	unsigned limit = atomic_load_explicit(&lock->spins, memory_order_relaxed);
+	unsigned max_spins = limit * 2 + 10;
+	if (max_spins > HASH_TABLE_LOCK_MAX_SPINS) {
+		max_spins = HASH_TABLE_LOCK_MAX_SPINS;
+	}
+	unsigned spun = 0;
+	bool acquired = false;
+	while (spun < max_spins && !acquired) {
+		++spun;
+		cpu_relax();
+		acquired = atomic_load_explicit(&lock->state, memory_order_relaxed) == 0
+		           && adaptive_try(lock);
+	}
+	if (!acquired) {
+		while (atomic_exchange_explicit(&lock->state, 2, memory_order_acquire) != 0) {
+			futex_wait(&lock->state, 2);
+		}
+	}
+	atomic_store_explicit(&lock->spins, limit + ((int) spun - (int) limit) / 8,
+	                      memory_order_relaxed);
+	return true;
+}
+
+static void adaptive_release(struct hash_table_adaptive_lock *lock)
+{
+	if (atomic_exchange_explicit(&lock->state, 0, memory_order_release) == 2) {
+		futex_wake(&lock->state);
+	}
+}
+
+static struct hash_table_mcs_node *take_mcs_node(void)
+{
+	//checked even without asserts, a ninth node would be past the array
+	if (mcs_used == (1u << HASH_TABLE_LOCK_MCS_NODES) - 1) {
+		fprintf(stderr, "hash_table_lock: a thread holds more than %d MCS locks\n",
+		        HASH_TABLE_LOCK_MCS_NODES);
+		abort();
+	}
+	unsigned index = __builtin_ctz(~mcs_used);
+	mcs_used |= 1u << index;
+	struct hash_table_mcs_node *node = &mcs_nodes[index];
+	atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+	atomic_store_explicit(&node->waiting, 1, memory_order_relaxed);
+	return node;
+}
+
+static void put_mcs_node(struct hash_table_mcs_node *node)
+{
+	mcs_used &= ~(1u << (node - mcs_nodes));
+}
+
+static bool mcs_try(struct hash_table_mcs_lock *lock)
+{
+	struct hash_table_mcs_node *node = take_mcs_node();
+	struct hash_table_mcs_node *expected = NULL;
+	if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, node,
+	                                            memory_order_acquire,
+	                                            memory_order_relaxed)) {
+		lock->owner = node;
+		return true;
+	}
+	put_mcs_node(node);
+	return false;
+}
+
+static bool mcs_acquire(struct hash_table_mcs_lock *lock)
+{
+	struct hash_table_mcs_node *node = take_mcs_node();
+	struct hash_table_mcs_node *previous = atomic_exchange_explicit(&lock->tail, node,
+	                                                                memory_order_acq_rel);
+	if (previous != NULL) {
+		atomic_store_explicit(&previous->next, node, memory_order_release);
+		unsigned spun = 0;
+		while (atomic_load_explicit(&node->waiting, memory_order_acquire) != 0) {
+			if (spun < HASH_TABLE_LOCK_MCS_SPINS) {
+				++spun;
+				cpu_relax();
+				continue;
+			}
+			unsigned expected = 1;
+			if (atomic_compare_exchange_strong_explicit(&node->waiting, &expected, 2,
+			                                            memory_order_relaxed,
+			                                            memory_order_relaxed)
+			    || expected == 2) {
+				futex_wait(&node->waiting, 2);
+			}
+		}
+	}
+	lock->owner = node;
+	return previous != NULL;
+}
+
+static void mcs_release(struct hash_table_mcs_lock *lock)
+{
+	struct hash_table_mcs_node *node = lock->owner;
+	struct hash_table_mcs_node *next = atomic_load_explicit(&node->next, memory_order_acquire);
+	if (next == NULL) {
+		struct hash_table_mcs_node *expected = node;
+		if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, NULL,
+		                                            memory_order_release,
+		                                            memory_order_relaxed)) {
+			put_mcs_node(node);
+			return;
+		}
+		//a waiter swapped itself in but hasn't linked up yet
+		while ((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL) {
+			cpu_relax();
+		}
+	}
+	if (atomic_exchange_explicit(&next->waiting, 0, memory_order_release) == 2) {
+		futex_wake(&next->waiting);
+	}
+	put_mcs_node(node);
+}
+
+void hash_table_lock_init(struct hash_table_lock *lock, enum hash_table_lock_kind kind)
+{
+	switch (kind) {
+	case HASH_TABLE_LOCK_MUTEX:
+		if(pthread_mutex_init(&lock->mutex, NULL) != 0){
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case HASH_TABLE_LOCK_SPINLOCK:
+		atomic_init(&lock->spinlock, false);
+		break;
+	case HASH_TABLE_LOCK_ADAPTIVE:
+		atomic_init(&lock->adaptive.state, 0);
+		atomic_init(&lock->adaptive.spins, 0);
+		break;
+	case HASH_TABLE_LOCK_MCS:
+		atomic_init(&lock->mcs.tail, NULL);
+		lock->mcs.owner = NULL;
+		break;
+	}
+}
+
+void hash_table_lock_destroy(struct hash_table_lock *lock, enum hash_table_lock_kind kind)
+{
+	switch (kind) {
+	case HASH_TABLE_LOCK_MUTEX:
+		if(pthread_mutex_destroy(&lock->mutex) != 0){
+			perror("pthread_mutex_destroy");
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case HASH_TABLE_LOCK_SPINLOCK:
+	case HASH_TABLE_LOCK_ADAPTIVE:
+	case HASH_TABLE_LOCK_MCS:
+		break;
+	}
+}
+
+bool hash_table_lock_try(struct hash_table_lock *lock, enum hash_table_lock_kind kind)
+{
+	switch (kind) {
+	case HASH_TABLE_LOCK_MUTEX:
+		return pthread_mutex_trylock(&lock->mutex) == 0;
+	case HASH_TABLE_LOCK_SPINLOCK:
+		return !atomic_exchange_explicit(&lock->spinlock, true, memory_order_acquire);
+	case HASH_TABLE_LOCK_ADAPTIVE:
+		return adaptive_try(&lock->adaptive);
+	case HASH_TABLE_LOCK_MCS:
+		return mcs_try(&lock->mcs);
+	}
+	return false;
+}
+
+bool hash_table_lock_acquire(struct hash_table_lock *lock, enum hash_table_lock_kind kind)
+{
+	bool contended = false;
+	switch (kind) {
+	case HASH_TABLE_LOCK_MUTEX:
+		if (pthread_mutex_trylock(&lock->mutex) == 0) {
+			break;
+		}
+		contended = true;
+		if(pthread_mutex_lock(&lock->mutex) != 0){
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case HASH_TABLE_LOCK_SPINLOCK:
+		//test and test-and-set, waiters spin on a shared line instead of
+		//hammering it with exchanges
+		while (atomic_exchange_explicit(&lock->spinlock, true, memory_order_acquire)) {
+			contended = true;
+			while (atomic_load_explicit(&lock->spinlock, memory_order_relaxed)) {
+				cpu_relax();
+			}
+		}
+		break;
+	case HASH_TABLE_LOCK_ADAPTIVE:
+		contended = adaptive_acquire(&lock->adaptive);
+		break;
+	case HASH_TABLE_LOCK_MCS:
+		contended = mcs_acquire(&lock->mcs);
+		break;
+	}
+	return contended;
+}
+
+void hash_table_lock_release(struct hash_table_lock *lock, enum hash_table_lock_kind kind)
+{
+	switch (kind) {
+	case HASH_TABLE_LOCK_MUTEX:
+		if(pthread_mutex_unlock(&lock->mutex) != 0){
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case HASH_TABLE_LOCK_SPINLOCK:
+		atomic_store_explicit(&lock->spinlock, false, memory_order_release);
+		break;
+	case HASH_TABLE_LOCK_ADAPTIVE:
+		adaptive_release(&lock->adaptive);
+		break;
+	case HASH_TABLE_LOCK_MCS:
+		mcs_release(&lock->mcs);
+		break;
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/* The locks v1 and v2 can guard their writers with. Locks are always
+ * released by the thread that took them. */
+enum hash_table_lock_kind {
+	HASH_TABLE_LOCK_MUTEX,
+	/* Test and test-and-set, waiters never sleep */
+	HASH_TABLE_LOCK_SPINLOCK,
+	/* Waiters spin about as long as the last waits took, then sleep on a
+	 * futex, so short critical sections never pay for a syscall and long
+	 * waits don't burn a cpu */
+	HASH_TABLE_LOCK_ADAPTIVE,
+	/* MCS queue lock: waiters line up in arrival order and each spins,
+	 * then sleeps, on its own node, so handing the lock over only touches
+	 * the next waiter's cache line */
+	HASH_TABLE_LOCK_MCS,
+};
+
+struct hash_table_adaptive_lock {
+	//0 free, 1 held, 2 held and someone may be asleep
+	atomic_uint state;
+	//spins a waiter tries before it sleeps, moves towards what recent
+	//waits needed
+	atomic_uint spins;
+};
+
+struct hash_table_mcs_node;
+
+struct hash_table_mcs_lock {
+	//the last waiter in line, NULL while the lock is free
+	struct hash_table_mcs_node *_Atomic tail;
+	//the holder's node, only the holder touches it
+	struct hash_table_mcs_node *owner;
+};
+
+struct hash_table_lock {
+	union {
+		pthread_mutex_t mutex;
+		atomic_bool spinlock;
+		struct hash_table_adaptive_lock adaptive;
+		struct hash_table_mcs_lock mcs;
+	};
+};
+
+void hash_table_lock_init(struct hash_table_lock *lock, enum hash_table_lock_kind kind);
+void hash_table_lock_destroy(struct hash_table_lock *lock, enum hash_table_lock_kind kind);
+/* Returns false without waiting if the lock is held */
+bool hash_table_lock_try(struct hash_table_lock *lock, enum hash_table_lock_kind kind);
+/* Returns true if the lock was held when asked, so callers can count
+ * their contention without a separate try */
+bool hash_table_lock_acquire(struct hash_table_lock *lock, enum hash_table_lock_kind kind);
+void hash_table_lock_release(struct hash_table_lock *lock, enum hash_table_lock_kind kind);
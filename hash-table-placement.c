@@ -0,0 +1,282 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "hash-table-placement.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+const char *placement_policy_names[] = {
+	[PLACEMENT_NONE] = "none",
+	[PLACEMENT_COMPACT] = "compact",
+	[PLACEMENT_ROUND_ROBIN] = "round-robin",
+};
+
+const char *placement_memory_names[] = {
+	[PLACEMENT_MEMORY_FIRST_TOUCH] = "first-touch",
+	[PLACEMENT_MEMORY_INTERLEAVE] = "interleave",
+};
+
+void placement_describe(const struct placement *placement, char *buffer, size_t size)
+{
+	if (placement->pin != PLACEMENT_NONE) {
+		snprintf(buffer, size, "pin %s with %s memory",
+		         placement_policy_names[placement->pin],
+		         placement_memory_names[placement->memory]);
+	}
+	else if (placement->numa != PLACEMENT_NONE) {
+		snprintf(buffer, size, "numa %s with %s memory",
+		         placement_policy_names[placement->numa],
+		         placement_memory_names[placement->memory]);
+	}
+	else {
+		snprintf(buffer, size, "scheduler with %s memory",
+		         placement_memory_names[placement->memory]);
+	}
+}
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#define PLACEMENT_MAX_NODES 1024
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+/* The cpus we may run on sorted by node, so the cpus of node n are
+ * cpus[node_first[n]] to cpus[node_first[n] + node_cpus[n] - 1]. Nodes
+ * without any of our cpus are left out. */
+static int cpus[CPU_SETSIZE];
+static size_t cpu_count;
+static int node_ids[PLACEMENT_MAX_NODES];
+static size_t node_first[PLACEMENT_MAX_NODES];
+static size_t node_cpus[PLACEMENT_MAX_NODES];
+static size_t node_count;
+
+/* Parses a sysfs cpu list like "0-3,8,10-11" */
+static void parse_cpu_list(const char *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	while (*list != 0 && *list != '\n') {
+		char *end;
+		long first = strtol(list, &end, 10);
+		long last = first;
+		if (*end == '-') {
+			last = strtol(end + 1, &end, 10);
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+			CPU_SET(cpu, set);
+		}
+		if (end == list) {
+			break;
+		}
+		list = *end == ',' ? end + 1 : end;
+	}
+}
+
+static bool read_node_cpus(int node, cpu_set_t *set)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *file = fopen(path, "r");
+	if (file == NULL) {
+		return false;
+	}
+	char list[4096];
+	bool read = fgets(list, sizeof(list), file) != NULL;
+	fclose(file);
+	if (read) {
+		parse_cpu_list(list, set);
+	}
+	return read;
+}
+
+static void add_node(int node, const cpu_set_t *node_set, cpu_set_t *remaining)
+{
+	node_ids[node_count] = node;
+	node_first[node_count] = cpu_count;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, node_set) && CPU_ISSET(cpu, remaining)) {
+			cpus[cpu_count++] = cpu;
+			CPU_CLR(cpu, remaining);
+		}
+	}
+	node_cpus[node_count] = cpu_count - node_first[node_count];
+	if (node_cpus[node_count] > 0) {
+		++node_count;
+	}
+}
+
+bool placement_init(void)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		perror("sched_getaffinity");
+		return false;
+	}
+	cpu_count = 0;
+	node_count = 0;
+
+	DIR *directory = opendir("/sys/devices/system/node");
+	if (directory != NULL) {
+		struct dirent *entry;
+		while ((entry = readdir(directory)) != NULL && node_count < PLACEMENT_MAX_NODES) {
+			int node;
+			cpu_set_t node_set;
+			if (sscanf(entry->d_name, "node%d", &node) == 1 && node < PLACEMENT_MAX_NODES
+			    && read_node_cpus(node, &node_set)) {
+				add_node(node, &node_set, &allowed);
+			}
+		}
+		closedir(directory);
+	}
+	//no sysfs node information, or cpus no node claimed: treat them as
+	//one more node so every cpu can still be pinned
+	if (CPU_COUNT(&allowed) > 0 && node_count < PLACEMENT_MAX_NODES) {
+		cpu_set_t rest = allowed;
+		add_node(node_count == 0 ? 0 : -1, &rest, &allowed);
+	}
+	return cpu_count > 0;
+}
+
+size_t placement_cpus(void)
+{
+	return cpu_count;
+}
+
+size_t placement_nodes(void)
+{
+	return node_count;
+}
+
+int placement_apply_memory(const struct placement *placement)
+{
+	unsigned long mask[PLACEMENT_MAX_NODES / BITS_PER_WORD] = { 0 };
+	int mode = MPOL_DEFAULT;
+	if (placement->memory == PLACEMENT_MEMORY_INTERLEAVE) {
+		mode = MPOL_INTERLEAVE;
+		for (size_t i = 0; i < node_count; ++i) {
+			if (node_ids[i] >= 0) {
+				mask[node_ids[i] / BITS_PER_WORD] |= 1ul << (node_ids[i] % BITS_PER_WORD);
+			}
+		}
+	}
+	if (syscall(SYS_set_mempolicy, mode, mode == MPOL_DEFAULT ? NULL : mask,
+	            mode == MPOL_DEFAULT ? 0 : PLACEMENT_MAX_NODES) != 0) {
+		return errno;
+	}
+	return 0;
+}
+
+/* Index into the sorted cpus of the cpu a pinned thread runs on */
+static size_t pinned_cpu(enum placement_policy policy, uint32_t thread)
+{
+	if (policy == PLACEMENT_COMPACT) {
+		return thread % cpu_count;
+	}
+	size_t node = thread % node_count;
+	return node_first[node] + (thread / node_count) % node_cpus[node];
+}
+
+/* Index of the node a node bound thread runs on */
+static size_t bound_node(enum placement_policy policy, uint32_t thread)
+{
+	if (policy == PLACEMENT_ROUND_ROBIN) {
+		return thread % node_count;
+	}
+	//compact gives each node as many threads as it has cpus
+	size_t cpu = thread % cpu_count;
+	size_t node = 0;
+	while (cpu >= node_first[node] + node_cpus[node]) {
+		++node;
+	}
+	return node;
+}
+
+int placement_thread_attr(const struct placement *placement,
+                          uint32_t thread,
+                          pthread_attr_t *attr)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (placement->pin != PLACEMENT_NONE) {
+		CPU_SET(cpus[pinned_cpu(placement->pin, thread)], &set);
+	}
+	else if (placement->numa != PLACEMENT_NONE) {
+		size_t node = bound_node(placement->numa, thread);
+		for (size_t i = 0; i < node_cpus[node]; ++i) {
+			CPU_SET(cpus[node_first[node] + i], &set);
+		}
+	}
+	else {
+		return 0;
+	}
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+void placement_describe_thread(const struct placement *placement,
+                               uint32_t thread,
+                               char *buffer,
+                               size_t size)
+{
+	if (placement->pin != PLACEMENT_NONE) {
+		snprintf(buffer, size, "cpu %d", cpus[pinned_cpu(placement->pin, thread)]);
+	}
+	else if (placement->numa != PLACEMENT_NONE) {
+		snprintf(buffer, size, "node %d", node_ids[bound_node(placement->numa, thread)]);
+	}
+	else {
+		snprintf(buffer, size, "any cpu");
+	}
+}
+
+#else
+
+bool placement_init(void)
+{
+	return false;
+}
+
+size_t placement_cpus(void)
+{
+	return 0;
+}
+
+size_t placement_nodes(void)
+{
+	return 0;
+}
+
+int placement_apply_memory(const struct placement *placement)
+{
+	return placement->memory == PLACEMENT_MEMORY_FIRST_TOUCH ? 0 : ENOTSUP;
+}
+
+int placement_thread_attr(const struct placement *placement,
+                          uint32_t thread,
+                          pthread_attr_t *attr)
+{
+	(void) thread;
+	(void) attr;
+	if (placement->pin != PLACEMENT_NONE || placement->numa != PLACEMENT_NONE) {
+		return ENOTSUP;
+	}
+	return 0;
+}
+
+void placement_describe_thread(const struct placement *placement,
+                               uint32_t thread,
+                               char *buffer,
+                               size_t size)
+{
+	(void) placement;
+	(void) thread;
+	snprintf(buffer, size, "any cpu");
+}
+
+#endif
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where the tester runs its worker threads and puts the tables' memory.
+ * Placement is only implemented on Linux, elsewhere placement_init fails
+ * and everything is left to the scheduler. */
+enum placement_policy {
+	PLACEMENT_NONE,
+	/* Fill the cpus of one node before moving on to the next */
+	PLACEMENT_COMPACT,
+	/* Consecutive threads go to consecutive nodes */
+	PLACEMENT_ROUND_ROBIN,
+};
+
+enum placement_memory {
+	/* Pages land on the node of the thread that first writes them */
+	PLACEMENT_MEMORY_FIRST_TOUCH,
+	/* Pages are spread evenly over every node */
+	PLACEMENT_MEMORY_INTERLEAVE,
+};
+
+struct placement {
+	//pins every thread to a single cpu
+	enum placement_policy pin;
+	//binds every thread to all cpus of one node
+	enum placement_policy numa;
+	enum placement_memory memory;
+};
+
+extern const char *placement_policy_names[];
+extern const char *placement_memory_names[];
+
+/* Reads the cpus this process may run on and the nodes they belong to,
+ * returns false when threads can't be placed on this system */
+bool placement_init(void);
+size_t placement_cpus(void);
+size_t placement_nodes(void);
+/* Sets the memory policy of the calling thread, threads created after
+ * this inherit it */
+int placement_apply_memory(const struct placement *placement);
+/* Sets up attr so the thread starts where the placement puts it */
+int placement_thread_attr(const struct placement *placement,
+                          uint32_t thread,
+                          pthread_attr_t *attr);
+/* Writes the policies, e.g. "pin compact with interleave memory" */
+void placement_describe(const struct placement *placement, char *buffer, size_t size);
+/* Writes where the thread runs, e.g. "cpu 3" or "node 1" */
+void placement_describe_thread(const struct placement *placement,
+                               uint32_t thread,
+                               char *buffer,
+                               size_t size);
@@ -0,0 +1,272 @@
+#include "hash-table-sharded.h"
+
+#include "hash-table-v2.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+//operations a shard's ring holds before callers have to wait for its owner
+#define HASH_TABLE_SHARDED_RING_SIZE 1024
+//cpu_relax rounds before a waiting thread yields its cpu
+#define HASH_TABLE_SHARDED_SPINS 64
+
+enum operation_kind {
+	OPERATION_ADD,
+	OPERATION_LOOKUP,
+	OPERATION_FLUSH,
+	OPERATION_STOP,
+};
+
+/* Filled in by the owner, the caller waits on done */
+struct completion {
+	atomic_bool done;
+	bool found;
+	uint32_t value;
+};
+
+/* A cell of the ring. sequence tells producers and the owner whose turn it
+ * is: it equals the ticket of the producer allowed to fill the cell, and
+ * that ticket + 1 once the operation in it is ready. */
+struct operation {
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t sequence;
+	enum operation_kind kind;
+	uint32_t value;
+	const char *key;
+	struct completion *completion;
+};
+
+struct shard {
+	//producers take tickets here
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+	//only the owner reads and writes head and table
+	_Alignas(CACHE_LINE_SIZE) size_t head;
+	struct hash_table_v2 *table;
+	atomic_bool ready;
+	pthread_t owner;
+	struct operation ring[HASH_TABLE_SHARDED_RING_SIZE];
+};
+
+struct hash_table_sharded {
+	size_t shard_count;
+	struct shard *shards;
+};
+
+static void backoff(unsigned *spins)
+{
+	if (++*spins < HASH_TABLE_SHARDED_SPINS) {
+		cpu_relax();
+	}
+	else {
+		*spins = 0;
+		sched_yield();
+	}
+}
+
+static void wait_for(atomic_bool *flag)
+{
+	unsigned spins = 0;
+	while (!atomic_load_explicit(flag, memory_order_acquire)) {
+		backoff(&spins);
+	}
+}
+
+static void complete(struct completion *completion)
+{
+	atomic_store_explicit(&completion->done, true, memory_order_release);
+}
+
+/* Runs the shard's operations in ring order until told to stop. The
+ * table is created here so its memory is first touched by the owner. */
+static void *run_owner(void *arg)
+{
+	struct shard *shard = arg;
+	shard->table = hash_table_v2_create();
+	atomic_store_explicit(&shard->ready, true, memory_order_release);
+
+	unsigned spins = 0;
+	while (true) {
+		struct operation *operation = &shard->ring[shard->head % HASH_TABLE_SHARDED_RING_SIZE];
+		if (atomic_load_explicit(&operation->sequence, memory_order_acquire) != shard->head + 1) {
+			backoff(&spins);
+			continue;
+		}
+		spins = 0;
+
+		struct operation current = *operation;
+		//hand the cell back to the producer that wraps around to it
+		atomic_store_explicit(&operation->sequence,
+		                      shard->head + HASH_TABLE_SHARDED_RING_SIZE,
+		                      memory_order_release);
+		++shard->head;
+
+		switch (current.kind) {
+		case OPERATION_ADD:
+			hash_table_v2_add_entry(shard->table, current.key, current.value);
+			break;
+		case OPERATION_LOOKUP:
+			current.completion->found = hash_table_v2_contains(shard->table, current.key);
+			if (current.completion->found) {
+				current.completion->value = hash_table_v2_get_value(shard->table, current.key);
+			}
+			complete(current.completion);
+			break;
+		case OPERATION_FLUSH:
+			complete(current.completion);
+			break;
+		case OPERATION_STOP:
+			hash_table_v2_destroy(shard->table);
+			complete(current.completion);
+			return NULL;
+		}
+	}
+}
+
+struct hash_table_sharded *hash_table_sharded_create(size_t shards,
+                                                     int (*setup_owner)(size_t shard,
+                                                                        pthread_attr_t *attr))
+{
+	assert(shards > 0);
+	struct hash_table_sharded *hash_table = calloc(1, sizeof(struct hash_table_sharded));
+	assert(hash_table != NULL);
+	hash_table->shard_count = shards;
+	hash_table->shards = aligned_alloc(CACHE_LINE_SIZE, shards * sizeof(struct shard));
+	assert(hash_table->shards != NULL);
+	memset(hash_table->shards, 0, shards * sizeof(struct shard));
+
+	for (size_t i = 0; i < shards; ++i) {
+		struct shard *shard = &hash_table->shards[i];
+		for (size_t j = 0; j < HASH_TABLE_SHARDED_RING_SIZE; ++j) {
+			atomic_init(&shard->ring[j].sequence, j);
+		}
+		pthread_attr_t attr;
+		if (pthread_attr_init(&attr) != 0) {
+			perror("pthread_attr_init");
+			exit(EXIT_FAILURE);
+		}
+		if (setup_owner != NULL && setup_owner(i, &attr) != 0) {
+			perror("setup_owner");
+			exit(EXIT_FAILURE);
+		}
+		if (pthread_create(&shard->owner, &attr, run_owner, shard) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	for (size_t i = 0; i < shards; ++i) {
+		wait_for(&hash_table->shards[i].ready);
+	}
+	return hash_table;
+}
+
+static struct shard *get_shard(struct hash_table_sharded *hash_table, const char *key)
+{
+	assert(key != NULL);
+	//a different hash than the one v2 buckets by, so every shard still
+	//spreads its keys over all of its buckets
+	uint64_t hash = wyhash(key, strlen(key));
+	return &hash_table->shards[(hash * hash_table->shard_count) >> 32];
+}
+
+static void post(struct shard *shard,
+                 enum operation_kind kind,
+                 const char *key,
+                 uint32_t value,
+                 struct completion *completion)
+{
+	unsigned spins = 0;
+	size_t ticket = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+	struct operation *operation;
+	while (true) {
+		operation = &shard->ring[ticket % HASH_TABLE_SHARDED_RING_SIZE];
+		size_t sequence = atomic_load_explicit(&operation->sequence, memory_order_acquire);
+		if (sequence == ticket) {
+			if (atomic_compare_exchange_weak_explicit(&shard->tail, &ticket, ticket + 1,
+			                                          memory_order_relaxed,
+			                                          memory_order_relaxed)) {
+				break;
+			}
+		}
+		else if (sequence < ticket) {
+			//the ring is full, wait for the owner to catch up
+			backoff(&spins);
+			ticket = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+		}
+		else {
+			ticket = atomic_load_explicit(&shard->tail, memory_order_relaxed);
+		}
+	}
+	operation->kind = kind;
+	operation->key = key;
+	operation->value = value;
+	operation->completion = completion;
+	atomic_store_explicit(&operation->sequence, ticket + 1, memory_order_release);
+}
+
+void hash_table_sharded_add_entry(struct hash_table_sharded *hash_table,
+                                  const char *key,
+                                  uint32_t value)
+{
+	post(get_shard(hash_table, key), OPERATION_ADD, key, value, NULL);
+}
+
+static struct completion lookup(struct hash_table_sharded *hash_table, const char *key)
+{
+	struct completion completion = { .done = false };
+	post(get_shard(hash_table, key), OPERATION_LOOKUP, key, 0, &completion);
+	wait_for(&completion.done);
+	return completion;
+}
+
+bool hash_table_sharded_contains(struct hash_table_sharded *hash_table,
+                                 const char *key)
+{
+	return lookup(hash_table, key).found;
+}
+
+uint32_t hash_table_sharded_get_value(struct hash_table_sharded *hash_table,
+                                      const char *key)
+{
+	struct completion completion = lookup(hash_table, key);
+	assert(completion.found);
+	return completion.value;
+}
+
+/* Posts kind to every shard and waits until each owner got to it */
+static void post_all(struct hash_table_sharded *hash_table, enum operation_kind kind)
+{
+	struct completion *completions = calloc(hash_table->shard_count, sizeof(struct completion));
+	assert(completions != NULL);
+	for (size_t i = 0; i < hash_table->shard_count; ++i) {
+		post(&hash_table->shards[i], kind, NULL, 0, &completions[i]);
+	}
+	for (size_t i = 0; i < hash_table->shard_count; ++i) {
+		wait_for(&completions[i].done);
+	}
+	free(completions);
+}
+
+void hash_table_sharded_flush(struct hash_table_sharded *hash_table)
+{
+	post_all(hash_table, OPERATION_FLUSH);
+}
+
+void hash_table_sharded_destroy(struct hash_table_sharded *hash_table)
+{
+	post_all(hash_table, OPERATION_STOP);
+	for (size_t i = 0; i < hash_table->shard_count; ++i) {
+		if (pthread_join(hash_table->shards[i].owner, NULL) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(hash_table->shards);
+	free(hash_table);
+}
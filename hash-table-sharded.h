@@ -0,0 +1,31 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Shared-nothing front end over hash_table_v2. The key hash picks a shard,
+ * and every shard is a v2 table that only its owner thread ever touches.
+ * Callers hand operations to the owner through the shard's bounded MPSC
+ * ring, so a shard's buckets and entries stay in its owner's cache.
+ *
+ * add_entry only queues the insert and returns. Operations from one thread
+ * run in the order that thread issued them, so a contains that follows an
+ * add_entry of the same key always finds it. */
+struct hash_table_sharded;
+/* setup_owner, if not NULL, can pin the owner of each shard before it
+ * starts, the owner then allocates its table where it runs */
+struct hash_table_sharded *hash_table_sharded_create(size_t shards,
+                                                     int (*setup_owner)(size_t shard,
+                                                                        pthread_attr_t *attr));
+void hash_table_sharded_add_entry(struct hash_table_sharded *hash_table,
+                                  const char *key,
+                                  uint32_t value);
+bool hash_table_sharded_contains(struct hash_table_sharded *hash_table,
+                                 const char *key);
+uint32_t hash_table_sharded_get_value(struct hash_table_sharded *hash_table,
+                                      const char *key);
+/* Waits until every operation queued before the call has run */
+void hash_table_sharded_flush(struct hash_table_sharded *hash_table);
+void hash_table_sharded_destroy(struct hash_table_sharded *hash_table);
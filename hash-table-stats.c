@@ -0,0 +1,47 @@
+#include "hash-table-stats.h"
+
+#include <time.h>
+
+uint64_t hash_table_stats_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void hash_table_stats_record_lock(struct hash_table_stats *stats,
+                                  struct hash_table_lock_stats *lock,
+                                  uint64_t wait_start)
+{
+	struct hash_table_thread_stats *thread = hash_table_stats_thread(stats);
+	hash_table_stats_add(&thread->lock_acquisitions, 1);
+	++lock->acquisitions;
+	if (wait_start != 0) {
+		uint64_t wait = hash_table_stats_now() - wait_start;
+		hash_table_stats_add(&thread->contended_acquisitions, 1);
+		hash_table_stats_add(&thread->lock_wait_nsec, wait);
+		++lock->contended_acquisitions;
+		lock->wait_nsec += wait;
+	}
+}
+
+void hash_table_stats_print(const struct hash_table_stats *stats, FILE *out)
+{
+	for (size_t i = 0; i < HASH_TABLE_STATS_THREADS; ++i) {
+		const struct hash_table_thread_stats *thread = &stats->threads[i];
+		uint64_t acquisitions = atomic_load(&thread->lock_acquisitions);
+		uint64_t lookups = atomic_load(&thread->lookups);
+		if (acquisitions == 0 && lookups == 0) {
+			continue;
+		}
+		uint64_t walked = atomic_load(&thread->entries_walked);
+		fprintf(out, "  - thread slot %zu: %'lu locks, %'lu contended, %'lu usec waiting, "
+		        "%'lu chain walks, %'lu entries walked (%.2f per walk), %'lu key compares\n",
+		        i, (unsigned long) acquisitions,
+		        (unsigned long) atomic_load(&thread->contended_acquisitions),
+		        (unsigned long) (atomic_load(&thread->lock_wait_nsec) / 1000),
+		        (unsigned long) lookups, (unsigned long) walked,
+		        lookups > 0 ? (double) walked / lookups : 0.0,
+		        (unsigned long) atomic_load(&thread->key_comparisons));
+	}
+}
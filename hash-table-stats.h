@@ -0,0 +1,53 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Instrumentation for v1 and v2, only compiled in with -DHASH_TABLE_STATS
+ * (make STATS=1). Every thread counts into its own cache line sized slot,
+ * the counters are plain loads and stores so they stay cheap, threads past
+ * HASH_TABLE_STATS_THREADS share slots and may lose counts. */
+#define HASH_TABLE_STATS_THREADS 64
+
+struct hash_table_thread_stats {
+	_Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t lock_acquisitions;
+	//the lock was already held when the thread tried to take it
+	atomic_uint_least64_t contended_acquisitions;
+	atomic_uint_least64_t lock_wait_nsec;
+	atomic_uint_least64_t lookups;
+	atomic_uint_least64_t entries_walked;
+	atomic_uint_least64_t key_comparisons;
+};
+
+struct hash_table_stats {
+	struct hash_table_thread_stats threads[HASH_TABLE_STATS_THREADS];
+};
+
+/* Counters for one lock, only ever updated with that lock held */
+struct hash_table_lock_stats {
+	uint64_t acquisitions;
+	uint64_t contended_acquisitions;
+	uint64_t wait_nsec;
+};
+
+static inline struct hash_table_thread_stats *hash_table_stats_thread(struct hash_table_stats *stats)
+{
+	return &stats->threads[hash_table_thread_index() % HASH_TABLE_STATS_THREADS];
+}
+
+static inline void hash_table_stats_add(atomic_uint_least64_t *counter, uint64_t value)
+{
+	atomic_store_explicit(counter,
+	                      atomic_load_explicit(counter, memory_order_relaxed) + value,
+	                      memory_order_relaxed);
+}
+
+uint64_t hash_table_stats_now(void);
+/* Records one acquisition, wait_start is 0 when the lock was free */
+void hash_table_stats_record_lock(struct hash_table_stats *stats,
+                                  struct hash_table_lock_stats *lock,
+                                  uint64_t wait_start);
+void hash_table_stats_print(const struct hash_table_stats *stats, FILE *out);
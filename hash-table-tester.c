@@ -1,28 +1,216 @@
+#include "hash-table-async.h"
 #include "hash-table-base.h"
 #include "hash-table-v1.h"
 #include "hash-table-v2.h"
+#include "hash-table-v3.h"
+#include "hash-table-v4.h"
+#include "hash-table-fixed.h"
+#include "hash-table-keys.h"
+#include "hash-table-placement.h"
+#include "hash-table-sharded.h"
 
 #include <argp.h>
+#include <errno.h>
 #include <locale.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <sys/time.h>
+#include <time.h>
 
 char *entries;
 
 void (*add_entry)(void *, const char *key, uint32_t value);
 
-#define BYTES_PER_STRING 8
+#define OPTION_V3 0x100
+#define OPTION_LOCK 0x101
+#define OPTION_BUCKETS_PER_LOCK 0x102
+#define OPTION_COPY_KEYS 0x103
+#define OPTION_HASHER 0x104
+#define OPTION_HASH_REPORT 0x105
+#define OPTION_BATCH 0x106
+#define OPTION_WORKLOAD 0x107
+#define OPTION_READ_PERCENT 0x108
+#define OPTION_LATENCY 0x109
+#define OPTION_FORMAT 0x10a
+#define OPTION_STATS 0x10b
+#define OPTION_PIN 0x10c
+#define OPTION_NUMA 0x10d
+#define OPTION_MEMORY 0x10e
+#define OPTION_SHARDED 0x10f
+#define OPTION_BULK 0x110
+#define OPTION_SNAPSHOT 0x111
+#define OPTION_INPUT 0x112
+#define OPTION_KEYS 0x113
+#define OPTION_ZIPF_EXPONENT 0x114
+#define OPTION_FIXED 0x115
+#define OPTION_SEQLOCK 0x116
+#define OPTION_V4 0x117
+#define OPTION_ITERATE 0x118
+#define OPTION_SWEEP_THREADS 0x119
+#define OPTION_SWEEP_SIZE 0x11a
+#define OPTION_REPEAT 0x11b
+#define OPTION_LOOKASIDE 0x11c
+#define OPTION_FIND 0x11d
+#define OPTION_ASYNC 0x11e
+#define OPTION_V1_LOCK 0x11f
+#define OPTION_SPLIT_CONTENTION 0x120
+#define OPTION_LOCK_SWEEP 0x121
+
+//most values --sweep-threads and --sweep-size take
+#define SWEEP_MAX 32
+
+enum format {
+	FORMAT_TEXT,
+	FORMAT_CSV,
+	/* One object per line for every table that ran */
+	FORMAT_JSON,
+};
+
+static const char *format_names[] = {
+	[FORMAT_TEXT] = "text",
+	[FORMAT_CSV] = "csv",
+	[FORMAT_JSON] = "json",
+};
+
+enum workload {
+	/* Concurrent inserts, then a single threaded missing check */
+	WORKLOAD_INSERT,
+	/* Prefilled table, every thread only looks up */
+	WORKLOAD_LOOKUP,
+	/* Prefilled with half the keys, each thread mixes lookups and inserts */
+	WORKLOAD_MIXED,
+	/* Half the threads insert while the other half look up */
+	WORKLOAD_CONCURRENT,
+	/* Prefilled with half the keys, each thread slides its half forward by
+	 * inserting a new key and removing the oldest, only for tables with
+	 * remove */
+	WORKLOAD_CHURN,
+	/* Every thread bumps the counters of random keys from the whole key
+	 * set, only for tables with fetch_add */
+	WORKLOAD_COUNTERS,
+};
+
+static const char *workload_names[] = {
+	[WORKLOAD_INSERT] = "insert",
+	[WORKLOAD_LOOKUP] = "lookup",
+	[WORKLOAD_MIXED] = "mixed",
+	[WORKLOAD_CONCURRENT] = "concurrent",
+	[WORKLOAD_CHURN] = "churn",
+	[WORKLOAD_COUNTERS] = "counters",
+};
+
+static const char *lock_names[] = {
+	[HASH_TABLE_LOCK_MUTEX] = "mutex",
+	[HASH_TABLE_LOCK_SPINLOCK] = "spinlock",
+	[HASH_TABLE_LOCK_ADAPTIVE] = "adaptive",
+	[HASH_TABLE_LOCK_MCS] = "mcs",
+};
+
+#define LOCK_KINDS (sizeof(lock_names) / sizeof(lock_names[0]))
+
+struct hasher {
+	const char *name;
+	hash_function hash;
+};
+
+static const struct hasher hashers[] = {
+	{ "djb2", bernstein_hash_length },
+	{ "wyhash", wyhash },
+};
+
+#define HASHERS (sizeof(hashers) / sizeof(hashers[0]))
+//chains at least this long share the last histogram row
+#define HISTOGRAM_ROWS 16
 
 struct arguments {
 	uint32_t threads;
 	uint32_t size;
+	//whether -s was given, --input otherwise takes every key of its file
+	bool size_given;
+	//file of newline separated keys, "-" for stdin, NULL to generate them
+	const char *input;
+	enum key_distribution keys;
+	double zipf_exponent;
+	//walk hash table v2 with for_each_range and destroy it in parallel
+	bool iterate;
+	//v1 and v2 insert through find and a handle instead of add_entry
+	bool find;
+	//workers of the asynchronous v2 run, 0 when it isn't run
+	uint32_t async_workers;
+	enum hash_table_lock_kind v1_lock;
+	//the sweep also runs v1 and v2 with every other kind of lock
+	bool lock_sweep;
+	bool v3;
+	bool v4;
+	bool fixed;
+	//where --v3 saves its table before reopening it mapped, NULL to skip
+	const char *snapshot;
+	bool hash_report;
+	uint32_t batch;
+	bool bulk;
+	enum workload workload;
+	uint32_t read_percent;
+	bool latency;
+	enum format format;
+	bool stats;
+	//set once any of --pin, --numa or --memory is given
+	bool placed;
+	struct placement placement;
+	//shards of the sharded table, 0 when it isn't compared
+	uint32_t shards;
+	//thread counts and sizes per thread the sweep runs every pair of, it
+	//only runs if either list was given
+	uint32_t sweep_threads[SWEEP_MAX];
+	size_t sweep_thread_count;
+	uint32_t sweep_sizes[SWEEP_MAX];
+	size_t sweep_size_count;
+	//runs of every sweep configuration
+	uint32_t repeat;
+	struct hash_table_v2_options v2_options;
 };
 
 static struct argp_option options[] = { 
 	{ "threads", 't', "NUM", 0, "Number of threads."},
 	{ "size", 's', "NUM", 0, "Size per thread."},
+	{ "input", OPTION_INPUT, "FILE", 0, "Read newline separated keys from FILE, - for stdin, and split them evenly over the threads."},
+	{ "keys", OPTION_KEYS, "NAME", 0, "Generated keys: random (default), sequential, shared-prefix or zipf."},
+	{ "zipf-exponent", OPTION_ZIPF_EXPONENT, "NUM", 0, "Skew of the zipf keys, 1.0 by default."},
+	{ "sweep-threads", OPTION_SWEEP_THREADS, "LIST", 0, "Time the inserts for each comma separated thread count and report speedup over base."},
+	{ "sweep-size", OPTION_SWEEP_SIZE, "LIST", 0, "Sizes per thread the sweep runs with, -s by default."},
+	{ "repeat", OPTION_REPEAT, "NUM", 0, "Runs of every sweep configuration, 5 by default."},
+	{ "iterate", OPTION_ITERATE, 0, 0, "Walk hash table v2 with a range of slices per thread, then destroy it in parallel."},
+	{ "v3", OPTION_V3, 0, 0, "Also run hash table v3 after v2."},
+	{ "v4", OPTION_V4, 0, 0, "Also run hash table v4 after v3."},
+	{ "fixed", OPTION_FIXED, 0, 0, "Also run the 8, 16 and 32 byte fixed width tables last, each one the longest key fits."},
+	{ "snapshot", OPTION_SNAPSHOT, "PATH", 0, "Save hash table v3 to PATH, then map it back and check it (needs --v3)."},
+	{ "lock", OPTION_LOCK, "KIND", 0, "Lock used by hash table v2: mutex (default), spinlock, adaptive or mcs."},
+	{ "v1-lock", OPTION_V1_LOCK, "KIND", 0, "Lock hash table v1 serializes its inserts on, the same kinds as --lock."},
+	{ "split-contention", OPTION_SPLIT_CONTENTION, "NUM", 0, "Let a hash table v2 lock that made NUM writers wait start an early resize."},
+	{ "lock-sweep", OPTION_LOCK_SWEEP, 0, 0, "Also sweep hash tables v1 and v2 with every lock kind besides the chosen ones."},
+	{ "buckets-per-lock", OPTION_BUCKETS_PER_LOCK, "NUM", 0, "Buckets sharing one lock in hash table v2, a power of two."},
+	{ "copy-keys", OPTION_COPY_KEYS, 0, 0, "Let hash table v2 copy keys into its own storage."},
+	{ "seqlock", OPTION_SEQLOCK, 0, 0, "Let hash table v2 lookups validate per bucket sequence counters instead of entering the epoch."},
+	{ "lookaside", OPTION_LOOKASIDE, 0, 0, "Put a per thread lookaside cache in front of hash table v2 lookups."},
+	{ "async", OPTION_ASYNC, "WORKERS", 0, "Also insert into hash table v2 through its asynchronous front end with WORKERS table workers."},
+	{ "find", OPTION_FIND, 0, 0, "Insert into hash tables v1 and v2 by hashing each key once, finding it and setting it through the handle."},
+	{ "hasher", OPTION_HASHER, "NAME", 0, "Hash function used by hash table v2: djb2 (default) or wyhash."},
+	{ "hash-report", OPTION_HASH_REPORT, 0, 0, "Report throughput and bucket occupancy of every hasher."},
+	{ "bulk", OPTION_BULK, 0, 0, "Fill a private buffer per thread, then merge them all into hash table v2."},
+	{ "batch", OPTION_BATCH, "NUM", 0, "Insert into, check and look up hash table v2 in batches of NUM keys."},
+	{ "workload", OPTION_WORKLOAD, "NAME", 0, "insert (default), lookup, mixed, concurrent, churn or counters."},
+	{ "read-percent", OPTION_READ_PERCENT, "NUM", 0, "Share of lookups in the mixed workload, 95 by default."},
+	{ "latency", OPTION_LATENCY, 0, 0, "Time every operation and report latency percentiles."},
+	{ "format", OPTION_FORMAT, "NAME", 0, "Output of the workloads: text (default), csv or json."},
+	{ "pin", OPTION_PIN, "POLICY", 0, "Pin every thread to one cpu: compact or round-robin over the nodes."},
+	{ "numa", OPTION_NUMA, "POLICY", 0, "Bind every thread to the cpus of one node: compact or round-robin."},
+	{ "memory", OPTION_MEMORY, "POLICY", 0, "Place the tables' memory by first-touch (default) or interleave it over the nodes."},
+	{ "sharded", OPTION_SHARDED, "SHARDS", 0, "Compare v2 against a table of SHARDS single owner shards, from 1 up to -t threads."},
+	{ "stats", OPTION_STATS, 0, 0, "Print the lock and chain counters of v1 and v2 (needs make STATS=1)."},
 	{ 0 } 
 };
 
@@ -64,6 +252,64 @@ static uint32_t parse_uint32_t(const char *string) {
 	return current;
 }
 
+static enum placement_policy parse_placement_policy(struct argp_state *state, const char *arg)
+{
+	if (strcmp(arg, "compact") == 0) {
+		return PLACEMENT_COMPACT;
+	}
+	if (strcmp(arg, "round-robin") == 0) {
+		return PLACEMENT_ROUND_ROBIN;
+	}
+	argp_error(state, "unknown placement policy '%s'", arg);
+	return PLACEMENT_NONE;
+}
+
+static const struct hasher *parse_hasher(struct argp_state *state, const char *arg)
+{
+	for (size_t i = 0; i < HASHERS; ++i) {
+		if (strcmp(arg, hashers[i].name) == 0) {
+			return &hashers[i];
+		}
+	}
+	argp_error(state, "unknown hasher '%s'", arg);
+	return &hashers[0];
+}
+
+static enum hash_table_lock_kind parse_lock_kind(struct argp_state *state, const char *arg)
+{
+	for (size_t i = 0; i < LOCK_KINDS; ++i) {
+		if (strcmp(arg, lock_names[i]) == 0) {
+			return (enum hash_table_lock_kind) i;
+		}
+	}
+	argp_error(state, "unknown lock kind '%s'", arg);
+	return HASH_TABLE_LOCK_MUTEX;
+}
+
+/* Comma separated positive numbers, at most SWEEP_MAX of them */
+static size_t parse_list(struct argp_state *state, const char *arg, uint32_t *values)
+{
+	size_t count = 0;
+	const char *next = arg;
+	while (true) {
+		char *end;
+		errno = 0;
+		unsigned long value = strtoul(next, &end, 10);
+		if (end == next || errno != 0 || value == 0 || value > UINT32_MAX
+		    || (*end != ',' && *end != 0)) {
+			argp_error(state, "'%s' is not a list of positive numbers", arg);
+		}
+		if (count == SWEEP_MAX) {
+			argp_error(state, "'%s' has more than %d values", arg, SWEEP_MAX);
+		}
+		values[count++] = value;
+		if (*end == 0) {
+			return count;
+		}
+		next = end + 1;
+	}
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 	struct arguments *arguments = state->input;
 	switch (key) {
@@ -72,13 +318,166 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 		break;
 	case 's':
 		arguments->size = parse_uint32_t(arg);
+		arguments->size_given = true;
+		break;
+	case OPTION_INPUT:
+		arguments->input = arg;
+		break;
+	case OPTION_KEYS:
+		for (size_t i = 0; i < KEY_DISTRIBUTIONS; ++i) {
+			if (strcmp(arg, key_distribution_names[i]) == 0) {
+				arguments->keys = i;
+				return 0;
+			}
+		}
+		argp_error(state, "unknown keys '%s'", arg);
+		break;
+	case OPTION_ZIPF_EXPONENT: {
+		char *end;
+		arguments->zipf_exponent = strtod(arg, &end);
+		if (*end != 0 || !(arguments->zipf_exponent > 0)) {
+			argp_error(state, "the zipf exponent must be a positive number");
+		}
+		break;
+	}
+	case OPTION_ITERATE:
+		arguments->iterate = true;
+		break;
+	case OPTION_SWEEP_THREADS:
+		arguments->sweep_thread_count = parse_list(state, arg, arguments->sweep_threads);
+		break;
+	case OPTION_SWEEP_SIZE:
+		arguments->sweep_size_count = parse_list(state, arg, arguments->sweep_sizes);
+		break;
+	case OPTION_REPEAT:
+		arguments->repeat = parse_uint32_t(arg);
+		if (arguments->repeat == 0) {
+			argp_error(state, "repeat must be at least 1");
+		}
+		break;
+	case OPTION_V3:
+		arguments->v3 = true;
+		break;
+	case OPTION_V4:
+		arguments->v4 = true;
+		break;
+	case OPTION_FIXED:
+		arguments->fixed = true;
+		break;
+	case OPTION_SNAPSHOT:
+		arguments->snapshot = arg;
+		break;
+	case OPTION_LOCK:
+		arguments->v2_options.lock_kind = (enum hash_table_v2_lock_kind) parse_lock_kind(state, arg);
+		break;
+	case OPTION_V1_LOCK:
+		arguments->v1_lock = parse_lock_kind(state, arg);
+		break;
+	case OPTION_SPLIT_CONTENTION:
+		arguments->v2_options.split_contention = parse_uint32_t(arg);
+		break;
+	case OPTION_LOCK_SWEEP:
+		arguments->lock_sweep = true;
+		break;
+	case OPTION_BUCKETS_PER_LOCK:
+		arguments->v2_options.buckets_per_lock = parse_uint32_t(arg);
+		if ((arguments->v2_options.buckets_per_lock
+		     & (arguments->v2_options.buckets_per_lock - 1)) != 0) {
+			argp_error(state, "buckets per lock must be a power of two");
+		}
+		break;
+	case OPTION_COPY_KEYS:
+		arguments->v2_options.copy_keys = true;
+		break;
+	case OPTION_SEQLOCK:
+		arguments->v2_options.seqlock_reads = true;
+		break;
+	case OPTION_LOOKASIDE:
+		arguments->v2_options.lookaside = true;
+		break;
+	case OPTION_FIND:
+		arguments->find = true;
+		break;
+	case OPTION_ASYNC:
+		arguments->async_workers = parse_uint32_t(arg);
+		if (arguments->async_workers == 0) {
+			argp_error(state, "the asynchronous front end needs at least one worker");
+		}
+		break;
+	case OPTION_HASHER:
+		arguments->v2_options.hash = parse_hasher(state, arg)->hash;
+		break;
+	case OPTION_HASH_REPORT:
+		arguments->hash_report = true;
+		break;
+	case OPTION_BULK:
+		arguments->bulk = true;
+		break;
+	case OPTION_BATCH:
+		arguments->batch = parse_uint32_t(arg);
+		break;
+	case OPTION_WORKLOAD:
+		for (size_t i = 0; i < sizeof(workload_names) / sizeof(workload_names[0]); ++i) {
+			if (strcmp(arg, workload_names[i]) == 0) {
+				arguments->workload = i;
+				return 0;
+			}
+		}
+		argp_error(state, "unknown workload '%s'", arg);
+		break;
+	case OPTION_READ_PERCENT:
+		arguments->read_percent = parse_uint32_t(arg);
+		if (arguments->read_percent > 100) {
+			argp_error(state, "read percent must be at most 100");
+		}
+		break;
+	case OPTION_LATENCY:
+		arguments->latency = true;
+		break;
+	case OPTION_FORMAT:
+		for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]); ++i) {
+			if (strcmp(arg, format_names[i]) == 0) {
+				arguments->format = i;
+				return 0;
+			}
+		}
+		argp_error(state, "unknown format '%s'", arg);
+		break;
+	case OPTION_STATS:
+		arguments->stats = true;
+		break;
+	case OPTION_SHARDED:
+		arguments->shards = parse_uint32_t(arg);
+		if (arguments->shards == 0) {
+			argp_error(state, "a sharded table needs at least one shard");
+		}
+		break;
+	case OPTION_PIN:
+		arguments->placement.pin = parse_placement_policy(state, arg);
+		arguments->placed = true;
+		break;
+	case OPTION_NUMA:
+		arguments->placement.numa = parse_placement_policy(state, arg);
+		arguments->placed = true;
+		break;
+	case OPTION_MEMORY:
+		if (strcmp(arg, "first-touch") == 0) {
+			arguments->placement.memory = PLACEMENT_MEMORY_FIRST_TOUCH;
+		}
+		else if (strcmp(arg, "interleave") == 0) {
+			arguments->placement.memory = PLACEMENT_MEMORY_INTERLEAVE;
+		}
+		else {
+			argp_error(state, "unknown memory policy '%s'", arg);
+		}
+		arguments->placed = true;
 		break;
 	}   
 	return 0;
 }
 
 static struct arguments arguments;
-static char *data;
+static struct key_set key_set;
 
 static size_t get_global_index(uint32_t thread, uint32_t index)
 {
@@ -87,7 +486,54 @@ static size_t get_global_index(uint32_t thread, uint32_t index)
 
 static char *get_string(size_t global_index)
 {
-	return data + (global_index * BYTES_PER_STRING);
+	return key_set.keys[global_index];
+}
+
+/* Starts worker thread i wherever --pin or --numa put it */
+static int create_worker(pthread_t *thread, uintptr_t i, void *(*run)(void *))
+{
+	pthread_attr_t attr;
+	int err = pthread_attr_init(&attr);
+	if (err == 0) {
+		err = placement_thread_attr(&arguments.placement, i, &attr);
+	}
+	if (err == 0) {
+		err = pthread_create(thread, &attr, run, (void*) i);
+	}
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+static void *run_generate(void *arg)
+{
+	key_set_generate_slice(&key_set, (uintptr_t) arg, 42);
+	return NULL;
+}
+
+/* Every thread generates its own slice of keys, placed where it will run
+ * the tables later, so the slice's pages are first touched there */
+static int generate_keys(void)
+{
+	key_set_create(&key_set, arguments.keys, (size_t) arguments.threads * arguments.size,
+	               arguments.threads, arguments.zipf_exponent);
+	pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = create_worker(&threads[i], i, run_generate);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	free(threads);
+	key_set_generated(&key_set);
+	return 0;
 }
 
 static unsigned long usec_diff(struct timeval *a, struct timeval *b)
@@ -98,13 +544,77 @@ static unsigned long usec_diff(struct timeval *a, struct timeval *b)
 	return usec;
 }
 
+/* Times each hasher over every key, then shows how evenly the keys spread
+ * over a power of two bucket count holding about one key per bucket */
+static void report_hashers(void)
+{
+	size_t count = (size_t) arguments.threads * arguments.size;
+	size_t capacity = HASH_TABLE_CAPACITY;
+	while (capacity < count) {
+		capacity *= 2;
+	}
+	uint32_t *occupancy = calloc(capacity, sizeof(uint32_t));
+	struct timeval start, end;
+	double megabytes = (double) key_set_bytes(&key_set) / 1e6;
+
+	for (size_t h = 0; h < HASHERS; ++h) {
+		const struct hasher *hasher = &hashers[h];
+
+		/* Keep the hashes alive so the loop isn't optimized away */
+		volatile uint32_t sink = 0;
+		gettimeofday(&start, NULL);
+		for (size_t i = 0; i < count; ++i) {
+			char *string = get_string(i);
+			sink ^= hasher->hash(string, strlen(string));
+		}
+		gettimeofday(&end, NULL);
+		unsigned long usec = usec_diff(&start, &end);
+		printf("Hasher %s: %'lu usec, %'.1f MB/s\n", hasher->name, usec,
+		       usec > 0 ? megabytes / (usec / 1e6) : 0.0);
+
+		memset(occupancy, 0, capacity * sizeof(uint32_t));
+		for (size_t i = 0; i < count; ++i) {
+			char *string = get_string(i);
+			++occupancy[hasher->hash(string, strlen(string)) & (capacity - 1)];
+		}
+		size_t histogram[HISTOGRAM_ROWS] = { 0 };
+		uint32_t longest = 0;
+		for (size_t i = 0; i < capacity; ++i) {
+			uint32_t length = occupancy[i];
+			++histogram[length < HISTOGRAM_ROWS ? length : HISTOGRAM_ROWS - 1];
+			if (length > longest) {
+				longest = length;
+			}
+		}
+		printf("  - %'zu buckets, longest chain %'u\n", capacity, longest);
+		for (size_t i = 0; i < HISTOGRAM_ROWS; ++i) {
+			printf("  - %s%zu entries: %'lu buckets\n",
+			       i == HISTOGRAM_ROWS - 1 ? ">= " : "", i, histogram[i]);
+		}
+	}
+	free(occupancy);
+}
+
 static struct hash_table_v1 *hash_table_v1;
 
+/* The lookup and the insert of --find share one hash */
+static void find_and_set_v1(const char *key, uint32_t value)
+{
+	uint32_t hash = hash_table_v1_hash(hash_table_v1, key);
+	struct hash_table_v1_handle handle;
+	hash_table_v1_find(hash_table_v1, key, hash, &handle);
+	hash_table_v1_handle_set(hash_table_v1, &handle, value);
+}
+
 void *run_v1(void *arg) {
 	uint32_t thread = (uintptr_t) arg;
 	for (uint32_t j = 0; j < arguments.size; ++j) {
 		size_t global_index = get_global_index(thread, j);
 		char *string = get_string(global_index);
+		if (arguments.find) {
+			find_and_set_v1(string, global_index);
+			continue;
+		}
 		hash_table_v1_add_entry(hash_table_v1, string, global_index);
 	}
 	return NULL;
@@ -112,82 +622,123 @@ void *run_v1(void *arg) {
 
 static struct hash_table_v2 *hash_table_v2;
 
+//one per thread when --bulk is given
+static struct hash_table_v2_bulk **v2_bulks;
+
+static void find_and_set_v2(const char *key, uint32_t value)
+{
+	uint32_t hash = hash_table_v2_hash(hash_table_v2, key);
+	struct hash_table_v2_handle handle;
+	hash_table_v2_find(hash_table_v2, key, hash, &handle);
+	hash_table_v2_handle_set(hash_table_v2, &handle, value);
+	hash_table_v2_release(hash_table_v2, &handle);
+}
+
 void *run_v2(void *arg) {
 	uint32_t thread = (uintptr_t) arg;
+	if (arguments.bulk) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(thread, j);
+			hash_table_v2_bulk_add(v2_bulks[thread], get_string(global_index), global_index);
+		}
+		return NULL;
+	}
+	if (arguments.batch > 1) {
+		const char **keys = calloc(arguments.batch, sizeof(char *));
+		uint32_t *values = calloc(arguments.batch, sizeof(uint32_t));
+		for (uint32_t j = 0; j < arguments.size; j += arguments.batch) {
+			uint32_t count = 0;
+			for (; count < arguments.batch && j + count < arguments.size; ++count) {
+				size_t global_index = get_global_index(thread, j + count);
+				keys[count] = get_string(global_index);
+				values[count] = global_index;
+			}
+			hash_table_v2_add_entries(hash_table_v2, keys, values, count);
+		}
+		free(keys);
+		free(values);
+		return NULL;
+	}
 	for (uint32_t j = 0; j < arguments.size; ++j) {
 		size_t global_index = get_global_index(thread, j);
 		char *string = get_string(global_index);
+		if (arguments.find) {
+			find_and_set_v2(string, global_index);
+			continue;
+		}
 		hash_table_v2_add_entry(hash_table_v2, string, global_index);
 	}
 	return NULL;
 }
 
-int main(int argc, char *argv[])
-{
-	arguments.threads = 4;
-	arguments.size = 25000;
-  
-	static struct argp argp = { options, parse_opt };
-	argp_parse(&argp, argc, argv, 0, 0, &arguments);
-
-	setlocale(LC_ALL, "en_US.UTF-8");
-
-	data = calloc(arguments.threads * arguments.size, BYTES_PER_STRING);
-
-	struct timeval start, end;
+static struct hash_table_async *hash_table_async;
+//one per inserting thread and one more for the missing check
+static struct hash_table_async_queue **async_queues;
+//completions run_async and count_missing_async poll at once
+#define ASYNC_POLL 64
 
-	gettimeofday(&start, NULL);
-	srand(42);
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			for (uint32_t k = 0; k < (BYTES_PER_STRING - 1); ++k) {
-				int r = rand() % 52;
-				if (r < 26) {
-					string[k] = r + 0x41;
-				}
-				else {
-					string[k] = r + 0x47;
-				}
+/* Never waits on the table, only on its own queue filling up */
+void *run_async(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	struct hash_table_async_queue *queue = async_queues[thread];
+	struct hash_table_async_completion completions[ASYNC_POLL];
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		while (!hash_table_async_submit(queue, HASH_TABLE_ASYNC_ADD, get_string(global_index),
+		                                global_index, global_index)) {
+			if (hash_table_async_poll(queue, completions, ASYNC_POLL) == 0) {
+				sched_yield();
 			}
-			string[BYTES_PER_STRING - 1] = 0;
 		}
 	}
-	gettimeofday(&end, NULL);
-	printf("Generation: %'lu usec\n", usec_diff(&start, &end));
-
-	struct hash_table_base *hash_table_base = hash_table_base_create();
-	gettimeofday(&start, NULL);
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			hash_table_base_add_entry(hash_table_base, string, global_index);
+	while (hash_table_async_pending(queue) > 0) {
+		if (hash_table_async_poll(queue, completions, ASYNC_POLL) == 0) {
+			sched_yield();
 		}
 	}
-	gettimeofday(&end, NULL);
-	printf("Hash table base: %'lu usec\n", usec_diff(&start, &end));
+	return NULL;
+}
 
+/* The missing check through asynchronous lookups */
+static size_t count_missing_async(void)
+{
+	struct hash_table_async_queue *queue = async_queues[arguments.threads];
+	struct hash_table_async_completion completions[ASYNC_POLL];
+	size_t count = (size_t) arguments.threads * arguments.size;
 	size_t missing = 0;
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_base_contains(hash_table_base, string)) {
+	size_t next = 0;
+	while (next < count || hash_table_async_pending(queue) > 0) {
+		while (next < count
+		       && hash_table_async_submit(queue, HASH_TABLE_ASYNC_LOOKUP,
+		                                  get_string(next), 0, next)) {
+			++next;
+		}
+		size_t polled = hash_table_async_poll(queue, completions, ASYNC_POLL);
+		for (size_t i = 0; i < polled; ++i) {
+			if (!completions[i].found) {
 				++missing;
 			}
 		}
+		if (polled == 0) {
+			sched_yield();
+		}
 	}
-	printf("  - %'lu missing\n", missing);
-	hash_table_base_destroy(hash_table_base);
-
-	pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
+	return missing;
+}
 
-	hash_table_v1 = hash_table_v1_create();
+/* The insert run of v2 again, but through hash_table_async */
+static int report_async(pthread_t *threads)
+{
+	struct timeval start, end;
+	struct hash_table_v2 *hash_table = hash_table_v2_create_with_options(&arguments.v2_options);
+	hash_table_async = hash_table_async_create(hash_table, arguments.async_workers);
+	async_queues = calloc(arguments.threads + 1, sizeof(struct hash_table_async_queue *));
+	for (uint32_t i = 0; i <= arguments.threads; ++i) {
+		async_queues[i] = hash_table_async_queue_create(hash_table_async);
+	}
 	gettimeofday(&start, NULL);
 	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_create(&threads[i], NULL, run_v1, (void*) i);
+		int err = create_worker(&threads[i], i, run_async);
 		if (err != 0) {
 			printf("pthread_create returned %d\n", err);
 			return err;
@@ -201,25 +752,89 @@ int main(int argc, char *argv[])
 		}
 	}
 	gettimeofday(&end, NULL);
-	printf("Hash table v1: %'lu usec\n", usec_diff(&start, &end));
+	printf("Hash table v2 async: %'lu usec\n", usec_diff(&start, &end));
+	printf("  - %'lu missing\n", count_missing_async());
+	hash_table_async_destroy(hash_table_async);
+	free(async_queues);
+	hash_table_v2_destroy(hash_table);
+	return 0;
+}
 
-	missing = 0;
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_v1_contains(hash_table_v1, string)) {
-				++missing;
+/* Same check as the other tables, through contains_many, plus
+ * get_values has to find every key's index */
+static size_t count_missing_v2_batched(void)
+{
+	size_t count = (size_t) arguments.threads * arguments.size;
+	const char **keys = calloc(arguments.batch, sizeof(char *));
+	bool *results = calloc(arguments.batch, sizeof(bool));
+	uint32_t *values = calloc(arguments.batch, sizeof(uint32_t));
+	size_t missing = 0;
+	for (size_t i = 0; i < count; i += arguments.batch) {
+		size_t group = 0;
+		for (; group < arguments.batch && i + group < count; ++group) {
+			keys[group] = get_string(i + group);
+		}
+		hash_table_v2_contains_many(hash_table_v2, keys, results, group);
+		size_t group_missing = 0;
+		for (size_t j = 0; j < group; ++j) {
+			if (!results[j]) {
+				++group_missing;
+			}
+		}
+		//get_values asserts every key is there
+		if (group_missing == 0) {
+			hash_table_v2_get_values(hash_table_v2, keys, values, group);
+			for (size_t j = 0; j < group; ++j) {
+				if (values[j] != i + j) {
+					++group_missing;
+				}
 			}
 		}
+		missing += group_missing;
 	}
-	printf("  - %'lu missing\n", missing);
-	hash_table_v1_destroy(hash_table_v1);
+	free(keys);
+	free(results);
+	free(values);
+	return missing;
+}
+
+struct iterate_result {
+	_Alignas(CACHE_LINE_SIZE) size_t visited;
+	//keys whose value isn't the index of one of their inserts
+	size_t wrong;
+};
+
+static struct iterate_result *iterate_results;
+
+static void check_visit(void *context, const char *key, uint64_t value)
+{
+	struct iterate_result *result = context;
+	++result->visited;
+	if (value >= key_set.count || strcmp(get_string(value), key) != 0) {
+		++result->wrong;
+	}
+}
 
-	hash_table_v2 = hash_table_v2_create();
+/* Every thread walks its own share of the slices */
+void *run_iterate(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	size_t first = (size_t) HASH_TABLE_V2_SLICES * thread / arguments.threads;
+	size_t last = (size_t) HASH_TABLE_V2_SLICES * (thread + 1) / arguments.threads;
+	hash_table_v2_for_each_range(hash_table_v2, first, last, check_visit, &iterate_results[thread]);
+	return NULL;
+}
+
+/* Walks hash_table_v2 in parallel and checks every key turns up once, then
+ * destroys it. A key's value is the index of one of its inserts, so the
+ * distinct keys are the indices that hold their own value. */
+static int report_iteration(pthread_t *threads)
+{
+	struct timeval start, end;
+	iterate_results = aligned_alloc(CACHE_LINE_SIZE, arguments.threads * sizeof(struct iterate_result));
+	memset(iterate_results, 0, arguments.threads * sizeof(struct iterate_result));
 	gettimeofday(&start, NULL);
 	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_create(&threads[i], NULL, run_v2, (void*) i);
+		int err = create_worker(&threads[i], i, run_iterate);
 		if (err != 0) {
 			printf("pthread_create returned %d\n", err);
 			return err;
@@ -233,23 +848,1483 @@ int main(int argc, char *argv[])
 		}
 	}
 	gettimeofday(&end, NULL);
-	printf("Hash table v2: %'lu usec\n", usec_diff(&start, &end));
+	printf("Hash table v2 iterate: %'lu usec\n", usec_diff(&start, &end));
 
-	missing = 0;
+	size_t visited = 0;
+	size_t wrong = 0;
 	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_v2_contains(hash_table_v2, string)) {
-				++missing;
-			}
+		visited += iterate_results[i].visited;
+		wrong += iterate_results[i].wrong;
+	}
+	size_t distinct = 0;
+	for (size_t i = 0; i < (size_t) arguments.threads * arguments.size; ++i) {
+		if (hash_table_v2_get_value64(hash_table_v2, get_string(i)) == i) {
+			++distinct;
 		}
 	}
-	printf("  - %'lu missing\n", missing);
-	hash_table_v2_destroy(hash_table_v2);
+	printf("  - %'lu of %'lu keys visited, %'lu wrong values\n", visited, distinct, wrong);
+	free(iterate_results);
+
+	gettimeofday(&start, NULL);
+	hash_table_v2_destroy_parallel(hash_table_v2, arguments.threads);
+	gettimeofday(&end, NULL);
+	printf("Hash table v2 destroy: %'lu usec\n", usec_diff(&start, &end));
+	return 0;
+}
+
+static struct hash_table_v3 *hash_table_v3;
+
+void *run_v3(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v3_add_entry(hash_table_v3, string, global_index);
+	}
+	return NULL;
+}
+
+static struct hash_table_v4 *hash_table_v4;
+
+void *run_v4(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v4_add_entry(hash_table_v4, string, global_index);
+	}
+	return NULL;
+}
+
+/* The concurrent tables behind one interface so every workload can run
+ * against each of them */
+struct table {
+	const char *name;
+	void *(*create)(void);
+	void (*add_entry)(void *hash_table, const char *key, uint32_t value);
+	bool (*contains)(void *hash_table, const char *key);
+	void (*destroy)(void *hash_table);
+	/* NULL when the table keeps no counters */
+	void (*stats)(void *hash_table, FILE *out);
+	/* Waits for queued inserts, NULL when add_entry is synchronous */
+	void (*flush)(void *hash_table);
+	/* NULL when the table can't remove keys */
+	bool (*remove)(void *hash_table, const char *key);
+	/* Returns the value before, NULL when the table has no atomic add */
+	uint64_t (*fetch_add)(void *hash_table, const char *key, uint64_t delta);
+	/* Batched lookups for --batch, NULL when the table has none */
+	void (*lookup_many)(void *hash_table, const char *const *keys, bool *found,
+	                    uint64_t *values, size_t count);
+};
+
+static void *table_v1_create(void) { return hash_table_v1_create_with_lock(arguments.v1_lock); }
+static void table_v1_add_entry(void *t, const char *key, uint32_t value) { hash_table_v1_add_entry(t, key, value); }
+static bool table_v1_contains(void *t, const char *key) { return hash_table_v1_contains(t, key); }
+static void table_v1_destroy(void *t) { hash_table_v1_destroy(t); }
+static void table_v1_stats(void *t, FILE *out) { hash_table_v1_stats(t, out); }
+
+static void *table_v2_create(void) { return hash_table_v2_create_with_options(&arguments.v2_options); }
+static void table_v2_add_entry(void *t, const char *key, uint32_t value) { hash_table_v2_add_entry(t, key, value); }
+static bool table_v2_contains(void *t, const char *key) { return hash_table_v2_contains(t, key); }
+static void table_v2_destroy(void *t) { hash_table_v2_destroy(t); }
+static void table_v2_stats(void *t, FILE *out) { hash_table_v2_stats(t, out); }
+static bool table_v2_remove(void *t, const char *key) { return hash_table_v2_remove(t, key); }
+static uint64_t table_v2_fetch_add(void *t, const char *key, uint64_t delta) { return hash_table_v2_fetch_add(t, key, delta); }
+static void table_v2_lookup_many(void *t, const char *const *keys, bool *found, uint64_t *values, size_t count) { hash_table_v2_lookup_many(t, keys, found, values, count); }
+
+static void *table_v3_create(void) { return hash_table_v3_create(); }
+static void table_v3_add_entry(void *t, const char *key, uint32_t value) { hash_table_v3_add_entry(t, key, value); }
+static bool table_v3_contains(void *t, const char *key) { return hash_table_v3_contains(t, key); }
+static void table_v3_destroy(void *t) { hash_table_v3_destroy(t); }
+static bool table_v3_remove(void *t, const char *key) { return hash_table_v3_remove(t, key); }
+
+static void *table_v4_create(void) { return hash_table_v4_create(); }
+static void table_v4_add_entry(void *t, const char *key, uint32_t value) { hash_table_v4_add_entry(t, key, value); }
+static bool table_v4_contains(void *t, const char *key) { return hash_table_v4_contains(t, key); }
+static void table_v4_destroy(void *t) { hash_table_v4_destroy(t); }
+static bool table_v4_remove(void *t, const char *key) { return hash_table_v4_remove(t, key); }
+
+/* The fixed width tables read exactly width bytes of every key and copy
+ * them in, so each key is NUL padded to the width in a buffer on the
+ * stack. A key as long as the width fills it without a terminator, only
+ * tables the longest key fits are run. */
+#define PADDED_KEY(width, key)                                  \
+	char padded[width] = { 0 };                             \
+	memcpy(padded, key, strnlen(key, width));
+
+static void *table_fixed8_create(void) { return hash_table_fixed8_create(); }
+static void table_fixed8_add_entry(void *t, const char *key, uint32_t value) { PADDED_KEY(8, key) hash_table_fixed8_add_entry(t, padded, value); }
+static bool table_fixed8_contains(void *t, const char *key) { PADDED_KEY(8, key) return hash_table_fixed8_contains(t, padded); }
+static void table_fixed8_destroy(void *t) { hash_table_fixed8_destroy(t); }
+static bool table_fixed8_remove(void *t, const char *key) { PADDED_KEY(8, key) return hash_table_fixed8_remove(t, padded); }
+
+static void *table_fixed16_create(void) { return hash_table_fixed16_create(); }
+static void table_fixed16_add_entry(void *t, const char *key, uint32_t value) { PADDED_KEY(16, key) hash_table_fixed16_add_entry(t, padded, value); }
+static bool table_fixed16_contains(void *t, const char *key) { PADDED_KEY(16, key) return hash_table_fixed16_contains(t, padded); }
+static void table_fixed16_destroy(void *t) { hash_table_fixed16_destroy(t); }
+static bool table_fixed16_remove(void *t, const char *key) { PADDED_KEY(16, key) return hash_table_fixed16_remove(t, padded); }
+
+static void *table_fixed32_create(void) { return hash_table_fixed32_create(); }
+static void table_fixed32_add_entry(void *t, const char *key, uint32_t value) { PADDED_KEY(32, key) hash_table_fixed32_add_entry(t, padded, value); }
+static bool table_fixed32_contains(void *t, const char *key) { PADDED_KEY(32, key) return hash_table_fixed32_contains(t, padded); }
+static void table_fixed32_destroy(void *t) { hash_table_fixed32_destroy(t); }
+static bool table_fixed32_remove(void *t, const char *key) { PADDED_KEY(32, key) return hash_table_fixed32_remove(t, padded); }
+
+/* Owners are placed like the workers, so owner i shares a cpu with worker i */
+
+static int setup_owner(size_t shard, pthread_attr_t *attr)
+{
+	return placement_thread_attr(&arguments.placement, shard, attr);
+}
+
+static void *table_sharded_create(void) { return hash_table_sharded_create(arguments.shards, setup_owner); }
+static void table_sharded_add_entry(void *t, const char *key, uint32_t value) { hash_table_sharded_add_entry(t, key, value); }
+static bool table_sharded_contains(void *t, const char *key) { return hash_table_sharded_contains(t, key); }
+static void table_sharded_destroy(void *t) { hash_table_sharded_destroy(t); }
+static void table_sharded_flush(void *t) { hash_table_sharded_flush(t); }
+
+static const struct table table_v1 = {
+	"v1", table_v1_create, table_v1_add_entry, table_v1_contains, table_v1_destroy,
+	table_v1_stats, NULL, NULL, NULL, NULL
+};
+static const struct table table_v2 = {
+	"v2", table_v2_create, table_v2_add_entry, table_v2_contains, table_v2_destroy,
+	table_v2_stats, NULL, table_v2_remove, table_v2_fetch_add, table_v2_lookup_many
+};
+static const struct table table_v3 = {
+	"v3", table_v3_create, table_v3_add_entry, table_v3_contains, table_v3_destroy,
+	NULL, NULL, table_v3_remove, NULL, NULL
+};
+static const struct table table_v4 = {
+	"v4", table_v4_create, table_v4_add_entry, table_v4_contains, table_v4_destroy,
+	NULL, NULL, table_v4_remove, NULL, NULL
+};
+static const struct table table_fixed8 = {
+	"fixed8", table_fixed8_create, table_fixed8_add_entry, table_fixed8_contains,
+	table_fixed8_destroy, NULL, NULL, table_fixed8_remove, NULL, NULL
+};
+static const struct table table_fixed16 = {
+	"fixed16", table_fixed16_create, table_fixed16_add_entry, table_fixed16_contains,
+	table_fixed16_destroy, NULL, NULL, table_fixed16_remove, NULL, NULL
+};
+static const struct table table_fixed32 = {
+	"fixed32", table_fixed32_create, table_fixed32_add_entry, table_fixed32_contains,
+	table_fixed32_destroy, NULL, NULL, table_fixed32_remove, NULL, NULL
+};
+static const struct table *fixed_tables[] = { &table_fixed8, &table_fixed16, &table_fixed32 };
+static const size_t fixed_widths[] = { 8, 16, 32 };
+
+#define FIXED_TABLES (sizeof(fixed_tables) / sizeof(fixed_tables[0]))
+
+/* Whether --fixed runs fixed_tables[i] on the current keys */
+static bool fixed_table_fits(size_t i)
+{
+	if (!arguments.fixed) {
+		return false;
+	}
+	for (size_t j = 0; j < key_set.count; ++j) {
+		if (strnlen(key_set.keys[j], fixed_widths[i] + 1) > fixed_widths[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+static const struct table table_sharded = {
+	"sharded", table_sharded_create, table_sharded_add_entry, table_sharded_contains,
+	table_sharded_destroy, NULL, table_sharded_flush, NULL, NULL, NULL
+};
+
+/* Log-linear latency histogram in the style of HdrHistogram: values below
+ * LATENCY_SUB_BUCKETS get their own bucket, above that every power of two
+ * is split into LATENCY_SUB_BUCKETS / 2 buckets, about 6% precision */
+#define LATENCY_SUB_BITS 5
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 2) * (LATENCY_SUB_BUCKETS / 2))
+
+struct latency_histogram {
+	uint64_t counts[LATENCY_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+static size_t latency_bucket(uint64_t nsec)
+{
+	if (nsec < LATENCY_SUB_BUCKETS) {
+		return nsec;
+	}
+	unsigned shift = (63 - __builtin_clzll(nsec)) - LATENCY_SUB_BITS + 1;
+	return shift * (LATENCY_SUB_BUCKETS / 2) + (nsec >> shift);
+}
+
+/* Highest value that lands in the bucket */
+static uint64_t latency_bucket_value(size_t bucket)
+{
+	if (bucket < LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+	unsigned shift = bucket / (LATENCY_SUB_BUCKETS / 2) - 1;
+	uint64_t mantissa = bucket - shift * (LATENCY_SUB_BUCKETS / 2);
+	return (mantissa << shift) + ((1ull << shift) - 1);
+}
+
+static void latency_record(struct latency_histogram *histogram, uint64_t nsec)
+{
+	++histogram->counts[latency_bucket(nsec)];
+	++histogram->total;
+	if (nsec > histogram->max) {
+		histogram->max = nsec;
+	}
+}
+
+static void latency_merge(struct latency_histogram *into, const struct latency_histogram *from)
+{
+	for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+		into->counts[i] += from->counts[i];
+	}
+	into->total += from->total;
+	if (from->max > into->max) {
+		into->max = from->max;
+	}
+}
+
+/* Smallest recorded bucket value at or above the given percentage of samples */
+static uint64_t latency_percentile(const struct latency_histogram *histogram, double percentile)
+{
+	if (histogram->total == 0) {
+		return 0;
+	}
+	uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total);
+	if (rank >= histogram->total) {
+		rank = histogram->total - 1;
+	}
+	uint64_t seen = 0;
+	for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+		seen += histogram->counts[i];
+		if (seen > rank) {
+			uint64_t value = latency_bucket_value(i);
+			return value < histogram->max ? value : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/* Padded so threads counting their own operations don't false share */
+struct thread_result {
+	_Alignas(CACHE_LINE_SIZE) size_t reads;
+	size_t writes;
+	size_t hits;
+	uint64_t nsec;
+	//only allocated with --latency
+	struct latency_histogram *read_latency;
+	struct latency_histogram *write_latency;
+};
+
+struct workload_state {
+	const struct table *table;
+	void *hash_table;
+	struct thread_result *results;
+	atomic_bool writers_done;
+};
+
+static struct workload_state workload_state;
+
+/* xorshift64, enough to pick keys without a shared rand() state */
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static void do_lookup(struct thread_result *result, const char *key)
+{
+	uint64_t start = result->read_latency != NULL ? now_nsec() : 0;
+	if (workload_state.table->contains(workload_state.hash_table, key)) {
+		++result->hits;
+	}
+	if (result->read_latency != NULL) {
+		latency_record(result->read_latency, now_nsec() - start);
+	}
+	++result->reads;
+}
+
+static void do_insert(struct thread_result *result, size_t global_index)
+{
+	uint64_t start = result->write_latency != NULL ? now_nsec() : 0;
+	workload_state.table->add_entry(workload_state.hash_table,
+	                                get_string(global_index), global_index);
+	if (result->write_latency != NULL) {
+		latency_record(result->write_latency, now_nsec() - start);
+	}
+	++result->writes;
+}
+
+/* Saves hash_table_v3, maps the file back and looks every key up in the
+ * mapped copy */
+static int report_snapshot(void)
+{
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	int err = hash_table_v3_save(hash_table_v3, arguments.snapshot);
+	gettimeofday(&end, NULL);
+	if (err != 0) {
+		fprintf(stderr, "saving %s failed: %s\n", arguments.snapshot, strerror(err));
+		return err;
+	}
+	printf("Hash table v3 save: %'lu usec\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	struct hash_table_v3 *mapped = hash_table_v3_open_mmap(arguments.snapshot);
+	gettimeofday(&end, NULL);
+	if (mapped == NULL) {
+		err = errno;
+		fprintf(stderr, "opening %s failed: %s\n", arguments.snapshot, strerror(err));
+		return err;
+	}
+	printf("Hash table v3 open: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v3_contains(mapped, string)
+			    || hash_table_v3_get_value(mapped, string) != hash_table_v3_get_value(hash_table_v3, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	hash_table_v3_destroy(mapped);
+	return 0;
+}
+
+/* Same as run_v1/run_v2, every thread inserts its own slice */
+static void *run_insert(void *arg)
+{
+	uint32_t thread = (uintptr_t) arg;
+	struct thread_result *result = &workload_state.results[thread];
+	uint64_t start = now_nsec();
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		do_insert(result, get_global_index(thread, j));
+	}
+	result->nsec = now_nsec() - start;
+	return NULL;
+}
+
+/* One batch of lookups, a key only hits if its value is its index too.
+ * The batch's time is recorded once per key. */
+static void do_lookup_many(struct thread_result *result,
+                           const char **keys,
+                           const size_t *indexes,
+                           bool *found,
+                           uint64_t *values,
+                           size_t count)
+{
+	uint64_t start = result->read_latency != NULL ? now_nsec() : 0;
+	workload_state.table->lookup_many(workload_state.hash_table, keys, found, values, count);
+	uint64_t nsec = result->read_latency != NULL ? (now_nsec() - start) / count : 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (found[i] && values[i] == indexes[i]) {
+			++result->hits;
+		}
+		if (result->read_latency != NULL) {
+			latency_record(result->read_latency, nsec);
+		}
+	}
+	result->reads += count;
+}
+
+/* Looks up random keys from the whole key set, in batches of --batch keys
+ * if the table has batched lookups */
+static void *run_lookup(void *arg)
+{
+	uint32_t thread = (uintptr_t) arg;
+	struct thread_result *result = &workload_state.results[thread];
+	size_t count = (size_t) arguments.threads * arguments.size;
+	uint64_t random = 0x9e3779b97f4a7c15ull * (thread + 1);
+	uint32_t batch = workload_state.table->lookup_many != NULL ? arguments.batch : 0;
+	const char **keys = NULL;
+	size_t *indexes = NULL;
+	bool *found = NULL;
+	uint64_t *values = NULL;
+	if (batch > 1) {
+		keys = calloc(batch, sizeof(char *));
+		indexes = calloc(batch, sizeof(size_t));
+		found = calloc(batch, sizeof(bool));
+		values = calloc(batch, sizeof(uint64_t));
+	}
+	uint64_t start = now_nsec();
+	for (uint32_t j = 0; j < arguments.size;) {
+		if (batch <= 1) {
+			do_lookup(result, get_string(next_random(&random) % count));
+			++j;
+			continue;
+		}
+		size_t group = 0;
+		for (; group < batch && j < arguments.size; ++group, ++j) {
+			indexes[group] = next_random(&random) % count;
+			keys[group] = get_string(indexes[group]);
+		}
+		do_lookup_many(result, keys, indexes, found, values, group);
+	}
+	result->nsec = now_nsec() - start;
+	free(keys);
+	free(indexes);
+	free(found);
+	free(values);
+	return NULL;
+}
+
+/* The first half of every slice is prefilled, reads pick from those and
+ * writes insert the thread's second half in order, then update it again */
+static void *run_mixed(void *arg)
+{
+	uint32_t thread = (uintptr_t) arg;
+	struct thread_result *result = &workload_state.results[thread];
+	uint32_t half = arguments.size / 2;
+	uint32_t next_write = half;
+	uint64_t random = 0x9e3779b97f4a7c15ull * (thread + 1);
+	uint64_t start = now_nsec();
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		uint64_t r = next_random(&random);
+		if (half == 0 || r % 100 >= arguments.read_percent) {
+			do_insert(result, get_global_index(thread, next_write));
+			if (++next_write == arguments.size) {
+				next_write = half;
+			}
+			continue;
+		}
+		uint32_t reader = (r >> 32) % arguments.threads;
+		do_lookup(result, get_string(get_global_index(reader, (r >> 8) % half)));
+	}
+	result->nsec = now_nsec() - start;
+	return NULL;
+}
+
+/* Removes are timed and counted as writes like inserts */
+static void do_remove(struct thread_result *result, size_t global_index)
+{
+	uint64_t start = result->write_latency != NULL ? now_nsec() : 0;
+	workload_state.table->remove(workload_state.hash_table, get_string(global_index));
+	if (result->write_latency != NULL) {
+		latency_record(result->write_latency, now_nsec() - start);
+	}
+	++result->writes;
+}
+
+/* Inserts and removes both count as writes, every lookup should hit */
+static void *run_churn(void *arg)
+{
+	uint32_t thread = (uintptr_t) arg;
+	struct thread_result *result = &workload_state.results[thread];
+	uint32_t half = arguments.size / 2;
+	uint64_t start = now_nsec();
+	for (uint32_t j = 0; j < arguments.size - half; ++j) {
+		do_insert(result, get_global_index(thread, half + j));
+		if (j < half) {
+			do_remove(result, get_global_index(thread, j));
+		}
+		do_lookup(result, get_string(get_global_index(thread, half + j)));
+	}
+	result->nsec = now_nsec() - start;
+	return NULL;
+}
+
+/* After a churn only the second half of every slice is left */
+static void check_churn(const struct table *table)
+{
+	size_t missing = 0;
+	size_t not_removed = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			bool found = table->contains(workload_state.hash_table,
+			                             get_string(get_global_index(i, j)));
+			if (j < arguments.size / 2 && found) {
+				++not_removed;
+			}
+			else if (j >= arguments.size / 2 && !found) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing, %'lu not removed\n", missing, not_removed);
+}
+
+/* Every add counts as a write */
+static void *run_counters(void *arg)
+{
+	uint32_t thread = (uintptr_t) arg;
+	struct thread_result *result = &workload_state.results[thread];
+	size_t count = (size_t) arguments.threads * arguments.size;
+	uint64_t random = 0x9e3779b97f4a7c15ull * (thread + 1);
+	uint64_t start = now_nsec();
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		const char *key = get_string(next_random(&random) % count);
+		uint64_t write_start = result->write_latency != NULL ? now_nsec() : 0;
+		workload_state.table->fetch_add(workload_state.hash_table, key, 1);
+		if (result->write_latency != NULL) {
+			latency_record(result->write_latency, now_nsec() - write_start);
+		}
+		++result->writes;
+	}
+	result->nsec = now_nsec() - start;
+	return NULL;
+}
+
+/* The counters have to add up to every add made. Each key is removed once
+ * it was counted, so keys that appear twice in the key set count once. */
+static void check_counters(const struct table *table)
+{
+	uint64_t total = 0;
+	size_t count = (size_t) arguments.threads * arguments.size;
+	for (size_t i = 0; i < count; ++i) {
+		const char *key = get_string(i);
+		total += table->fetch_add(workload_state.hash_table, key, 0);
+		table->remove(workload_state.hash_table, key);
+	}
+	printf("  - %'lu lost updates\n", (unsigned long) (count - total));
+}
+
+/* Even threads insert their slice, odd threads look up random keys until
+ * every writer is done */
+static void *run_concurrent(void *arg)
+{
+	uint32_t thread = (uintptr_t) arg;
+	struct thread_result *result = &workload_state.results[thread];
+	size_t count = (size_t) arguments.threads * arguments.size;
+	uint64_t random = 0x9e3779b97f4a7c15ull * (thread + 1);
+	uint64_t start = now_nsec();
+	if (thread % 2 == 0) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			do_insert(result, get_global_index(thread, j));
+		}
+	}
+	else {
+		while (!atomic_load_explicit(&workload_state.writers_done, memory_order_relaxed)) {
+			do_lookup(result, get_string(next_random(&random) % count));
+		}
+	}
+	result->nsec = now_nsec() - start;
+	return NULL;
+}
+
+static double per_second(size_t operations, uint64_t nsec)
+{
+	return nsec > 0 ? operations / (nsec / 1e9) : 0.0;
+}
+
+static const double percentiles[] = { 50.0, 99.0, 99.9 };
+static const char *percentile_names[] = { "p50", "p99", "p999" };
+#define PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+static void print_latency_text(const char *name, const struct latency_histogram *histogram)
+{
+	if (histogram->total == 0) {
+		return;
+	}
+	printf("  - %s latency:", name);
+	for (size_t i = 0; i < PERCENTILES; ++i) {
+		printf(" %s %'lu ns,", percentile_names[i],
+		       (unsigned long) latency_percentile(histogram, percentiles[i]));
+	}
+	printf(" max %'lu ns\n", (unsigned long) histogram->max);
+}
+
+static void print_latency_csv(const struct latency_histogram *histogram)
+{
+	for (size_t i = 0; i < PERCENTILES; ++i) {
+		printf(",%lu", (unsigned long) latency_percentile(histogram, percentiles[i]));
+	}
+	printf(",%lu", (unsigned long) histogram->max);
+}
+
+static void print_latency_json(const char *name, const struct latency_histogram *histogram)
+{
+	printf(", \"%s_latency_ns\": {", name);
+	for (size_t i = 0; i < PERCENTILES; ++i) {
+		printf("\"%s\": %lu, ", percentile_names[i],
+		       (unsigned long) latency_percentile(histogram, percentiles[i]));
+	}
+	printf("\"max\": %lu}", (unsigned long) histogram->max);
+}
+
+static void print_csv_header(void)
+{
+	printf("table,workload,threads,size,placement,thread,location,usec,lookups,inserts,"
+	       "hits,lookups_per_sec,inserts_per_sec");
+	if (arguments.latency) {
+		for (size_t i = 0; i < 2; ++i) {
+			const char *name = i == 0 ? "lookup" : "insert";
+			for (size_t j = 0; j < PERCENTILES; ++j) {
+				printf(",%s_%s_ns", name, percentile_names[j]);
+			}
+			printf(",%s_max_ns", name);
+		}
+	}
+	printf("\n");
+}
+
+/* thread is -1 for the whole run */
+static void print_csv_row(const struct table *table, int thread,
+                          const struct thread_result *result,
+                          uint64_t nsec)
+{
+	char placement[64];
+	placement_describe(&arguments.placement, placement, sizeof(placement));
+	printf("%s,%s,%u,%u,%s,", table->name, workload_names[arguments.workload],
+	       arguments.threads, arguments.size, placement);
+	if (thread < 0) {
+		printf("all,");
+	}
+	else {
+		char location[32];
+		placement_describe_thread(&arguments.placement, thread, location, sizeof(location));
+		printf("%d,%s", thread, location);
+	}
+	printf(",%lu,%zu,%zu,%zu,%.0f,%.0f", (unsigned long) (nsec / 1000),
+	       result->reads, result->writes, result->hits,
+	       per_second(result->reads, nsec), per_second(result->writes, nsec));
+	if (arguments.latency) {
+		print_latency_csv(result->read_latency);
+		print_latency_csv(result->write_latency);
+	}
+	printf("\n");
+}
+
+static void print_results(const struct table *table,
+                          const struct thread_result *total,
+                          uint64_t nsec)
+{
+	const struct thread_result *results = workload_state.results;
+	char placement[64];
+	switch (arguments.format) {
+	case FORMAT_TEXT:
+		printf("Hash table %s %s: %'lu usec\n", table->name,
+		       workload_names[arguments.workload], (unsigned long) (nsec / 1000));
+		printf("  - %'.0f lookups/s, %'.0f inserts/s, %'lu of %'lu lookups hit\n",
+		       per_second(total->reads, nsec), per_second(total->writes, nsec),
+		       total->hits, total->reads);
+		if (arguments.latency) {
+			print_latency_text("lookup", total->read_latency);
+			print_latency_text("insert", total->write_latency);
+		}
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			char location[32] = "";
+			if (arguments.placed) {
+				location[0] = ' ';
+				location[1] = '(';
+				placement_describe_thread(&arguments.placement, i, location + 2,
+				                          sizeof(location) - 3);
+				strcat(location, ")");
+			}
+			printf("  - thread %u%s: %'.0f lookups/s, %'.0f inserts/s\n", i, location,
+			       per_second(results[i].reads, results[i].nsec),
+			       per_second(results[i].writes, results[i].nsec));
+		}
+		break;
+	case FORMAT_CSV:
+		print_csv_row(table, -1, total, nsec);
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			print_csv_row(table, i, &results[i], results[i].nsec);
+		}
+		break;
+	case FORMAT_JSON:
+		placement_describe(&arguments.placement, placement, sizeof(placement));
+		printf("{\"table\": \"%s\", \"workload\": \"%s\", \"threads\": %u, \"size\": %u, "
+		       "\"placement\": \"%s\", \"usec\": %lu, \"lookups\": %zu, \"inserts\": %zu, \"hits\": %zu, "
+		       "\"lookups_per_sec\": %.0f, \"inserts_per_sec\": %.0f",
+		       table->name, workload_names[arguments.workload], arguments.threads,
+		       arguments.size, placement, (unsigned long) (nsec / 1000), total->reads,
+		       total->writes, total->hits, per_second(total->reads, nsec),
+		       per_second(total->writes, nsec));
+		if (arguments.latency) {
+			print_latency_json("lookup", total->read_latency);
+			print_latency_json("insert", total->write_latency);
+		}
+		printf(", \"per_thread\": [");
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			char location[32];
+			placement_describe_thread(&arguments.placement, i, location, sizeof(location));
+			printf("%s{\"location\": \"%s\", \"lookups_per_sec\": %.0f, \"inserts_per_sec\": %.0f}",
+			       i == 0 ? "" : ", ", location, per_second(results[i].reads, results[i].nsec),
+			       per_second(results[i].writes, results[i].nsec));
+		}
+		printf("]}\n");
+		break;
+	}
+}
+
+static int run_workload(const struct table *table, pthread_t *threads)
+{
+	if (arguments.workload == WORKLOAD_CHURN && table->remove == NULL) {
+		return 0;
+	}
+	if (arguments.workload == WORKLOAD_COUNTERS && table->fetch_add == NULL) {
+		return 0;
+	}
+	workload_state.table = table;
+	workload_state.hash_table = table->create();
+	workload_state.results = aligned_alloc(CACHE_LINE_SIZE,
+	                                       arguments.threads * sizeof(struct thread_result));
+	memset(workload_state.results, 0, arguments.threads * sizeof(struct thread_result));
+	if (arguments.latency) {
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			workload_state.results[i].read_latency = calloc(1, sizeof(struct latency_histogram));
+			workload_state.results[i].write_latency = calloc(1, sizeof(struct latency_histogram));
+		}
+	}
+	atomic_store(&workload_state.writers_done, false);
+
+	void *(*run)(void *) = NULL;
+	switch (arguments.workload) {
+	case WORKLOAD_INSERT:
+		run = run_insert;
+		break;
+	case WORKLOAD_LOOKUP:
+		run = run_lookup;
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			for (uint32_t j = 0; j < arguments.size; ++j) {
+				size_t global_index = get_global_index(i, j);
+				table->add_entry(workload_state.hash_table, get_string(global_index), global_index);
+			}
+		}
+		break;
+	case WORKLOAD_MIXED:
+		run = run_mixed;
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			for (uint32_t j = 0; j < arguments.size / 2; ++j) {
+				size_t global_index = get_global_index(i, j);
+				table->add_entry(workload_state.hash_table, get_string(global_index), global_index);
+			}
+		}
+		break;
+	case WORKLOAD_CONCURRENT:
+		run = run_concurrent;
+		break;
+	case WORKLOAD_CHURN:
+		run = run_churn;
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			for (uint32_t j = 0; j < arguments.size / 2; ++j) {
+				size_t global_index = get_global_index(i, j);
+				table->add_entry(workload_state.hash_table, get_string(global_index), global_index);
+			}
+		}
+		break;
+	case WORKLOAD_COUNTERS:
+		run = run_counters;
+		break;
+	}
+
+	uint64_t start = now_nsec();
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = create_worker(&threads[i], i, run);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	//writers are the even threads, join those first so readers know to stop
+	for (uintptr_t i = 0; i < arguments.threads; i += 2) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	atomic_store(&workload_state.writers_done, true);
+	for (uintptr_t i = 1; i < arguments.threads; i += 2) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	if (table->flush != NULL) {
+		table->flush(workload_state.hash_table);
+	}
+	uint64_t nsec = now_nsec() - start;
+
+	struct thread_result total = { 0 };
+	if (arguments.latency) {
+		total.read_latency = calloc(1, sizeof(struct latency_histogram));
+		total.write_latency = calloc(1, sizeof(struct latency_histogram));
+	}
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		struct thread_result *result = &workload_state.results[i];
+		total.reads += result->reads;
+		total.writes += result->writes;
+		total.hits += result->hits;
+		if (arguments.latency) {
+			latency_merge(total.read_latency, result->read_latency);
+			latency_merge(total.write_latency, result->write_latency);
+		}
+	}
+	print_results(table, &total, nsec);
+	if (arguments.workload == WORKLOAD_CHURN && arguments.format == FORMAT_TEXT) {
+		check_churn(table);
+	}
+	if (arguments.workload == WORKLOAD_COUNTERS && arguments.format == FORMAT_TEXT) {
+		check_counters(table);
+	}
+
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		free(workload_state.results[i].read_latency);
+		free(workload_state.results[i].write_latency);
+	}
+	free(total.read_latency);
+	free(total.write_latency);
+	free(workload_state.results);
+	//counters go to stderr so csv and json output stays parseable
+	if (arguments.stats && table->stats != NULL) {
+		fprintf(stderr, "Hash table %s stats:\n", table->name);
+		table->stats(workload_state.hash_table, stderr);
+	}
+	table->destroy(workload_state.hash_table);
+	return 0;
+}
+
+/* Runs v2 and the sharded table at 1, 2, 4, ... threads up to -t, every
+ * thread still works on its own slice of -s keys */
+static int run_sharded_comparison(pthread_t *threads)
+{
+	uint32_t max_threads = arguments.threads;
+	int err = 0;
+	for (uint32_t count = 1; err == 0; count *= 2) {
+		arguments.threads = count < max_threads ? count : max_threads;
+		err = run_workload(&table_v2, threads);
+		if (err == 0) {
+			err = run_workload(&table_sharded, threads);
+		}
+		if (arguments.threads == max_threads) {
+			break;
+		}
+	}
+	arguments.threads = max_threads;
+	return err;
+}
+
+/* The part of the plain insert run the sweep times, every thread adds its
+ * slice to workload_state's table */
+static void *run_sweep_insert(void *arg)
+{
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		workload_state.table->add_entry(workload_state.hash_table,
+		                                get_string(global_index), global_index);
+	}
+	return NULL;
+}
+
+static uint64_t time_base_insert(void)
+{
+	struct hash_table_base *hash_table_base = hash_table_base_create();
+	uint64_t start = now_nsec();
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			hash_table_base_add_entry(hash_table_base, get_string(global_index), global_index);
+		}
+	}
+	uint64_t usec = (now_nsec() - start) / 1000;
+	hash_table_base_destroy(hash_table_base);
+	return usec;
+}
+
+static int time_table_insert(const struct table *table, pthread_t *threads, uint64_t *usec)
+{
+	workload_state.table = table;
+	workload_state.hash_table = table->create();
+	uint64_t start = now_nsec();
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = create_worker(&threads[i], i, run_sweep_insert);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	if (table->flush != NULL) {
+		table->flush(workload_state.hash_table);
+	}
+	*usec = (now_nsec() - start) / 1000;
+	table->destroy(workload_state.hash_table);
+	return 0;
+}
+
+/* The plain insert run of a fixed width table, reported like the others */
+static int report_fixed(const struct table *table, pthread_t *threads)
+{
+	struct timeval start, end;
+	workload_state.table = table;
+	workload_state.hash_table = table->create();
+	gettimeofday(&start, NULL);
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = create_worker(&threads[i], i, run_sweep_insert);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table %s: %'lu usec\n", table->name, usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			if (!table->contains(workload_state.hash_table, get_string(global_index))) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	table->destroy(workload_state.hash_table);
+	return 0;
+}
+
+static int compare_usec(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return x < y ? -1 : (x > y);
+}
+
+struct sweep_result {
+	double median;
+	//sample standard deviation, 0 for a single run
+	double stddev;
+};
+
+/* Sorts usec */
+static struct sweep_result summarize_runs(uint64_t *usec, size_t runs)
+{
+	qsort(usec, runs, sizeof(uint64_t), compare_usec);
+	struct sweep_result result = { 0 };
+	result.median = runs % 2 == 1 ? usec[runs / 2] : (usec[runs / 2 - 1] + usec[runs / 2]) / 2.0;
+	double mean = 0;
+	for (size_t i = 0; i < runs; ++i) {
+		mean += usec[i];
+	}
+	mean /= runs;
+	for (size_t i = 0; i < runs && runs > 1; ++i) {
+		result.stddev += (usec[i] - mean) * (usec[i] - mean) / (runs - 1);
+	}
+	result.stddev = sqrt(result.stddev);
+	return result;
+}
+
+/* The lock rows' names are longer, the column only widens for them */
+static int sweep_name_width(void)
+{
+	return arguments.lock_sweep ? 11 : 8;
+}
+
+/* One row per table and configuration with fixed columns, so the output
+ * of two commits can be diffed. base runs on one thread. */
+static void print_sweep_row(const char *name,
+                            uint32_t threads,
+                            const struct sweep_result *result,
+                            const struct sweep_result *base)
+{
+	double speedup = result->median > 0 ? base->median / result->median : 0.0;
+	double efficiency = speedup / threads;
+	switch (arguments.format) {
+	case FORMAT_TEXT:
+		printf("%7u %10u %-*s %12.0f %10.0f %8.2f %10.2f\n", arguments.threads, arguments.size,
+		       sweep_name_width(), name, result->median, result->stddev, speedup, efficiency);
+		break;
+	case FORMAT_CSV:
+		printf("%u,%u,%s,%u,%.0f,%.0f,%.3f,%.3f\n", arguments.threads, arguments.size, name,
+		       arguments.repeat, result->median, result->stddev, speedup, efficiency);
+		break;
+	case FORMAT_JSON:
+		printf("{\"threads\": %u, \"size\": %u, \"table\": \"%s\", \"runs\": %u, "
+		       "\"median_usec\": %.0f, \"stddev_usec\": %.0f, \"speedup\": %.3f, "
+		       "\"efficiency\": %.3f}\n", arguments.threads, arguments.size, name,
+		       arguments.repeat, result->median, result->stddev, speedup, efficiency);
+		break;
+	}
+}
+
+/* Times v1 and v2 once with each lock kind that isn't the one they were
+ * given, the other rows already cover that one */
+static int sweep_lock_kinds(pthread_t *threads, uint64_t *usec, const struct sweep_result *base)
+{
+	enum hash_table_lock_kind v1_lock = arguments.v1_lock;
+	enum hash_table_v2_lock_kind v2_lock = arguments.v2_options.lock_kind;
+	int err = 0;
+	for (size_t k = 0; k < 2 && err == 0; ++k) {
+		const struct table *table = k == 0 ? &table_v1 : &table_v2;
+		enum hash_table_lock_kind given = k == 0 ? v1_lock : (enum hash_table_lock_kind) v2_lock;
+		for (size_t kind = 0; kind < LOCK_KINDS && err == 0; ++kind) {
+			if (kind == given) {
+				continue;
+			}
+			arguments.v1_lock = kind;
+			arguments.v2_options.lock_kind = kind;
+			for (uint32_t r = 0; r < arguments.repeat && err == 0; ++r) {
+				err = time_table_insert(table, threads, &usec[r]);
+			}
+			if (err == 0) {
+				char name[32];
+				snprintf(name, sizeof(name), "%s-%s", table->name, lock_names[kind]);
+				struct sweep_result result = summarize_runs(usec, arguments.repeat);
+				print_sweep_row(name, arguments.threads, &result, base);
+			}
+		}
+	}
+	arguments.v1_lock = v1_lock;
+	arguments.v2_options.lock_kind = v2_lock;
+	return err;
+}
+
+/* Times the plain inserts of every table for each pair of thread count
+ * and size, with freshly generated keys for each pair */
+static int run_sweep(void)
+{
+	//a list that wasn't given sweeps the -t or -s value alone
+	if (arguments.sweep_thread_count == 0) {
+		arguments.sweep_threads[arguments.sweep_thread_count++] = arguments.threads;
+	}
+	if (arguments.sweep_size_count == 0) {
+		arguments.sweep_sizes[arguments.sweep_size_count++] = arguments.size;
+	}
+	const struct table *tables[4 + FIXED_TABLES];
+	size_t table_count = 0;
+	tables[table_count++] = &table_v1;
+	tables[table_count++] = &table_v2;
+	if (arguments.v3) {
+		tables[table_count++] = &table_v3;
+	}
+	if (arguments.v4) {
+		tables[table_count++] = &table_v4;
+	}
+	//the fixed width tables go last, the ones a key is too long for are
+	//skipped per configuration
+	size_t fixed_count = arguments.fixed ? FIXED_TABLES : 0;
+	for (size_t i = 0; i < fixed_count; ++i) {
+		tables[table_count++] = fixed_tables[i];
+	}
+
+	switch (arguments.format) {
+	case FORMAT_TEXT:
+		printf("Sweep: %u runs per configuration\n", arguments.repeat);
+		printf("%7s %10s %-*s %12s %10s %8s %10s\n", "threads", "size", sweep_name_width(), "table",
+		       "median usec", "stddev", "speedup", "efficiency");
+		break;
+	case FORMAT_CSV:
+		printf("threads,size,table,runs,median_usec,stddev_usec,speedup,efficiency\n");
+		break;
+	case FORMAT_JSON:
+		break;
+	}
+
+	uint64_t *usec = calloc(arguments.repeat, sizeof(uint64_t));
+	int err = 0;
+	for (size_t i = 0; i < arguments.sweep_size_count && err == 0; ++i) {
+		for (size_t j = 0; j < arguments.sweep_thread_count && err == 0; ++j) {
+			arguments.size = arguments.sweep_sizes[i];
+			arguments.threads = arguments.sweep_threads[j];
+			err = generate_keys();
+			if (err != 0) {
+				break;
+			}
+			pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
+
+			for (uint32_t r = 0; r < arguments.repeat; ++r) {
+				usec[r] = time_base_insert();
+			}
+			struct sweep_result base = summarize_runs(usec, arguments.repeat);
+			print_sweep_row("base", 1, &base, &base);
+
+			for (size_t k = 0; k < table_count && err == 0; ++k) {
+				if (k >= table_count - fixed_count && !fixed_table_fits(k - (table_count - fixed_count))) {
+					continue;
+				}
+				for (uint32_t r = 0; r < arguments.repeat && err == 0; ++r) {
+					err = time_table_insert(tables[k], threads, &usec[r]);
+				}
+				if (err == 0) {
+					struct sweep_result result = summarize_runs(usec, arguments.repeat);
+					print_sweep_row(tables[k]->name, arguments.threads, &result, &base);
+				}
+			}
+			if (arguments.lock_sweep && err == 0) {
+				err = sweep_lock_kinds(threads, usec, &base);
+			}
+			free(threads);
+			key_set_destroy(&key_set);
+		}
+	}
+	free(usec);
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	arguments.threads = 4;
+	arguments.size = 25000;
+	arguments.read_percent = 95;
+	arguments.zipf_exponent = 1.0;
+	arguments.repeat = 5;
+  
+	static struct argp argp = { options, parse_opt };
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	setlocale(LC_ALL, "en_US.UTF-8");
+
+	if (arguments.placed) {
+		if (arguments.placement.pin != PLACEMENT_NONE
+		    && arguments.placement.numa != PLACEMENT_NONE) {
+			fprintf(stderr, "--pin and --numa can't be combined\n");
+			return EINVAL;
+		}
+		if (!placement_init()) {
+			fprintf(stderr, "thread placement isn't supported on this system\n");
+			return ENOTSUP;
+		}
+	}
+
+	if (arguments.sweep_thread_count > 0 || arguments.sweep_size_count > 0) {
+		if (arguments.input != NULL) {
+			fprintf(stderr, "--sweep-threads and --sweep-size need generated keys\n");
+			return EINVAL;
+		}
+		return run_sweep();
+	}
+
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	if (arguments.input != NULL) {
+		size_t limit = arguments.size_given ? (size_t) arguments.threads * arguments.size : 0;
+		int err = key_set_read(&key_set, arguments.input, limit);
+		if (err != 0) {
+			fprintf(stderr, "reading %s failed: %s\n", arguments.input, strerror(err));
+			return err;
+		}
+		if (key_set.count < arguments.threads) {
+			fprintf(stderr, "%s has fewer keys than there are threads\n", arguments.input);
+			return EINVAL;
+		}
+		//every thread gets an equal slice, the remainder is left out
+		arguments.size = key_set.count / arguments.threads;
+	}
+	else {
+		int err = generate_keys();
+		if (err != 0) {
+			return err;
+		}
+	}
+	gettimeofday(&end, NULL);
+	if (arguments.format == FORMAT_TEXT) {
+		printf("Generation: %'lu usec\n", usec_diff(&start, &end));
+		if (arguments.input != NULL) {
+			printf("Input: %'zu keys, %'u per thread\n", key_set.count, arguments.size);
+		}
+	}
+
+	//the keys stay where generation touched them, only the tables follow
+	//the memory policy
+	if (arguments.placed) {
+		int err = placement_apply_memory(&arguments.placement);
+		if (err != 0) {
+			fprintf(stderr, "setting the memory policy failed: %s\n", strerror(err));
+			return err;
+		}
+		if (arguments.format == FORMAT_TEXT) {
+			char placement[64];
+			placement_describe(&arguments.placement, placement, sizeof(placement));
+			printf("Placement: %s, %zu cpus on %zu nodes\n", placement,
+			       placement_cpus(), placement_nodes());
+		}
+	}
+
+	//the plain insert run keeps its original output, everything else goes
+	//through the workload runner
+	if (arguments.workload != WORKLOAD_INSERT || arguments.latency
+	    || arguments.format != FORMAT_TEXT || arguments.shards > 0) {
+		pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
+		if (arguments.format == FORMAT_CSV) {
+			print_csv_header();
+		}
+		int err = 0;
+		if (arguments.shards > 0) {
+			err = run_sharded_comparison(threads);
+			free(threads);
+			key_set_destroy(&key_set);
+			return err;
+		}
+		err = run_workload(&table_v1, threads);
+		if (err == 0) {
+			err = run_workload(&table_v2, threads);
+		}
+		if (err == 0 && arguments.v3) {
+			err = run_workload(&table_v3, threads);
+		}
+		if (err == 0 && arguments.v4) {
+			err = run_workload(&table_v4, threads);
+		}
+		for (size_t i = 0; i < FIXED_TABLES && err == 0; ++i) {
+			if (fixed_table_fits(i)) {
+				err = run_workload(fixed_tables[i], threads);
+			}
+		}
+		free(threads);
+		key_set_destroy(&key_set);
+		return err;
+	}
+
+	struct hash_table_base *hash_table_base = hash_table_base_create();
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			hash_table_base_add_entry(hash_table_base, string, global_index);
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table base: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_base_contains(hash_table_base, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	hash_table_base_destroy(hash_table_base);
+
+	pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
+
+	hash_table_v1 = hash_table_v1_create_with_lock(arguments.v1_lock);
+	gettimeofday(&start, NULL);
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = create_worker(&threads[i], i, run_v1);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table v1: %'lu usec\n", usec_diff(&start, &end));
+
+	missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v1_contains(hash_table_v1, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.stats) {
+		hash_table_v1_stats(hash_table_v1, stdout);
+	}
+	hash_table_v1_destroy(hash_table_v1);
+
+	hash_table_v2 = hash_table_v2_create_with_options(&arguments.v2_options);
+	if (arguments.bulk) {
+		v2_bulks = calloc(arguments.threads, sizeof(struct hash_table_v2_bulk *));
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			v2_bulks[i] = hash_table_v2_bulk_create(hash_table_v2);
+		}
+	}
+	gettimeofday(&start, NULL);
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = create_worker(&threads[i], i, run_v2);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			return err;
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			return err;
+		}
+	}
+	if (arguments.bulk) {
+		hash_table_v2_merge(hash_table_v2, v2_bulks, arguments.threads, arguments.threads);
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table v2: %'lu usec\n", usec_diff(&start, &end));
+	if (arguments.bulk) {
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			hash_table_v2_bulk_destroy(v2_bulks[i]);
+		}
+		free(v2_bulks);
+	}
+
+	if (arguments.batch > 1) {
+		missing = count_missing_v2_batched();
+	}
+	else {
+		missing = 0;
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			for (uint32_t j = 0; j < arguments.size; ++j) {
+				size_t global_index = get_global_index(i, j);
+				char *string = get_string(global_index);
+				if (!hash_table_v2_contains(hash_table_v2, string)) {
+					++missing;
+				}
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	if (arguments.stats) {
+		hash_table_v2_stats(hash_table_v2, stdout);
+	}
+	if (arguments.iterate) {
+		int err = report_iteration(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+	else {
+		hash_table_v2_destroy(hash_table_v2);
+	}
+
+	if (arguments.v3) {
+		hash_table_v3 = hash_table_v3_create();
+		gettimeofday(&start, NULL);
+		for (uintptr_t i = 0; i < arguments.threads; ++i) {
+			int err = create_worker(&threads[i], i, run_v3);
+			if (err != 0) {
+				printf("pthread_create returned %d\n", err);
+				return err;
+			}
+		}
+		for (uintptr_t i = 0; i < arguments.threads; ++i) {
+			int err = pthread_join(threads[i], NULL);
+			if (err != 0) {
+				printf("pthread_join returned %d\n", err);
+				return err;
+			}
+		}
+		gettimeofday(&end, NULL);
+		printf("Hash table v3: %'lu usec\n", usec_diff(&start, &end));
+
+		missing = 0;
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			for (uint32_t j = 0; j < arguments.size; ++j) {
+				size_t global_index = get_global_index(i, j);
+				char *string = get_string(global_index);
+				if (!hash_table_v3_contains(hash_table_v3, string)) {
+					++missing;
+				}
+			}
+		}
+		printf("  - %'lu missing\n", missing);
+
+		if (arguments.snapshot != NULL) {
+			int err = report_snapshot();
+			if (err != 0) {
+				return err;
+			}
+		}
+		hash_table_v3_destroy(hash_table_v3);
+	}
+
+	if (arguments.v4) {
+		hash_table_v4 = hash_table_v4_create();
+		gettimeofday(&start, NULL);
+		for (uintptr_t i = 0; i < arguments.threads; ++i) {
+			int err = create_worker(&threads[i], i, run_v4);
+			if (err != 0) {
+				printf("pthread_create returned %d\n", err);
+				return err;
+			}
+		}
+		for (uintptr_t i = 0; i < arguments.threads; ++i) {
+			int err = pthread_join(threads[i], NULL);
+			if (err != 0) {
+				printf("pthread_join returned %d\n", err);
+				return err;
+			}
+		}
+		gettimeofday(&end, NULL);
+		printf("Hash table v4: %'lu usec\n", usec_diff(&start, &end));
+
+		missing = 0;
+		for (uint32_t i = 0; i < arguments.threads; ++i) {
+			for (uint32_t j = 0; j < arguments.size; ++j) {
+				size_t global_index = get_global_index(i, j);
+				char *string = get_string(global_index);
+				if (!hash_table_v4_contains(hash_table_v4, string)) {
+					++missing;
+				}
+			}
+		}
+		printf("  - %'lu missing\n", missing);
+		hash_table_v4_destroy(hash_table_v4);
+	}
+
+	for (size_t i = 0; i < FIXED_TABLES && arguments.fixed; ++i) {
+		if (!fixed_table_fits(i)) {
+			printf("Hash table %s: skipped, a key is longer than %zu bytes\n",
+			       fixed_tables[i]->name, fixed_widths[i]);
+			continue;
+		}
+		int err = report_fixed(fixed_tables[i], threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.async_workers > 0) {
+		int err = report_async(threads);
+		if (err != 0) {
+			return err;
+		}
+	}
+
+	if (arguments.hash_report) {
+		report_hashers();
+	}
 
 	free(threads);
-	free(data);
+	key_set_destroy(&key_set);
 
 	return 0;
 }
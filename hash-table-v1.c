@@ -1,19 +1,30 @@
-#include "hash-table-base.h"
+#include "hash-table-v1.h"
+
+#include "hash-table-arena.h"
+#include "hash-table-stats.h"
 
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/queue.h>
 
 #include <pthread.h>
 
+/* contains and get_value don't take the mutex, so entries are fully
+ * written before a release store links them in and readers follow the
+ * links with acquire loads */
 struct list_entry {
 	const char *key;
-	uint32_t value;
-	SLIST_ENTRY(list_entry) pointers;
+	atomic_uint_least32_t value;
+	//the key's hash, keys are only compared when it matches
+	uint32_t hash;
+	struct list_entry *_Atomic next;
 };
 
-SLIST_HEAD(list_head, list_entry);
+struct list_head {
+	struct list_entry *_Atomic first;
+};
 
 struct hash_table_entry {
 	struct list_head list_head;
@@ -22,47 +33,80 @@ struct hash_table_entry {
 struct hash_table_v1 {
 	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
 	//add a global mutex, lock the whole thing since we don't care about performance
-	//only correctness!
-	pthread_mutex_t mutex;
+	//only correctness! a pthread mutex unless created with another kind
+	enum hash_table_lock_kind lock_kind;
+	struct hash_table_lock mutex;
+	//every list_entry is carved out of here, so destroy is just a few frees
+	struct arena *arena;
+#ifdef HASH_TABLE_STATS
+	struct hash_table_stats *stats;
+	struct hash_table_lock_stats mutex_stats;
+#endif
 };
 
 struct hash_table_v1 *hash_table_v1_create()
+{
+	return hash_table_v1_create_with_lock(HASH_TABLE_LOCK_MUTEX);
+}
+
+struct hash_table_v1 *hash_table_v1_create_with_lock(enum hash_table_lock_kind lock_kind)
 {
 	struct hash_table_v1 *hash_table = calloc(1, sizeof(struct hash_table_v1));
 	assert(hash_table != NULL);
+	hash_table->arena = arena_create();
+#ifdef HASH_TABLE_STATS
+	hash_table->stats = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct hash_table_stats));
+	assert(hash_table->stats != NULL);
+	memset(hash_table->stats, 0, sizeof(struct hash_table_stats));
+#endif
 	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
 		struct hash_table_entry *entry = &hash_table->entries[i];
-		SLIST_INIT(&entry->list_head);
+		atomic_init(&entry->list_head.first, NULL);
 	}
 	//initialize the lock
-	if (pthread_mutex_init(&hash_table->mutex, NULL) != 0){
-		perror("pthread_mutex_init");
-		exit(EXIT_FAILURE);
-	}
+	hash_table->lock_kind = lock_kind;
+	hash_table_lock_init(&hash_table->mutex, lock_kind);
 	return hash_table;
 }
 
-static struct hash_table_entry *get_hash_table_entry(struct hash_table_v1 *hash_table,
-                                                     const char *key)
+uint32_t hash_table_v1_hash(struct hash_table_v1 *hash_table, const char *key)
 {
+	(void) hash_table;
 	assert(key != NULL);
-	uint32_t index = bernstein_hash(key) % HASH_TABLE_CAPACITY;
+	return bernstein_hash(key);
+}
+
+static struct hash_table_entry *get_hash_table_entry(struct hash_table_v1 *hash_table,
+                                                     uint32_t hash)
+{
+	uint32_t index = hash % HASH_TABLE_CAPACITY;
 	struct hash_table_entry *entry = &hash_table->entries[index];
 	return entry;
 }
 
 static struct list_entry *get_list_entry(struct hash_table_v1 *hash_table,
                                          const char *key,
+                                         uint32_t hash,
                                          struct list_head *list_head)
 {
 	assert(key != NULL);
+#ifdef HASH_TABLE_STATS
+	struct hash_table_thread_stats *stats = hash_table_stats_thread(hash_table->stats);
+	hash_table_stats_add(&stats->lookups, 1);
+#endif
 
-	struct list_entry *entry = NULL;
-	
-	SLIST_FOREACH(entry, list_head, pointers) {
-	  if (strcmp(entry->key, key) == 0) {
+	struct list_entry *entry = atomic_load_explicit(&list_head->first, memory_order_acquire);
+	while (entry != NULL) {
+#ifdef HASH_TABLE_STATS
+	  hash_table_stats_add(&stats->entries_walked, 1);
+	  if (entry->hash == hash) {
+	    hash_table_stats_add(&stats->key_comparisons, 1);
+	  }
+#endif
+	  if (entry->hash == hash && strcmp(entry->key, key) == 0) {
 	    return entry;
 	  }
+	  entry = atomic_load_explicit(&entry->next, memory_order_acquire);
 	}
 	return NULL;
 }
@@ -70,74 +114,148 @@ static struct list_entry *get_list_entry(struct hash_table_v1 *hash_table,
 bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
                             const char *key)
 {
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	return hash_table_v1_contains_with_hash(hash_table, key, hash_table_v1_hash(hash_table, key));
+}
+
+bool hash_table_v1_contains_with_hash(struct hash_table_v1 *hash_table,
+                                      const char *key,
+                                      uint32_t hash)
+{
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
 	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, list_head);
 	return list_entry != NULL;
 }
 
-void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
-                             const char *key,
-                             uint32_t value)
+/* add_entry, returns the entry now holding the key */
+static struct list_entry *put_list_entry(struct hash_table_v1 *hash_table,
+                                         const char *key,
+                                         uint32_t hash,
+                                         uint32_t value)
 {
 	//before modifying the table, thread acquire lock
-	if (pthread_mutex_lock(&hash_table->mutex) != 0){
-		perror("pthread_mutex_lock");
-		exit(EXIT_FAILURE);
+#ifdef HASH_TABLE_STATS
+	//a failed trylock means another writer holds it, time the wait
+	uint64_t wait_start = 0;
+	if (!hash_table_lock_try(&hash_table->mutex, hash_table->lock_kind)) {
+		wait_start = hash_table_stats_now();
+		hash_table_lock_acquire(&hash_table->mutex, hash_table->lock_kind);
 	}
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	hash_table_stats_record_lock(hash_table->stats, &hash_table->mutex_stats, wait_start);
+#else
+	hash_table_lock_acquire(&hash_table->mutex, hash_table->lock_kind);
+#endif
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
 	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, list_head);
 
 	/* Update the value if it already exists */
 	if (list_entry != NULL) {
-		list_entry->value = value;
+		atomic_store_explicit(&list_entry->value, value, memory_order_relaxed);
 		//unlock after addition of value
-		if (pthread_mutex_unlock(&hash_table->mutex) != 0){
-			perror("pthread_mutex_unlock");
-			exit(EXIT_FAILURE);
-		}
-		return;
+		hash_table_lock_release(&hash_table->mutex, hash_table->lock_kind);
+		return list_entry;
 	}
 
-	list_entry = calloc(1, sizeof(struct list_entry));
+	list_entry = arena_alloc(hash_table->arena, sizeof(struct list_entry));
 	list_entry->key = key;
-	list_entry->value = value;
-	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
+	list_entry->hash = hash;
+	atomic_init(&list_entry->value, value);
+	atomic_init(&list_entry->next,
+	            atomic_load_explicit(&list_head->first, memory_order_relaxed));
+	atomic_store_explicit(&list_head->first, list_entry, memory_order_release);
 
 	//unlock after update
-	if (pthread_mutex_unlock(&hash_table->mutex) != 0){
-		perror("pthread_mutex_unlock");
-		exit(EXIT_FAILURE);
-	}
+	hash_table_lock_release(&hash_table->mutex, hash_table->lock_kind);
+	return list_entry;
+}
+
+void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
+                             const char *key,
+                             uint32_t value)
+{
+	put_list_entry(hash_table, key, hash_table_v1_hash(hash_table, key), value);
+}
+
+void hash_table_v1_add_entry_with_hash(struct hash_table_v1 *hash_table,
+                                       const char *key,
+                                       uint32_t hash,
+                                       uint32_t value)
+{
+	put_list_entry(hash_table, key, hash, value);
 }
 
 uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
                                  const char *key)
 {
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	return hash_table_v1_get_value_with_hash(hash_table, key, hash_table_v1_hash(hash_table, key));
+}
+
+uint32_t hash_table_v1_get_value_with_hash(struct hash_table_v1 *hash_table,
+                                           const char *key,
+                                           uint32_t hash)
+{
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
 	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+	struct list_entry *list_entry = get_list_entry(hash_table, key, hash, list_head);
 	assert(list_entry != NULL);
-	return list_entry->value;
+	return atomic_load_explicit(&list_entry->value, memory_order_relaxed);
 }
 
-void hash_table_v1_destroy(struct hash_table_v1 *hash_table)
+bool hash_table_v1_find(struct hash_table_v1 *hash_table,
+                        const char *key,
+                        uint32_t hash,
+                        struct hash_table_v1_handle *handle)
 {
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
-		}
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	handle->key = key;
+	handle->hash = hash;
+	handle->entry = get_list_entry(hash_table, key, hash, &hash_table_entry->list_head);
+	return handle->entry != NULL;
+}
+
+uint32_t hash_table_v1_handle_value(const struct hash_table_v1_handle *handle)
+{
+	struct list_entry *list_entry = handle->entry;
+	assert(list_entry != NULL);
+	return atomic_load_explicit(&list_entry->value, memory_order_relaxed);
+}
+
+void hash_table_v1_handle_set(struct hash_table_v1 *hash_table,
+                              struct hash_table_v1_handle *handle,
+                              uint32_t value)
+{
+	struct list_entry *list_entry = handle->entry;
+	//entries are never unlinked, so storing into one is what add_entry
+	//does under the mutex
+	if (list_entry != NULL) {
+		atomic_store_explicit(&list_entry->value, value, memory_order_relaxed);
+		return;
 	}
+	handle->entry = put_list_entry(hash_table, handle->key, handle->hash, value);
+}
+
+void hash_table_v1_stats(struct hash_table_v1 *hash_table, FILE *out)
+{
+#ifdef HASH_TABLE_STATS
+	hash_table_stats_print(hash_table->stats, out);
+	fprintf(out, "  - global mutex: %'lu locks, %'lu contended, %'lu usec waiting\n",
+	        (unsigned long) hash_table->mutex_stats.acquisitions,
+	        (unsigned long) hash_table->mutex_stats.contended_acquisitions,
+	        (unsigned long) (hash_table->mutex_stats.wait_nsec / 1000));
+#else
+	(void) hash_table;
+	fprintf(out, "  - built without HASH_TABLE_STATS\n");
+#endif
+}
+
+void hash_table_v1_destroy(struct hash_table_v1 *hash_table)
+{
+	arena_destroy(hash_table->arena);
+#ifdef HASH_TABLE_STATS
+	free(hash_table->stats);
+#endif
 	//destroy the mutex
-	if(pthread_mutex_destroy(&hash_table->mutex) != 0){
-		perror("pthread_mutex_destroy");
-		exit(EXIT_FAILURE);
-	}
+	hash_table_lock_destroy(&hash_table->mutex, hash_table->lock_kind);
 	free(hash_table);
 }
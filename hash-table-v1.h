@@ -1,11 +1,15 @@
 #pragma once
 
 #include "hash-table-common.h"
+#include "hash-table-lock.h"
 
 #include <stdbool.h>
+#include <stdio.h>
 
 struct hash_table_v1;
 struct hash_table_v1 *hash_table_v1_create();
+/* create uses a pthread mutex for the table wide writer lock */
+struct hash_table_v1 *hash_table_v1_create_with_lock(enum hash_table_lock_kind lock_kind);
 void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
                              const char *key,
                              uint32_t value);
@@ -13,4 +17,41 @@ bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
                             const char *key);
 uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
                                  const char* key);
+/* The hash the calls above compute for key. The _with_hash calls take it
+ * from the caller instead, so a key that is looked up and then added is
+ * only hashed once. */
+uint32_t hash_table_v1_hash(struct hash_table_v1 *hash_table, const char *key);
+void hash_table_v1_add_entry_with_hash(struct hash_table_v1 *hash_table,
+                                       const char *key,
+                                       uint32_t hash,
+                                       uint32_t value);
+bool hash_table_v1_contains_with_hash(struct hash_table_v1 *hash_table,
+                                      const char *key,
+                                      uint32_t hash);
+uint32_t hash_table_v1_get_value_with_hash(struct hash_table_v1 *hash_table,
+                                           const char *key,
+                                           uint32_t hash);
+/* Where find left off, so reading and then setting the key's value walks
+ * its bucket once. Entries are never removed, a handle stays good until
+ * destroy. */
+struct hash_table_v1_handle {
+	const char *key;
+	uint32_t hash;
+	//the key's entry, NULL while it isn't in the table
+	void *entry;
+};
+/* Returns whether the key is in the table */
+bool hash_table_v1_find(struct hash_table_v1 *hash_table,
+                        const char *key,
+                        uint32_t hash,
+                        struct hash_table_v1_handle *handle);
+/* The key's value, only for handles whose key was found or set */
+uint32_t hash_table_v1_handle_value(const struct hash_table_v1_handle *handle);
+/* Same as add_entry, but a key that was found is updated without taking
+ * the mutex or walking the bucket again */
+void hash_table_v1_handle_set(struct hash_table_v1 *hash_table,
+                              struct hash_table_v1_handle *handle,
+                              uint32_t value);
+/* Writes the lock and chain counters of a HASH_TABLE_STATS build */
+void hash_table_v1_stats(struct hash_table_v1 *hash_table, FILE *out);
 void hash_table_v1_destroy(struct hash_table_v1 *hash_table);
@@ -1,144 +1,1698 @@
-#include "hash-table-base.h"
+#include "hash-table-v2.h"
+
+#include "hash-table-arena.h"
+#include "hash-table-epoch.h"
+#include "hash-table-stats.h"
 
 #include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/queue.h>
 
 #include <pthread.h>
 
+//grow once the table averages this many entries per bucket
+#define HASH_TABLE_V2_MAX_LOAD_FACTOR 2
+//buckets a writer moves to the new array each time it helps a resize
+#define HASH_TABLE_V2_MIGRATE_BATCH 8
+//entry counts are split so writers don't all hit the same cache line
+#define HASH_TABLE_V2_COUNTERS 64
+//how many entries ahead batched operations prefetch buckets
+#define HASH_TABLE_V2_PREFETCH_DISTANCE 8
+//keys a batched lookup keeps in flight at once
+#define HASH_TABLE_V2_LOOKUP_GROUP 16
+//set in a value once a resize copied its entry or a remove unlinked it, an
+//add that finds it set came too late and has to go through the bucket lock
+#define HASH_TABLE_V2_VALUE_MOVED (UINT64_C(1) << 63)
+//entries of every thread's lookaside cache, a power of two
+#define HASH_TABLE_V2_LOOKASIDE_SLOTS 4096
+//every table's generations start at its own multiple of this, so one
+//table's cached results never match another's generation
+#define HASH_TABLE_V2_GENERATION_SHIFT 40
+
+static atomic_uint_least64_t next_table;
+
+/* Readers never lock, so entries are fully written before a release store
+ * links them in and readers follow the links with acquire loads. Every
+ * operation runs inside an epoch, remove unlinks an entry under the bucket
+ * lock and leaves its next pointer alone, the entry goes back to the arena
+ * once no reader can still be standing on it. */
 struct list_entry {
 	const char *key;
-	uint32_t value;
-	SLIST_ENTRY(list_entry) pointers;
+	//both checked before the key bytes are compared, the hash also saves
+	//rehashing the key when a resize moves it
+	uint32_t key_length;
+	uint32_t hash;
+	//a number up to HASH_TABLE_V2_VALUE_MAX, the top bit is
+	//HASH_TABLE_V2_VALUE_MOVED
+	atomic_uint_least64_t value;
+	struct list_entry *_Atomic next;
 };
 
-SLIST_HEAD(list_head, list_entry);
+struct list_head {
+	struct list_entry *_Atomic first;
+};
 
 struct hash_table_entry {
 	struct list_head list_head;
-	//in order to potentially improve performance, fine grained locking!
-	pthread_mutex_t mutex;
+	//odd while an entry is being unlinked, bumped again when a retired
+	//array's entries are handed back, seqlock readers walk again when it
+	//moved under them
+	atomic_uint_least32_t sequence;
+	//set (under the bucket's lock) once its entries live in the next array
+	atomic_bool migrated;
+};
+
+struct bucket_lock {
+	struct hash_table_lock lock;
+	//waits since this lock last asked for a split, only touched with the
+	//lock held
+	uint32_t contention;
+#ifdef HASH_TABLE_STATS
+	struct hash_table_lock_stats stats;
+#endif
+};
+
+struct bucket_array {
+	//always a power of two
+	size_t capacity;
+	//the larger array being migrated into, NULL when no resize is running
+	struct bucket_array *_Atomic next;
+	//the array this one replaced while the resize runs, once it is done
+	//the old array and its entries are retired and this is cleared
+	struct bucket_array *previous;
+	atomic_size_t migrate_next;
+	atomic_size_t migrate_done;
+	//writer locks live apart from the buckets, bucket i uses lock
+	//i >> lock_shift of the hash table
+	char *locks;
+	size_t lock_count;
+	size_t lock_stride;
+	struct hash_table_entry entries[];
+};
+
+struct counter {
+	_Alignas(CACHE_LINE_SIZE) atomic_size_t value;
 };
 
 struct hash_table_v2 {
-	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
+	//oldest array that still holds entries, lookups start here
+	struct bucket_array *_Atomic buckets;
+	enum hash_table_lock_kind lock_kind;
+	unsigned lock_shift;
+	//0, or the waits on one lock after which it asks for an early resize
+	uint32_t split_contention;
+	//set by a lock that reached split_contention, the next insert
+	//starts the resize
+	atomic_bool split_wanted;
+	hash_function hash;
+	struct counter counters[HASH_TABLE_V2_COUNTERS];
+	//only one thread at a time allocates the next array
+	pthread_mutex_t resize_mutex;
+	//every list_entry, including the copies made by resizes, is carved
+	//out of here, so destroy never walks the lists
+	struct arena *arena;
+	//keys copied in by add_entry when the table owns its keys, packed
+	//apart from the entries. NULL when keys are borrowed from the caller
+	struct arena *key_arena;
+#ifdef HASH_TABLE_STATS
+	struct hash_table_stats *stats;
+#endif
+	//retired entries and bucket arrays wait here for readers to leave
+	struct epoch epoch;
+	bool seqlock_reads;
+	//with seqlock_reads, replaced arrays linked through previous, readers
+	//may still probe them. Only the epoch's reclaim pushes here, and only
+	//one thread at a time reclaims
+	struct bucket_array *kept_arrays;
+#ifdef HASH_TABLE_STATS
+	atomic_size_t contention_splits;
+#endif
+	//with lookaside, bumped after every change so cached lookups of
+	//older generations stop counting
+	_Alignas(CACHE_LINE_SIZE) atomic_uint_least64_t generation;
+	bool lookaside;
+	//set by destroy, retired entries then stay in the arenas that are
+	//about to be released and retired arrays join kept_arrays
+	bool destroying;
 };
 
+static void bucket_lock_init(struct hash_table_v2 *hash_table, struct bucket_lock *lock)
+{
+	hash_table_lock_init(&lock->lock, hash_table->lock_kind);
+	lock->contention = 0;
+}
+
+static void bucket_lock_destroy(struct hash_table_v2 *hash_table, struct bucket_lock *lock)
+{
+	hash_table_lock_destroy(&lock->lock, hash_table->lock_kind);
+}
+
+/* Returns true if the lock was held by someone else */
+static bool lock_bucket(struct hash_table_v2 *hash_table, struct bucket_lock *lock)
+{
+#ifdef HASH_TABLE_STATS
+	uint64_t wait_start = 0;
+	bool contended = false;
+	if (!hash_table_lock_try(&lock->lock, hash_table->lock_kind)) {
+		wait_start = hash_table_stats_now();
+		hash_table_lock_acquire(&lock->lock, hash_table->lock_kind);
+		contended = true;
+	}
+	hash_table_stats_record_lock(hash_table->stats, &lock->stats, wait_start);
+	return contended;
+#else
+	return hash_table_lock_acquire(&lock->lock, hash_table->lock_kind);
+#endif
+}
+
+static void unlock_bucket(struct hash_table_v2 *hash_table, struct bucket_lock *lock)
+{
+	hash_table_lock_release(&lock->lock, hash_table->lock_kind);
+}
+
+static struct bucket_lock *lock_at(struct bucket_array *array, size_t lock)
+{
+	return (struct bucket_lock *) (array->locks + lock * array->lock_stride);
+}
+
+static struct bucket_lock *get_bucket_lock(struct hash_table_v2 *hash_table,
+                                           struct bucket_array *array,
+                                           size_t index)
+{
+	return lock_at(array, index >> hash_table->lock_shift);
+}
+
+static struct bucket_array *bucket_array_create(struct hash_table_v2 *hash_table,
+                                                size_t capacity)
+{
+	struct bucket_array *array = calloc(1, sizeof(struct bucket_array)
+	                                       + capacity * sizeof(struct hash_table_entry));
+	assert(array != NULL);
+	array->capacity = capacity;
+	for (size_t i = 0; i < capacity; ++i) {
+		struct hash_table_entry *entry = &array->entries[i];
+		atomic_init(&entry->list_head.first, NULL);
+	}
+
+	//striped locks get a cache line each so neighbouring stripes don't
+	//false share, a lock per bucket stays packed to keep memory down
+	array->lock_count = capacity >> hash_table->lock_shift;
+	if (array->lock_count == 0) {
+		array->lock_count = 1;
+	}
+	if (hash_table->lock_shift == 0) {
+		array->lock_stride = sizeof(struct bucket_lock);
+		array->locks = calloc(array->lock_count, array->lock_stride);
+	}
+	else {
+		array->lock_stride = (sizeof(struct bucket_lock) + CACHE_LINE_SIZE - 1)
+		                     & ~(size_t) (CACHE_LINE_SIZE - 1);
+		array->locks = aligned_alloc(CACHE_LINE_SIZE, array->lock_count * array->lock_stride);
+	}
+	assert(array->locks != NULL);
+	for (size_t i = 0; i < array->lock_count; ++i) {
+		bucket_lock_init(hash_table, lock_at(array, i));
+	}
+	return array;
+}
+
+static void bucket_array_free(struct bucket_array *array)
+{
+	free(array->locks);
+	free(array);
+}
+
+static void bucket_array_destroy(struct hash_table_v2 *hash_table,
+                                 struct bucket_array *array)
+{
+	for (size_t i = 0; i < array->lock_count; ++i) {
+		bucket_lock_destroy(hash_table, lock_at(array, i));
+	}
+	bucket_array_free(array);
+}
+
 struct hash_table_v2 *hash_table_v2_create()
+{
+	struct hash_table_v2_options options = { 0 };
+	return hash_table_v2_create_with_options(&options);
+}
+
+struct hash_table_v2 *hash_table_v2_create_with_options(const struct hash_table_v2_options *options)
 {
 	struct hash_table_v2 *hash_table = calloc(1, sizeof(struct hash_table_v2));
 	assert(hash_table != NULL);
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		SLIST_INIT(&entry->list_head);
-		//each bucket of the hash table will have a lock initialized
-		//instead of the whole hash table
-
-		if(pthread_mutex_init(&entry->mutex, NULL) != 0){
-			perror("pthread_mutex_init");
+	hash_table->lock_kind = (enum hash_table_lock_kind) options->lock_kind;
+	hash_table->split_contention = options->split_contention;
+	hash_table->hash = options->hash != NULL ? options->hash : bernstein_hash_length;
+	hash_table->seqlock_reads = options->seqlock_reads;
+	hash_table->lookaside = options->lookaside;
+	atomic_init(&hash_table->generation,
+	            (atomic_fetch_add(&next_table, 1) + 1) << HASH_TABLE_V2_GENERATION_SHIFT);
+	if (options->buckets_per_lock > 1) {
+		//only powers of two, so a shift finds the lock
+		assert((options->buckets_per_lock & (options->buckets_per_lock - 1)) == 0);
+		hash_table->lock_shift = __builtin_ctz(options->buckets_per_lock);
+	}
+	hash_table->arena = arena_create();
+#ifdef HASH_TABLE_STATS
+	hash_table->stats = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct hash_table_stats));
+	assert(hash_table->stats != NULL);
+	memset(hash_table->stats, 0, sizeof(struct hash_table_stats));
+#endif
+	if (options->copy_keys) {
+		hash_table->key_arena = arena_create();
+	}
+	atomic_init(&hash_table->buckets, bucket_array_create(hash_table, HASH_TABLE_CAPACITY));
+	epoch_init(&hash_table->epoch, hash_table);
+	if(pthread_mutex_init(&hash_table->resize_mutex, NULL) != 0){
+		perror("pthread_mutex_init");
+		exit(EXIT_FAILURE);
+	}
+	return hash_table;
+}
+
+/* 32 bytes, so an entry never straddles two cache lines */
+struct lookaside_entry {
+	const char *key;
+	uint64_t generation;
+	uint64_t value;
+	bool found;
+};
+
+/* Thread local and shared by all tables, each thread allocates its own on
+ * its first cached lookup and frees it when it exits */
+struct lookaside {
+	struct lookaside_entry entries[HASH_TABLE_V2_LOOKASIDE_SLOTS];
+};
+
+static pthread_once_t lookaside_once = PTHREAD_ONCE_INIT;
+static pthread_key_t lookaside_key;
+static _Thread_local struct lookaside *thread_lookaside;
+
+static void create_lookaside_key(void)
+{
+	if (pthread_key_create(&lookaside_key, free) != 0) {
+		perror("pthread_key_create");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static struct lookaside_entry *get_lookaside_entry(const char *key)
+{
+	if (thread_lookaside == NULL) {
+		if (pthread_once(&lookaside_once, create_lookaside_key) != 0) {
+			perror("pthread_once");
+			exit(EXIT_FAILURE);
+		}
+		thread_lookaside = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct lookaside));
+		assert(thread_lookaside != NULL);
+		memset(thread_lookaside, 0, sizeof(struct lookaside));
+		if (pthread_setspecific(lookaside_key, thread_lookaside) != 0) {
+			perror("pthread_setspecific");
 			exit(EXIT_FAILURE);
 		}
 	}
-	return hash_table;
+	//keys are told apart by address, the low bits are all alignment
+	uint64_t index = ((uintptr_t) key * 0x9e3779b97f4a7c15ull) >> 32;
+	return &thread_lookaside->entries[index & (HASH_TABLE_V2_LOOKASIDE_SLOTS - 1)];
+}
+
+/* Called after every change a lookup may have cached */
+static void invalidate_lookaside(struct hash_table_v2 *hash_table)
+{
+	if (hash_table->lookaside) {
+		atomic_fetch_add_explicit(&hash_table->generation, 1, memory_order_release);
+	}
 }
 
 static struct hash_table_entry *get_hash_table_entry(struct hash_table_v2 *hash_table,
-                                                     const char *key)
+                                                     uint32_t hash)
 {
-	assert(key != NULL);
-	uint32_t index = bernstein_hash(key) % HASH_TABLE_CAPACITY;
-	struct hash_table_entry *entry = &hash_table->entries[index];
+	struct bucket_array *array = atomic_load(&hash_table->buckets);
+	struct hash_table_entry *entry = &array->entries[hash & (array->capacity - 1)];
+	while (atomic_load_explicit(&entry->migrated, memory_order_acquire)) {
+		array = atomic_load_explicit(&array->next, memory_order_acquire);
+		entry = &array->entries[hash & (array->capacity - 1)];
+	}
 	return entry;
 }
 
+/* Returns the bucket for the key with its lock held, following any
+ * finished migrations */
+static struct hash_table_entry *lock_hash_table_entry(struct hash_table_v2 *hash_table,
+                                                      uint32_t hash,
+                                                      struct bucket_lock **lock)
+{
+	struct bucket_array *array = atomic_load(&hash_table->buckets);
+	while (true) {
+		size_t index = hash & (array->capacity - 1);
+		struct hash_table_entry *entry = &array->entries[index];
+		*lock = get_bucket_lock(hash_table, array, index);
+		bool contended = lock_bucket(hash_table, *lock);
+		if (!atomic_load_explicit(&entry->migrated, memory_order_relaxed)) {
+			if (contended && hash_table->split_contention != 0
+			    && ++(*lock)->contention >= hash_table->split_contention) {
+				(*lock)->contention = 0;
+				atomic_store_explicit(&hash_table->split_wanted, true, memory_order_relaxed);
+			}
+			return entry;
+		}
+		unlock_bucket(hash_table, *lock);
+		array = atomic_load(&array->next);
+	}
+}
+
+static uint32_t get_key_length(const char *key)
+{
+	assert(key != NULL);
+	size_t length = strlen(key);
+	assert(length <= UINT32_MAX);
+	return length;
+}
+
+static uint64_t load_value(struct list_entry *list_entry)
+{
+	return atomic_load_explicit(&list_entry->value, memory_order_relaxed)
+	       & ~HASH_TABLE_V2_VALUE_MOVED;
+}
+
 static struct list_entry *get_list_entry(struct hash_table_v2 *hash_table,
                                          const char *key,
+                                         uint32_t key_length,
+                                         uint32_t hash,
                                          struct list_head *list_head)
 {
 	assert(key != NULL);
 
-	struct list_entry *entry = NULL;
-	
-	SLIST_FOREACH(entry, list_head, pointers) {
-	  if (strcmp(entry->key, key) == 0) {
+#ifdef HASH_TABLE_STATS
+	struct hash_table_thread_stats *stats = hash_table_stats_thread(hash_table->stats);
+	hash_table_stats_add(&stats->lookups, 1);
+#endif
+
+	struct list_entry *entry = atomic_load_explicit(&list_head->first, memory_order_acquire);
+	while (entry != NULL) {
+#ifdef HASH_TABLE_STATS
+	  hash_table_stats_add(&stats->entries_walked, 1);
+	  if (entry->hash == hash && entry->key_length == key_length) {
+	    hash_table_stats_add(&stats->key_comparisons, 1);
+	  }
+#endif
+	  if (entry->hash == hash && entry->key_length == key_length
+	      && memcmp(entry->key, key, key_length) == 0) {
 	    return entry;
 	  }
+	  entry = atomic_load_explicit(&entry->next, memory_order_acquire);
 	}
 	return NULL;
 }
 
-bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
-                            const char *key)
+/* Called with the bucket locked, or on a retired array nobody writes */
+static void sequence_write_begin(struct hash_table_entry *entry)
+{
+	uint32_t sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+	atomic_store_explicit(&entry->sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void sequence_write_end(struct hash_table_entry *entry)
+{
+	uint32_t sequence = atomic_load_explicit(&entry->sequence, memory_order_relaxed);
+	atomic_store_explicit(&entry->sequence, sequence + 1, memory_order_release);
+}
+
+static uint32_t sequence_read_begin(struct hash_table_entry *entry)
+{
+	uint32_t sequence;
+	while ((sequence = atomic_load_explicit(&entry->sequence, memory_order_acquire)) & 1) {
+		cpu_relax();
+	}
+	return sequence;
+}
+
+/* True if nothing read since sequence_read_begin can have been changed by
+ * an unlink or a reclaim */
+static bool sequence_read_valid(struct hash_table_entry *entry, uint32_t sequence)
+{
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&entry->sequence, memory_order_relaxed) == sequence;
+}
+
+/* The lookup of seqlock_reads. Without the epoch an entry can be handed
+ * back while we stand on it, but the arena only ever reuses it as another
+ * entry and the bucket's sequence moves before that can happen, so every
+ * entry is checked against the sequence before its key is compared and
+ * again before its result counts. A migrated bucket is about to be
+ * reclaimed, it is looked up again in the array it moved to. */
+static bool find_list_entry_value(struct hash_table_v2 *hash_table,
+                                  uint32_t hash,
+                                  const char *key,
+                                  uint32_t key_length,
+                                  uint64_t *value)
+{
+#ifdef HASH_TABLE_STATS
+	struct hash_table_thread_stats *stats = hash_table_stats_thread(hash_table->stats);
+	hash_table_stats_add(&stats->lookups, 1);
+#else
+	(void) hash_table;
+#endif
+
+	while (true) {
+		struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+		uint32_t sequence = sequence_read_begin(hash_table_entry);
+		if (atomic_load_explicit(&hash_table_entry->migrated, memory_order_acquire)) {
+			continue;
+		}
+		struct list_entry *entry = atomic_load_explicit(&hash_table_entry->list_head.first,
+		                                                memory_order_acquire);
+		bool changed = false;
+		while (entry != NULL) {
+#ifdef HASH_TABLE_STATS
+			hash_table_stats_add(&stats->entries_walked, 1);
+#endif
+			const char *entry_key = entry->key;
+			uint32_t entry_key_length = entry->key_length;
+			uint32_t entry_hash = entry->hash;
+			uint64_t entry_value = load_value(entry);
+			struct list_entry *next = atomic_load_explicit(&entry->next, memory_order_acquire);
+			if (!sequence_read_valid(hash_table_entry, sequence)) {
+				changed = true;
+				break;
+			}
+			if (entry_hash == hash && entry_key_length == key_length
+			    && memcmp(entry_key, key, key_length) == 0) {
+#ifdef HASH_TABLE_STATS
+				hash_table_stats_add(&stats->key_comparisons, 1);
+#endif
+				if (!sequence_read_valid(hash_table_entry, sequence)) {
+					changed = true;
+					break;
+				}
+				*value = entry_value;
+				return true;
+			}
+			entry = next;
+		}
+		if (!changed && sequence_read_valid(hash_table_entry, sequence)) {
+			return false;
+		}
+	}
+}
+
+static struct list_entry *insert_list_entry(struct hash_table_v2 *hash_table,
+                                            struct list_head *list_head,
+                                            const char *key,
+                                            uint32_t key_length,
+                                            uint32_t hash,
+                                            uint64_t value)
 {
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	struct list_entry *list_entry = arena_alloc(hash_table->arena, sizeof(struct list_entry));
+	list_entry->key = key;
+	list_entry->key_length = key_length;
+	list_entry->hash = hash;
+	atomic_init(&list_entry->value, value);
+	atomic_init(&list_entry->next,
+	            atomic_load_explicit(&list_head->first, memory_order_relaxed));
+	atomic_store_explicit(&list_head->first, list_entry, memory_order_release);
+	return list_entry;
+}
+
+/* Copies one bucket of array into array->next. Nobody else writes the two
+ * destination buckets until they see migrated set, so only the source
+ * bucket needs its lock. The source list is left intact for any reader
+ * still walking it. */
+static void migrate_bucket(struct hash_table_v2 *hash_table,
+                           struct bucket_array *array,
+                           size_t index)
+{
+	struct bucket_array *next = atomic_load(&array->next);
+	struct hash_table_entry *entry = &array->entries[index];
+	struct bucket_lock *lock = get_bucket_lock(hash_table, array, index);
+	lock_bucket(hash_table, lock);
+	struct list_entry *list_entry = atomic_load_explicit(&entry->list_head.first,
+	                                                     memory_order_relaxed);
+	while (list_entry != NULL) {
+		struct hash_table_entry *destination = &next->entries[list_entry->hash & (next->capacity - 1)];
+		//lock-free fetch_adds keep landing on the entry, marking it in the
+		//same atomic step that reads the value tells them apart
+		uint64_t value = atomic_fetch_or_explicit(&list_entry->value, HASH_TABLE_V2_VALUE_MOVED,
+		                                          memory_order_relaxed);
+		insert_list_entry(hash_table, &destination->list_head,
+		                  list_entry->key, list_entry->key_length, list_entry->hash,
+		                  value & ~HASH_TABLE_V2_VALUE_MOVED);
+		list_entry = atomic_load_explicit(&list_entry->next, memory_order_relaxed);
+	}
+	atomic_store_explicit(&entry->migrated, true, memory_order_release);
+	unlock_bucket(hash_table, lock);
+}
+
+/* Entries of a fully migrated array were all copied, so only the entries
+ * themselves go back, the keys are still used by the copies */
+static void reclaim_bucket_array(void *context, void *object)
+{
+	struct hash_table_v2 *hash_table = context;
+	struct bucket_array *array = object;
+	if (hash_table->destroying) {
+		array->previous = hash_table->kept_arrays;
+		hash_table->kept_arrays = array;
+		return;
+	}
+	for (size_t i = 0; i < array->capacity; ++i) {
+		struct hash_table_entry *entry = &array->entries[i];
+		//seqlock readers still walking this bucket must see it change
+		//before its entries can be reused
+		if (hash_table->seqlock_reads) {
+			sequence_write_begin(entry);
+		}
+		struct list_entry *list_entry = atomic_load_explicit(&entry->list_head.first,
+		                                                     memory_order_relaxed);
+		while (list_entry != NULL) {
+			struct list_entry *next = atomic_load_explicit(&list_entry->next, memory_order_relaxed);
+			arena_free(hash_table->arena, list_entry, sizeof(struct list_entry));
+			list_entry = next;
+		}
+		if (hash_table->seqlock_reads) {
+			sequence_write_end(entry);
+		}
+	}
+	if (hash_table->seqlock_reads) {
+		array->previous = hash_table->kept_arrays;
+		hash_table->kept_arrays = array;
+		return;
+	}
+	bucket_array_destroy(hash_table, array);
+}
+
+/* Moves a few buckets of a running resize, whoever finishes the last one
+ * makes the new array the head of the table and retires the old one */
+static void help_resize(struct hash_table_v2 *hash_table, struct bucket_array *array)
+{
+	for (size_t i = 0; i < HASH_TABLE_V2_MIGRATE_BATCH; ++i) {
+		size_t index = atomic_fetch_add(&array->migrate_next, 1);
+		if (index >= array->capacity) {
+			return;
+		}
+		migrate_bucket(hash_table, array, index);
+		if (atomic_fetch_add(&array->migrate_done, 1) + 1 == array->capacity) {
+			struct bucket_array *next = atomic_load(&array->next);
+			atomic_store(&hash_table->buckets, next);
+			next->previous = NULL;
+			epoch_retire(&hash_table->epoch, array, reclaim_bucket_array);
+			return;
+		}
+	}
+}
+
+static void start_resize(struct hash_table_v2 *hash_table, struct bucket_array *array)
+{
+	//someone else is already allocating the next array
+	if (pthread_mutex_trylock(&hash_table->resize_mutex) != 0) {
+		return;
+	}
+	if (atomic_load(&hash_table->buckets) == array && atomic_load(&array->next) == NULL) {
+		struct bucket_array *next = bucket_array_create(hash_table, array->capacity * 2);
+		next->previous = array;
+		atomic_store(&array->next, next);
+	}
+	if(pthread_mutex_unlock(&hash_table->resize_mutex) != 0){
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Called after every insert, either helps a running resize or starts one
+ * when this counter's share of the load factor is exceeded. A hot lock can
+ * start one early, doubling the buckets and the locks they share, but
+ * only while the table is at least a quarter as full as a resize needs,
+ * so contention on a handful of keys can't keep growing it. */
+static void maybe_resize(struct hash_table_v2 *hash_table, uint32_t hash)
+{
+	struct counter *counter = &hash_table->counters[hash % HASH_TABLE_V2_COUNTERS];
+	size_t count = atomic_fetch_add_explicit(&counter->value, 1, memory_order_relaxed) + 1;
+	struct bucket_array *array = atomic_load(&hash_table->buckets);
+	if (atomic_load(&array->next) != NULL) {
+		help_resize(hash_table, array);
+	}
+	else if (count * HASH_TABLE_V2_COUNTERS > array->capacity * HASH_TABLE_V2_MAX_LOAD_FACTOR) {
+		start_resize(hash_table, array);
+	}
+	else if (atomic_load_explicit(&hash_table->split_wanted, memory_order_relaxed)
+	         && count * HASH_TABLE_V2_COUNTERS * 4 > array->capacity * HASH_TABLE_V2_MAX_LOAD_FACTOR
+	         && atomic_exchange_explicit(&hash_table->split_wanted, false, memory_order_relaxed)) {
+#ifdef HASH_TABLE_STATS
+		atomic_fetch_add_explicit(&hash_table->contention_splits, 1, memory_order_relaxed);
+#endif
+		start_resize(hash_table, array);
+	}
+}
+
+/* The lookup behind contains and get_value, value is left alone if the
+ * key is missing */
+static bool find_value(struct hash_table_v2 *hash_table,
+                       const char *key,
+                       uint32_t key_length,
+                       uint32_t hash,
+                       uint64_t *value)
+{
+	if (hash_table->seqlock_reads) {
+		return find_list_entry_value(hash_table, hash, key, key_length, value);
+	}
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
 	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+	struct list_entry *list_entry = get_list_entry(hash_table, key, key_length, hash, list_head);
+	if (list_entry != NULL) {
+		*value = load_value(list_entry);
+	}
+	epoch_exit(&hash_table->epoch, epoch);
 	return list_entry != NULL;
 }
 
+/* A hit reads the thread's own entry and the generation, nothing else. A
+ * result is cached with the generation read before the lookup, so a
+ * change that raced with the lookup leaves it already stale. hash is
+ * NULL when the key is only hashed on a miss. */
+static bool find_value_cached(struct hash_table_v2 *hash_table,
+                              const char *key,
+                              const uint32_t *hash,
+                              uint64_t *value)
+{
+	struct lookaside_entry *entry = get_lookaside_entry(key);
+	uint64_t generation = atomic_load_explicit(&hash_table->generation, memory_order_acquire);
+	if (entry->key == key && entry->generation == generation) {
+		*value = entry->value;
+		return entry->found;
+	}
+	*value = 0;
+	uint32_t key_length = get_key_length(key);
+	bool found = find_value(hash_table, key, key_length,
+	                        hash != NULL ? *hash : hash_table->hash(key, key_length), value);
+	*entry = (struct lookaside_entry) { key, generation, *value, found };
+	return found;
+}
+
+uint32_t hash_table_v2_hash(struct hash_table_v2 *hash_table, const char *key)
+{
+	return hash_table->hash(key, get_key_length(key));
+}
+
+bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
+                            const char *key)
+{
+	uint64_t value;
+	if (hash_table->lookaside) {
+		return find_value_cached(hash_table, key, NULL, &value);
+	}
+	uint32_t key_length = get_key_length(key);
+	return find_value(hash_table, key, key_length, hash_table->hash(key, key_length), &value);
+}
+
+bool hash_table_v2_contains_with_hash(struct hash_table_v2 *hash_table,
+                                      const char *key,
+                                      uint32_t hash)
+{
+	uint64_t value;
+	if (hash_table->lookaside) {
+		return find_value_cached(hash_table, key, &hash, &value);
+	}
+	return find_value(hash_table, key, get_key_length(key), hash, &value);
+}
+
+/* Called with the bucket locked and the key missing from it */
+static struct list_entry *add_list_entry(struct hash_table_v2 *hash_table,
+                                         struct list_head *list_head,
+                                         const char *key,
+                                         uint32_t key_length,
+                                         uint32_t hash,
+                                         uint64_t value)
+{
+	if (hash_table->key_arena != NULL) {
+		char *copy = arena_alloc(hash_table->key_arena, key_length + 1);
+		memcpy(copy, key, key_length + 1);
+		key = copy;
+	}
+	return insert_list_entry(hash_table, list_head, key, key_length, hash, value);
+}
+
+/* Called with the bucket locked, returns true if a new entry was added */
+static bool put_list_entry(struct hash_table_v2 *hash_table,
+                           struct list_head *list_head,
+                           const char *key,
+                           uint32_t key_length,
+                           uint32_t hash,
+                           uint64_t value)
+{
+	struct list_entry *list_entry = get_list_entry(hash_table, key, key_length, hash, list_head);
+
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		atomic_store_explicit(&list_entry->value, value, memory_order_relaxed);
+		return false;
+	}
+
+	add_list_entry(hash_table, list_head, key, key_length, hash, value);
+	return true;
+}
+
+/* add_entry inside the caller's epoch, returns the entry now holding the
+ * key, good for as long as the caller stays in the epoch */
+static struct list_entry *set_list_entry(struct hash_table_v2 *hash_table,
+                                         const char *key,
+                                         uint32_t key_length,
+                                         uint32_t hash,
+                                         uint64_t value)
+{
+	assert(value <= HASH_TABLE_V2_VALUE_MAX);
+	struct bucket_lock *lock = NULL;
+	struct hash_table_entry *hash_table_entry = lock_hash_table_entry(hash_table, hash, &lock);
+
+	struct list_entry *list_entry = get_list_entry(hash_table, key, key_length, hash,
+	                                               &hash_table_entry->list_head);
+	bool added = list_entry == NULL;
+	if (added) {
+		list_entry = add_list_entry(hash_table, &hash_table_entry->list_head,
+		                            key, key_length, hash, value);
+	}
+	else {
+		atomic_store_explicit(&list_entry->value, value, memory_order_relaxed);
+	}
+
+	unlock_bucket(hash_table, lock);
+	invalidate_lookaside(hash_table);
+
+	if (added) {
+		maybe_resize(hash_table, hash);
+	}
+	return list_entry;
+}
+
 void hash_table_v2_add_entry(struct hash_table_v2 *hash_table,
                              const char *key,
                              uint32_t value)
 {
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	hash_table_v2_add_entry64(hash_table, key, value);
+}
 
-	if(pthread_mutex_lock(&hash_table_entry->mutex) != 0){
-		perror("pthread_mutex_lock");
-		exit(EXIT_FAILURE);
+void hash_table_v2_add_entry64(struct hash_table_v2 *hash_table,
+                               const char *key,
+                               uint64_t value)
+{
+	hash_table_v2_add_entry64_with_hash(hash_table, key, hash_table_v2_hash(hash_table, key), value);
+}
+
+void hash_table_v2_add_entry_with_hash(struct hash_table_v2 *hash_table,
+                                       const char *key,
+                                       uint32_t hash,
+                                       uint32_t value)
+{
+	hash_table_v2_add_entry64_with_hash(hash_table, key, hash, value);
+}
+
+void hash_table_v2_add_entry64_with_hash(struct hash_table_v2 *hash_table,
+                                         const char *key,
+                                         uint32_t hash,
+                                         uint64_t value)
+{
+	uint32_t key_length = get_key_length(key);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	set_list_entry(hash_table, key, key_length, hash, value);
+	epoch_exit(&hash_table->epoch, epoch);
+}
+
+uint64_t hash_table_v2_upsert(struct hash_table_v2 *hash_table,
+                             const char *key,
+                             hash_table_v2_update update,
+                             void *context)
+{
+	return hash_table_v2_upsert_with_hash(hash_table, key, hash_table_v2_hash(hash_table, key),
+	                                      update, context);
+}
+
+uint64_t hash_table_v2_upsert_with_hash(struct hash_table_v2 *hash_table,
+                                        const char *key,
+                                        uint32_t hash,
+                                        hash_table_v2_update update,
+                                        void *context)
+{
+	uint32_t key_length = get_key_length(key);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct bucket_lock *lock = NULL;
+	struct hash_table_entry *hash_table_entry = lock_hash_table_entry(hash_table, hash, &lock);
+
+	struct list_entry *list_entry = get_list_entry(hash_table, key, key_length, hash,
+	                                               &hash_table_entry->list_head);
+	uint64_t value;
+	if (list_entry != NULL) {
+		//the lock keeps out other writers but not fetch_add, whose adds
+		//must not be lost
+		uint64_t current = atomic_load_explicit(&list_entry->value, memory_order_relaxed);
+		do {
+			value = update(context, true, current);
+		} while (!atomic_compare_exchange_weak_explicit(&list_entry->value, &current, value,
+		                                                memory_order_relaxed,
+		                                                memory_order_relaxed));
 	}
+	else {
+		value = update(context, false, 0);
+		add_list_entry(hash_table, &hash_table_entry->list_head, key, key_length, hash, value);
+	}
+	assert(value <= HASH_TABLE_V2_VALUE_MAX);
 
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+	unlock_bucket(hash_table, lock);
+	invalidate_lookaside(hash_table);
 
-	/* Update the value if it already exists */
+	if (list_entry == NULL) {
+		maybe_resize(hash_table, hash);
+	}
+	epoch_exit(&hash_table->epoch, epoch);
+	return value;
+}
+
+uint64_t hash_table_v2_fetch_add(struct hash_table_v2 *hash_table,
+                                 const char *key,
+                                 uint64_t delta)
+{
+	return hash_table_v2_fetch_add_with_hash(hash_table, key, hash_table_v2_hash(hash_table, key),
+	                                         delta);
+}
+
+uint64_t hash_table_v2_fetch_add_with_hash(struct hash_table_v2 *hash_table,
+                                           const char *key,
+                                           uint32_t hash,
+                                           uint64_t delta)
+{
+	uint32_t key_length = get_key_length(key);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(hash_table, key, key_length, hash,
+	                                               &hash_table_entry->list_head);
 	if (list_entry != NULL) {
-		list_entry->value = value;
-		if(pthread_mutex_unlock(&hash_table_entry->mutex) != 0){
-			perror("pthread_mutex_unlock");
-			exit(EXIT_FAILURE);
+		uint64_t previous = atomic_fetch_add_explicit(&list_entry->value, delta,
+		                                              memory_order_relaxed);
+		if (!(previous & HASH_TABLE_V2_VALUE_MOVED)) {
+			assert(previous + delta <= HASH_TABLE_V2_VALUE_MAX);
+			invalidate_lookaside(hash_table);
+			epoch_exit(&hash_table->epoch, epoch);
+			return previous;
 		}
+		//the add landed after a resize copied the entry or a remove
+		//unlinked it, nobody reads this one's value anymore
+	}
+
+	//new keys and moved entries go through the bucket lock
+	struct bucket_lock *lock = NULL;
+	hash_table_entry = lock_hash_table_entry(hash_table, hash, &lock);
+	list_entry = get_list_entry(hash_table, key, key_length, hash, &hash_table_entry->list_head);
+	uint64_t previous = 0;
+	if (list_entry != NULL) {
+		previous = atomic_fetch_add_explicit(&list_entry->value, delta, memory_order_relaxed);
+		assert(previous + delta <= HASH_TABLE_V2_VALUE_MAX);
+	}
+	else {
+		add_list_entry(hash_table, &hash_table_entry->list_head, key, key_length, hash, delta);
+	}
+
+	unlock_bucket(hash_table, lock);
+	invalidate_lookaside(hash_table);
+
+	if (list_entry == NULL) {
+		maybe_resize(hash_table, hash);
+	}
+	epoch_exit(&hash_table->epoch, epoch);
+	return previous;
+}
+
+static void reclaim_list_entry(void *context, void *object)
+{
+	struct hash_table_v2 *hash_table = context;
+	struct list_entry *list_entry = object;
+	if (hash_table->destroying) {
 		return;
 	}
+	if (hash_table->key_arena != NULL) {
+		arena_free(hash_table->key_arena, (char *) list_entry->key, list_entry->key_length + 1);
+	}
+	arena_free(hash_table->arena, list_entry, sizeof(struct list_entry));
+}
 
-	list_entry = calloc(1, sizeof(struct list_entry));
-	list_entry->key = key;
-	list_entry->value = value;
-	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
+bool hash_table_v2_remove(struct hash_table_v2 *hash_table,
+                          const char *key)
+{
+	return hash_table_v2_remove_with_hash(hash_table, key, hash_table_v2_hash(hash_table, key));
+}
 
-	if(pthread_mutex_unlock(&hash_table_entry->mutex) != 0){
-		perror("pthread_mutex_unlock");
-		exit(EXIT_FAILURE);
+bool hash_table_v2_remove_with_hash(struct hash_table_v2 *hash_table,
+                                    const char *key,
+                                    uint32_t hash)
+{
+	uint32_t key_length = get_key_length(key);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct bucket_lock *lock = NULL;
+	struct hash_table_entry *hash_table_entry = lock_hash_table_entry(hash_table, hash, &lock);
+
+	//find the link pointing at the entry, then swing it past the entry
+	struct list_entry *_Atomic *link = &hash_table_entry->list_head.first;
+	struct list_entry *list_entry = atomic_load_explicit(link, memory_order_relaxed);
+	while (list_entry != NULL
+	       && (list_entry->hash != hash
+	           || list_entry->key_length != key_length
+	           || memcmp(list_entry->key, key, key_length) != 0)) {
+		link = &list_entry->next;
+		list_entry = atomic_load_explicit(link, memory_order_relaxed);
+	}
+	if (list_entry != NULL) {
+		//lock-free writers still holding the entry have to notice
+		atomic_fetch_or_explicit(&list_entry->value, HASH_TABLE_V2_VALUE_MOVED,
+		                         memory_order_relaxed);
+		sequence_write_begin(hash_table_entry);
+		atomic_store_explicit(link,
+		                      atomic_load_explicit(&list_entry->next, memory_order_relaxed),
+		                      memory_order_release);
+		sequence_write_end(hash_table_entry);
+	}
+
+	unlock_bucket(hash_table, lock);
+
+	if (list_entry != NULL) {
+		invalidate_lookaside(hash_table);
+		struct counter *counter = &hash_table->counters[hash % HASH_TABLE_V2_COUNTERS];
+		atomic_fetch_sub_explicit(&counter->value, 1, memory_order_relaxed);
+		epoch_retire(&hash_table->epoch, list_entry, reclaim_list_entry);
+	}
+	epoch_exit(&hash_table->epoch, epoch);
+	return list_entry != NULL;
+}
+
+struct batch_entry {
+	uint32_t hash;
+	uint32_t key_length;
+	size_t bucket;
+	//position in the caller's arrays, later positions win for duplicates
+	size_t index;
+	//set when the bucket had already migrated and add_entry has to run
+	bool deferred;
+	bool added;
+};
+
+static int compare_batch_entries(const void *a, const void *b)
+{
+	const struct batch_entry *x = a;
+	const struct batch_entry *y = b;
+	if (x->bucket != y->bucket) {
+		return x->bucket < y->bucket ? -1 : 1;
+	}
+	return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+void hash_table_v2_add_entries(struct hash_table_v2 *hash_table,
+                               const char *const *keys,
+                               const uint32_t *values,
+                               size_t count)
+{
+	struct batch_entry *batch = malloc(count * sizeof(struct batch_entry));
+	assert(count == 0 || batch != NULL);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+
+	//hash everything up front, then sort so entries sharing a lock are
+	//next to each other (locks cover contiguous bucket ranges)
+	struct bucket_array *array = atomic_load(&hash_table->buckets);
+	for (size_t i = 0; i < count; ++i) {
+		struct batch_entry *entry = &batch[i];
+		entry->key_length = get_key_length(keys[i]);
+		entry->hash = hash_table->hash(keys[i], entry->key_length);
+		entry->bucket = entry->hash & (array->capacity - 1);
+		entry->index = i;
+		entry->deferred = false;
+		entry->added = false;
+	}
+	qsort(batch, count, sizeof(struct batch_entry), compare_batch_entries);
+
+	size_t i = 0;
+	while (i < count) {
+		size_t lock_index = batch[i].bucket >> hash_table->lock_shift;
+		size_t end = i;
+		while (end < count && (batch[end].bucket >> hash_table->lock_shift) == lock_index) {
+			++end;
+		}
+		//pull in the next group's buckets while this one is worked on
+		for (size_t j = end; j < count && j < end + HASH_TABLE_V2_PREFETCH_DISTANCE; ++j) {
+			__builtin_prefetch(&array->entries[batch[j].bucket]);
+		}
+
+		struct bucket_lock *lock = get_bucket_lock(hash_table, array, batch[i].bucket);
+		lock_bucket(hash_table, lock);
+		for (size_t j = i; j < end; ++j) {
+			struct batch_entry *entry = &batch[j];
+			struct hash_table_entry *hash_table_entry = &array->entries[entry->bucket];
+			if (atomic_load_explicit(&hash_table_entry->migrated, memory_order_relaxed)) {
+				entry->deferred = true;
+				continue;
+			}
+			entry->added = put_list_entry(hash_table, &hash_table_entry->list_head,
+			                              keys[entry->index], entry->key_length,
+			                              entry->hash, values[entry->index]);
+		}
+		unlock_bucket(hash_table, lock);
+
+		for (size_t j = i; j < end; ++j) {
+			struct batch_entry *entry = &batch[j];
+			if (entry->deferred) {
+				hash_table_v2_add_entry_with_hash(hash_table, keys[entry->index],
+				                                  entry->hash, values[entry->index]);
+			}
+			else if (entry->added) {
+				maybe_resize(hash_table, entry->hash);
+			}
+		}
+		i = end;
+	}
+	invalidate_lookaside(hash_table);
+	epoch_exit(&hash_table->epoch, epoch);
+	free(batch);
+}
+
+struct bulk_entry {
+	const char *key;
+	uint32_t key_length;
+	uint32_t hash;
+	uint32_t value;
+};
+
+struct hash_table_v2_bulk {
+	struct hash_table_v2 *hash_table;
+	struct bulk_entry *entries;
+	size_t count;
+	size_t capacity;
+};
+
+struct hash_table_v2_bulk *hash_table_v2_bulk_create(struct hash_table_v2 *hash_table)
+{
+	struct hash_table_v2_bulk *bulk = calloc(1, sizeof(struct hash_table_v2_bulk));
+	assert(bulk != NULL);
+	bulk->hash_table = hash_table;
+	return bulk;
+}
+
+void hash_table_v2_bulk_add(struct hash_table_v2_bulk *bulk,
+                            const char *key,
+                            uint32_t value)
+{
+	if (bulk->count == bulk->capacity) {
+		bulk->capacity = bulk->capacity == 0 ? HASH_TABLE_CAPACITY : bulk->capacity * 2;
+		bulk->entries = realloc(bulk->entries, bulk->capacity * sizeof(struct bulk_entry));
+		assert(bulk->entries != NULL);
+	}
+	struct bulk_entry *entry = &bulk->entries[bulk->count++];
+	entry->key = key;
+	entry->key_length = get_key_length(key);
+	entry->hash = bulk->hash_table->hash(key, entry->key_length);
+	entry->value = value;
+}
+
+void hash_table_v2_bulk_destroy(struct hash_table_v2_bulk *bulk)
+{
+	free(bulk->entries);
+	free(bulk);
+}
+
+/* Shared by the merge workers. Worker w owns bucket range w of the final
+ * array, entries are first scattered so each range's entries sit together
+ * in (buffer, position) order and the last write of a key is applied last. */
+struct merge {
+	struct hash_table_v2 *hash_table;
+	struct hash_table_v2_bulk *const *bulks;
+	size_t bulk_count;
+	size_t workers;
+	struct bucket_array *array;
+	//offsets[bulk * workers + range] is where that bulk's entries for the
+	//range go in sorted, counted first and turned into offsets after
+	size_t *offsets;
+	struct bulk_entry *sorted;
+	//range r holds sorted[range_start[r]] up to sorted[range_start[r + 1]]
+	size_t *range_start;
+};
+
+struct merge_worker {
+	struct merge *merge;
+	size_t index;
+	void (*run)(struct merge *merge, size_t worker);
+};
+
+static size_t merge_range(struct merge *merge, uint32_t hash)
+{
+	size_t bucket = hash & (merge->array->capacity - 1);
+	return (bucket * merge->workers) / merge->array->capacity;
+}
+
+static void merge_migrate(struct merge *merge, size_t worker)
+{
+	(void) worker;
+	struct bucket_array *array = atomic_load(&merge->hash_table->buckets);
+	while (atomic_load(&array->next) != NULL
+	       && atomic_load(&array->migrate_next) < array->capacity) {
+		help_resize(merge->hash_table, array);
+	}
+}
+
+static void merge_count(struct merge *merge, size_t worker)
+{
+	for (size_t b = worker; b < merge->bulk_count; b += merge->workers) {
+		const struct hash_table_v2_bulk *bulk = merge->bulks[b];
+		size_t *counts = &merge->offsets[b * merge->workers];
+		for (size_t i = 0; i < bulk->count; ++i) {
+			++counts[merge_range(merge, bulk->entries[i].hash)];
+		}
+	}
+}
+
+static void merge_scatter(struct merge *merge, size_t worker)
+{
+	for (size_t b = worker; b < merge->bulk_count; b += merge->workers) {
+		const struct hash_table_v2_bulk *bulk = merge->bulks[b];
+		size_t *offsets = &merge->offsets[b * merge->workers];
+		for (size_t i = 0; i < bulk->count; ++i) {
+			const struct bulk_entry *entry = &bulk->entries[i];
+			merge->sorted[offsets[merge_range(merge, entry->hash)]++] = *entry;
+		}
+	}
+}
+
+/* No other thread writes this range's buckets, so nothing is locked */
+static void merge_apply(struct merge *merge, size_t worker)
+{
+	struct hash_table_v2 *hash_table = merge->hash_table;
+	struct bucket_array *array = merge->array;
+	size_t added[HASH_TABLE_V2_COUNTERS] = { 0 };
+	for (size_t i = merge->range_start[worker]; i < merge->range_start[worker + 1]; ++i) {
+		const struct bulk_entry *entry = &merge->sorted[i];
+		if (i + HASH_TABLE_V2_PREFETCH_DISTANCE < merge->range_start[worker + 1]) {
+			uint32_t hash = merge->sorted[i + HASH_TABLE_V2_PREFETCH_DISTANCE].hash;
+			__builtin_prefetch(&array->entries[hash & (array->capacity - 1)]);
+		}
+		struct hash_table_entry *hash_table_entry = &array->entries[entry->hash & (array->capacity - 1)];
+		if (put_list_entry(hash_table, &hash_table_entry->list_head,
+		                   entry->key, entry->key_length, entry->hash, entry->value)) {
+			++added[entry->hash % HASH_TABLE_V2_COUNTERS];
+		}
+	}
+	for (size_t i = 0; i < HASH_TABLE_V2_COUNTERS; ++i) {
+		if (added[i] != 0) {
+			atomic_fetch_add_explicit(&hash_table->counters[i].value, added[i],
+			                          memory_order_relaxed);
+		}
+	}
+}
+
+static void *run_merge_worker(void *arg)
+{
+	struct merge_worker *worker = arg;
+	worker->run(worker->merge, worker->index);
+	return NULL;
+}
+
+/* Runs one phase on every worker, the calling thread acts as worker 0 */
+static void run_merge_phase(struct merge *merge,
+                            void (*run)(struct merge *merge, size_t worker))
+{
+	pthread_t threads[merge->workers];
+	struct merge_worker workers[merge->workers];
+	for (size_t i = 1; i < merge->workers; ++i) {
+		workers[i] = (struct merge_worker) { merge, i, run };
+		if (pthread_create(&threads[i], NULL, run_merge_worker, &workers[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	run(merge, 0);
+	for (size_t i = 1; i < merge->workers; ++i) {
+		if (pthread_join(threads[i], NULL) != 0) {
+			perror("pthread_join");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+void hash_table_v2_merge(struct hash_table_v2 *hash_table,
+                         struct hash_table_v2_bulk *const *bulks,
+                         size_t bulk_count,
+                         size_t threads)
+{
+	struct merge merge = {
+		.hash_table = hash_table,
+		.bulks = bulks,
+		.bulk_count = bulk_count,
+		.workers = threads > 0 ? threads : 1,
+	};
+
+	//size the table for everything up front (duplicates make this an
+	//overestimate) so no resize runs while the ranges are filled
+	size_t total = 0;
+	for (size_t i = 0; i < HASH_TABLE_V2_COUNTERS; ++i) {
+		total += atomic_load_explicit(&hash_table->counters[i].value, memory_order_relaxed);
+	}
+	for (size_t i = 0; i < bulk_count; ++i) {
+		total += bulks[i]->count;
+	}
+	run_merge_phase(&merge, merge_migrate);
+	struct bucket_array *array = atomic_load(&hash_table->buckets);
+	size_t capacity = array->capacity;
+	while (total > capacity * HASH_TABLE_V2_MAX_LOAD_FACTOR) {
+		capacity *= 2;
+	}
+	if (capacity > array->capacity) {
+		struct bucket_array *next = bucket_array_create(hash_table, capacity);
+		next->previous = array;
+		atomic_store(&array->next, next);
+		run_merge_phase(&merge, merge_migrate);
+		array = next;
+	}
+	merge.array = array;
+
+	merge.offsets = calloc(bulk_count * merge.workers, sizeof(size_t));
+	merge.range_start = calloc(merge.workers + 1, sizeof(size_t));
+	assert(merge.offsets != NULL && merge.range_start != NULL);
+	run_merge_phase(&merge, merge_count);
+
+	//ranges in order, and inside a range the bulks in order
+	size_t offset = 0;
+	for (size_t range = 0; range < merge.workers; ++range) {
+		merge.range_start[range] = offset;
+		for (size_t b = 0; b < bulk_count; ++b) {
+			size_t count = merge.offsets[b * merge.workers + range];
+			merge.offsets[b * merge.workers + range] = offset;
+			offset += count;
+		}
+	}
+	merge.range_start[merge.workers] = offset;
+
+	merge.sorted = malloc(offset * sizeof(struct bulk_entry));
+	assert(offset == 0 || merge.sorted != NULL);
+	run_merge_phase(&merge, merge_scatter);
+	run_merge_phase(&merge, merge_apply);
+	invalidate_lookaside(hash_table);
+
+	free(merge.sorted);
+	free(merge.range_start);
+	free(merge.offsets);
+	for (size_t i = 0; i < bulk_count; ++i) {
+		bulks[i]->count = 0;
 	}
 }
 
 uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
                                  const char *key)
 {
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
-	assert(list_entry != NULL);
-	return list_entry->value;
+	return hash_table_v2_get_value64(hash_table, key);
 }
 
-void hash_table_v2_destroy(struct hash_table_v2 *hash_table)
+uint64_t hash_table_v2_get_value64(struct hash_table_v2 *hash_table,
+                                   const char *key)
 {
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
+	uint64_t value = 0;
+	bool found;
+	if (hash_table->lookaside) {
+		found = find_value_cached(hash_table, key, NULL, &value);
+	}
+	else {
+		uint32_t key_length = get_key_length(key);
+		found = find_value(hash_table, key, key_length, hash_table->hash(key, key_length), &value);
+	}
+	assert(found);
+	(void) found;
+	return value;
+}
+
+uint32_t hash_table_v2_get_value_with_hash(struct hash_table_v2 *hash_table,
+                                           const char *key,
+                                           uint32_t hash)
+{
+	return hash_table_v2_get_value64_with_hash(hash_table, key, hash);
+}
+
+uint64_t hash_table_v2_get_value64_with_hash(struct hash_table_v2 *hash_table,
+                                             const char *key,
+                                             uint32_t hash)
+{
+	uint64_t value = 0;
+	bool found = hash_table->lookaside
+	             ? find_value_cached(hash_table, key, &hash, &value)
+	             : find_value(hash_table, key, get_key_length(key), hash, &value);
+	assert(found);
+	(void) found;
+	return value;
+}
+
+bool hash_table_v2_find(struct hash_table_v2 *hash_table,
+                        const char *key,
+                        uint32_t hash,
+                        struct hash_table_v2_handle *handle)
+{
+	handle->key = key;
+	handle->key_length = get_key_length(key);
+	handle->hash = hash;
+	handle->epoch = epoch_enter(&hash_table->epoch);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	handle->entry = get_list_entry(hash_table, key, handle->key_length, hash,
+	                               &hash_table_entry->list_head);
+	return handle->entry != NULL;
+}
+
+uint64_t hash_table_v2_handle_value(const struct hash_table_v2_handle *handle)
+{
+	assert(handle->entry != NULL);
+	return load_value(handle->entry);
+}
+
+void hash_table_v2_handle_set(struct hash_table_v2 *hash_table,
+                              struct hash_table_v2_handle *handle,
+                              uint64_t value)
+{
+	assert(value <= HASH_TABLE_V2_VALUE_MAX);
+	struct list_entry *list_entry = handle->entry;
+	if (list_entry != NULL) {
+		//a moved or removed entry is no longer the key's, the store then
+		//has to be made through the lock like a fetch_add's
+		uint64_t current = atomic_load_explicit(&list_entry->value, memory_order_relaxed);
+		while (!(current & HASH_TABLE_V2_VALUE_MOVED)) {
+			if (atomic_compare_exchange_weak_explicit(&list_entry->value, &current, value,
+			                                          memory_order_relaxed,
+			                                          memory_order_relaxed)) {
+				invalidate_lookaside(hash_table);
+				return;
+			}
 		}
+	}
+	handle->entry = set_list_entry(hash_table, handle->key, handle->key_length,
+	                               handle->hash, value);
+}
+
+void hash_table_v2_release(struct hash_table_v2 *hash_table,
+                           struct hash_table_v2_handle *handle)
+{
+	epoch_exit(&hash_table->epoch, handle->epoch);
+	handle->entry = NULL;
+}
+
+/* Group prefetching: every stage runs over the whole group of keys before
+ * the next one starts, so the cache misses of one stage overlap across the
+ * group instead of stalling each key in turn. */
+static void get_list_entry_group(struct hash_table_v2 *hash_table,
+                                 const char *const *keys,
+                                 bool *found,
+                                 uint64_t *values,
+                                 size_t group)
+{
+	uint32_t hashes[HASH_TABLE_V2_LOOKUP_GROUP];
+	uint32_t key_lengths[HASH_TABLE_V2_LOOKUP_GROUP];
+	struct hash_table_entry *entries[HASH_TABLE_V2_LOOKUP_GROUP];
+	assert(group <= HASH_TABLE_V2_LOOKUP_GROUP);
+
+	//hash and prefetch the buckets
+	struct bucket_array *array = atomic_load(&hash_table->buckets);
+	for (size_t i = 0; i < group; ++i) {
+		key_lengths[i] = get_key_length(keys[i]);
+		hashes[i] = hash_table->hash(keys[i], key_lengths[i]);
+		entries[i] = &array->entries[hashes[i] & (array->capacity - 1)];
+		__builtin_prefetch(entries[i]);
+	}
+	//follow any migrations and prefetch the first entry of each chain
+	for (size_t i = 0; i < group; ++i) {
+		if (atomic_load_explicit(&entries[i]->migrated, memory_order_acquire)) {
+			entries[i] = get_hash_table_entry(hash_table, hashes[i]);
+		}
+		struct list_entry *first = atomic_load_explicit(&entries[i]->list_head.first,
+		                                                memory_order_acquire);
+		if (first != NULL) {
+			__builtin_prefetch(first);
+		}
+	}
+	//walk the chains, their heads should be in cache by now
+	for (size_t i = 0; i < group; ++i) {
+		if (hash_table->seqlock_reads) {
+			uint64_t value = 0;
+			found[i] = find_list_entry_value(hash_table, hashes[i], keys[i],
+			                                 key_lengths[i], &value);
+			values[i] = value;
+			continue;
+		}
+		struct list_entry *list_entry = get_list_entry(hash_table, keys[i], key_lengths[i],
+		                                               hashes[i], &entries[i]->list_head);
+		found[i] = list_entry != NULL;
+		if (found[i]) {
+			values[i] = load_value(list_entry);
+		}
+	}
+}
+
+void hash_table_v2_contains_many(struct hash_table_v2 *hash_table,
+                                 const char *const *keys,
+                                 bool *results,
+                                 size_t count)
+{
+	uint64_t values[HASH_TABLE_V2_LOOKUP_GROUP];
+	for (size_t start = 0; start < count; start += HASH_TABLE_V2_LOOKUP_GROUP) {
+		size_t group = count - start < HASH_TABLE_V2_LOOKUP_GROUP
+		               ? count - start : HASH_TABLE_V2_LOOKUP_GROUP;
+		size_t epoch = hash_table->seqlock_reads ? 0 : epoch_enter(&hash_table->epoch);
+		get_list_entry_group(hash_table, keys + start, results + start, values, group);
+		if (!hash_table->seqlock_reads) {
+			epoch_exit(&hash_table->epoch, epoch);
+		}
+	}
+}
+
+void hash_table_v2_get_values(struct hash_table_v2 *hash_table,
+                              const char *const *keys,
+                              uint32_t *values,
+                              size_t count)
+{
+	bool found[HASH_TABLE_V2_LOOKUP_GROUP];
+	uint64_t group_values[HASH_TABLE_V2_LOOKUP_GROUP];
+	for (size_t start = 0; start < count; start += HASH_TABLE_V2_LOOKUP_GROUP) {
+		size_t group = count - start < HASH_TABLE_V2_LOOKUP_GROUP
+		               ? count - start : HASH_TABLE_V2_LOOKUP_GROUP;
+		size_t epoch = hash_table->seqlock_reads ? 0 : epoch_enter(&hash_table->epoch);
+		get_list_entry_group(hash_table, keys + start, found, group_values, group);
+		for (size_t i = 0; i < group; ++i) {
+			assert(found[i]);
+			values[start + i] = group_values[i];
+		}
+		if (!hash_table->seqlock_reads) {
+			epoch_exit(&hash_table->epoch, epoch);
+		}
+	}
+}
+
+void hash_table_v2_lookup_many(struct hash_table_v2 *hash_table,
+                               const char *const *keys,
+                               bool *found,
+                               uint64_t *values,
+                               size_t count)
+{
+	for (size_t start = 0; start < count; start += HASH_TABLE_V2_LOOKUP_GROUP) {
+		size_t group = count - start < HASH_TABLE_V2_LOOKUP_GROUP
+		               ? count - start : HASH_TABLE_V2_LOOKUP_GROUP;
+		size_t epoch = hash_table->seqlock_reads ? 0 : epoch_enter(&hash_table->epoch);
+		get_list_entry_group(hash_table, keys + start, found + start, values + start, group);
+		if (!hash_table->seqlock_reads) {
+			epoch_exit(&hash_table->epoch, epoch);
+		}
+	}
+}
+
+#ifdef HASH_TABLE_STATS
+//locks listed by hash_table_v2_stats
+#define HASH_TABLE_V2_HOTTEST_LOCKS 5
 
-		//free up the list entry's mutex
-		if(pthread_mutex_destroy(&entry->mutex) != 0){
-			perror("pthread_mutex_destroy");
+static bool hotter_lock(const struct bucket_lock *a, const struct bucket_lock *b)
+{
+	if (a->stats.contended_acquisitions != b->stats.contended_acquisitions) {
+		return a->stats.contended_acquisitions > b->stats.contended_acquisitions;
+	}
+	return a->stats.acquisitions > b->stats.acquisitions;
+}
+#endif
+
+/* Visits the bucket, or once its entries moved, the buckets of the next
+ * array that got them */
+static void visit_bucket(struct bucket_array *array,
+                         size_t index,
+                         hash_table_v2_visit visit,
+                         void *context)
+{
+	struct hash_table_entry *entry = &array->entries[index];
+	if (atomic_load_explicit(&entry->migrated, memory_order_acquire)) {
+		struct bucket_array *next = atomic_load(&array->next);
+		for (size_t i = index; i < next->capacity; i += array->capacity) {
+			visit_bucket(next, i, visit, context);
+		}
+		return;
+	}
+	struct list_entry *list_entry = atomic_load_explicit(&entry->list_head.first,
+	                                                     memory_order_acquire);
+	while (list_entry != NULL) {
+		visit(context, list_entry->key, load_value(list_entry));
+		//a remove in visit leaves the next pointer alone
+		list_entry = atomic_load_explicit(&list_entry->next, memory_order_acquire);
+	}
+}
+
+void hash_table_v2_for_each(struct hash_table_v2 *hash_table,
+                            hash_table_v2_visit visit,
+                            void *context)
+{
+	hash_table_v2_for_each_range(hash_table, 0, HASH_TABLE_V2_SLICES, visit, context);
+}
+
+/* Slice s is bucket s of the smallest array, so in an array of capacity c
+ * it is every bucket s + k * HASH_TABLE_V2_SLICES. Runs over the slices
+ * bucket by bucket for each k, which keeps the walk sequential. */
+void hash_table_v2_for_each_range(struct hash_table_v2 *hash_table,
+                                  size_t first,
+                                  size_t last,
+                                  hash_table_v2_visit visit,
+                                  void *context)
+{
+	assert(first <= last && last <= HASH_TABLE_V2_SLICES);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct bucket_array *array = atomic_load(&hash_table->buckets);
+	for (size_t base = 0; base < array->capacity; base += HASH_TABLE_V2_SLICES) {
+		for (size_t slice = first; slice < last; ++slice) {
+			visit_bucket(array, base + slice, visit, context);
+		}
+	}
+	epoch_exit(&hash_table->epoch, epoch);
+}
+
+void hash_table_v2_stats(struct hash_table_v2 *hash_table, FILE *out)
+{
+#ifdef HASH_TABLE_STATS
+	struct bucket_array *array = atomic_load(&hash_table->buckets);
+	hash_table_stats_print(hash_table->stats, out);
+
+	//the most contended locks of the current array, ties go to the busiest
+	size_t hottest[HASH_TABLE_V2_HOTTEST_LOCKS];
+	size_t found = 0;
+	for (size_t i = 0; i < array->lock_count; ++i) {
+		struct bucket_lock *lock = lock_at(array, i);
+		size_t position;
+		if (found < HASH_TABLE_V2_HOTTEST_LOCKS) {
+			position = found++;
+		}
+		else if (hotter_lock(lock, lock_at(array, hottest[found - 1]))) {
+			position = found - 1;
+		}
+		else {
+			continue;
+		}
+		while (position > 0 && hotter_lock(lock, lock_at(array, hottest[position - 1]))) {
+			hottest[position] = hottest[position - 1];
+			--position;
+		}
+		hottest[position] = i;
+	}
+	fprintf(out, "  - %'zu buckets, %'zu locks\n", array->capacity, array->lock_count);
+	if (hash_table->split_contention != 0) {
+		fprintf(out, "  - %'zu resizes started by contended locks\n",
+		        atomic_load(&hash_table->contention_splits));
+	}
+	for (size_t i = 0; i < found; ++i) {
+		struct bucket_lock *lock = lock_at(array, hottest[i]);
+		fprintf(out, "  - lock %'zu (buckets %'zu-%'zu): %'lu locks, %'lu contended, %'lu usec waiting\n",
+		        hottest[i], hottest[i] << hash_table->lock_shift,
+		        ((hottest[i] + 1) << hash_table->lock_shift) - 1,
+		        (unsigned long) lock->stats.acquisitions,
+		        (unsigned long) lock->stats.contended_acquisitions,
+		        (unsigned long) (lock->stats.wait_nsec / 1000));
+	}
+#else
+	(void) hash_table;
+	fprintf(out, "  - built without HASH_TABLE_STATS\n");
+#endif
+}
+
+struct destroy_worker {
+	struct hash_table_v2 *hash_table;
+	//every array left, linked through previous
+	struct bucket_array *arrays;
+	size_t index;
+	size_t workers;
+};
+
+/* Destroys the worker's share of the locks of every array, which is what
+ * makes destroying a large table take long */
+static void *run_destroy_worker(void *arg)
+{
+	struct destroy_worker *worker = arg;
+	for (struct bucket_array *array = worker->arrays; array != NULL; array = array->previous) {
+		size_t first = array->lock_count * worker->index / worker->workers;
+		size_t last = array->lock_count * (worker->index + 1) / worker->workers;
+		for (size_t i = first; i < last; ++i) {
+			bucket_lock_destroy(worker->hash_table, lock_at(array, i));
+		}
+	}
+	return NULL;
+}
+
+void hash_table_v2_destroy(struct hash_table_v2 *hash_table)
+{
+	hash_table_v2_destroy_parallel(hash_table, 1);
+}
+
+void hash_table_v2_destroy_parallel(struct hash_table_v2 *hash_table, size_t threads)
+{
+	//entries, removed or not, all live in the arena chunks released below
+	hash_table->destroying = true;
+	epoch_destroy(&hash_table->epoch);
+	//the newest array, the one it replaces while a resize runs, then the
+	//retired ones
+	struct bucket_array *arrays = atomic_load(&hash_table->buckets);
+	if (atomic_load(&arrays->next) != NULL) {
+		arrays = atomic_load(&arrays->next);
+	}
+	struct bucket_array *oldest = arrays;
+	while (oldest->previous != NULL) {
+		oldest = oldest->previous;
+	}
+	oldest->previous = hash_table->kept_arrays;
+
+	size_t workers = threads > 0 ? threads : 1;
+	pthread_t pthreads[workers];
+	struct destroy_worker destroy_workers[workers];
+	for (size_t i = 0; i < workers; ++i) {
+		destroy_workers[i] = (struct destroy_worker) { hash_table, arrays, i, workers };
+	}
+	//the calling thread acts as worker 0
+	for (size_t i = 1; i < workers; ++i) {
+		if (pthread_create(&pthreads[i], NULL, run_destroy_worker, &destroy_workers[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+	run_destroy_worker(&destroy_workers[0]);
+	for (size_t i = 1; i < workers; ++i) {
+		if (pthread_join(pthreads[i], NULL) != 0) {
+			perror("pthread_join");
 			exit(EXIT_FAILURE);
 		}
 	}
+	while (arrays != NULL) {
+		struct bucket_array *previous = arrays->previous;
+		bucket_array_free(arrays);
+		arrays = previous;
+	}
+
+	if(pthread_mutex_destroy(&hash_table->resize_mutex) != 0){
+		perror("pthread_mutex_destroy");
+		exit(EXIT_FAILURE);
+	}
+	arena_destroy(hash_table->arena);
+#ifdef HASH_TABLE_STATS
+	free(hash_table->stats);
+#endif
+	if (hash_table->key_arena != NULL) {
+		arena_destroy(hash_table->key_arena);
+	}
 	free(hash_table);
-}
\ No newline at end of file
+}
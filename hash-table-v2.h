@@ -1,16 +1,207 @@
 #pragma once
 
 #include "hash-table-common.h"
+#include "hash-table-lock.h"
 
 #include <stdbool.h>
+#include <stdio.h>
+
+enum hash_table_v2_lock_kind {
+	HASH_TABLE_V2_LOCK_MUTEX = HASH_TABLE_LOCK_MUTEX,
+	HASH_TABLE_V2_LOCK_SPINLOCK = HASH_TABLE_LOCK_SPINLOCK,
+	HASH_TABLE_V2_LOCK_ADAPTIVE = HASH_TABLE_LOCK_ADAPTIVE,
+	HASH_TABLE_V2_LOCK_MCS = HASH_TABLE_LOCK_MCS,
+};
+
+/* A zeroed struct gives the defaults used by hash_table_v2_create */
+struct hash_table_v2_options {
+	enum hash_table_v2_lock_kind lock_kind;
+	/* Buckets sharing one writer lock, a power of two. 0 or 1 gives every
+	 * bucket its own lock, larger values stripe cache line sized locks
+	 * over the buckets. */
+	uint32_t buckets_per_lock;
+	/* 0 leaves it off. Otherwise a lock that made this many writers wait
+	 * asks for an early resize, which splits every bucket and, with
+	 * striped locks, the stripes, so hot buckets stop sharing a lock. */
+	uint32_t split_contention;
+	/* Copy keys into table owned storage instead of keeping the caller's
+	 * pointer, so keys only need to live until add_entry returns */
+	bool copy_keys;
+	/* NULL picks bernstein_hash_length */
+	hash_function hash;
+	/* Lookups don't enter the epoch, they check a sequence counter next
+	 * to every bucket's list and walk again if a remove raced with them,
+	 * so a lookup writes no memory at all. Bucket arrays a resize
+	 * replaced are then kept until destroy. */
+	bool seqlock_reads;
+	/* contains and get_value first look in a small direct mapped cache of
+	 * the calling thread, and a hit neither hashes the key nor touches a
+	 * bucket. Every change to the table empties all caches by bumping a
+	 * shared generation, so this only pays off when reads far outnumber
+	 * writes. Keys are told apart by address: a key buffer reused for a
+	 * different key needs this off. */
+	bool lookaside;
+};
+
+/* Values are kept in the entry itself as 64 bit words whose top bit the
+ * table uses, so counters, pointers and small packed structs need no
+ * allocation of their own. The uint32_t calls store and return the low
+ * bits of the same word. */
+#define HASH_TABLE_V2_VALUE_MAX (UINT64_MAX >> 1)
+
+/* Returns the new value for a key, found is false and value 0 for keys
+ * that aren't in the table yet. May be called again with a newer value if
+ * a fetch_add raced with it, so it should only compute. */
+typedef uint64_t (*hash_table_v2_update)(void *context, bool found, uint64_t value);
 
 struct hash_table_v2;
 struct hash_table_v2 *hash_table_v2_create();
+struct hash_table_v2 *hash_table_v2_create_with_options(const struct hash_table_v2_options *options);
 void hash_table_v2_add_entry(struct hash_table_v2 *hash_table,
                              const char *key,
                              uint32_t value);
+void hash_table_v2_add_entry64(struct hash_table_v2 *hash_table,
+                               const char *key,
+                               uint64_t value);
+/* Reads, updates and writes back the value in the one walk of the
+ * bucket add_entry does, under its lock. Returns the value update returned. */
+uint64_t hash_table_v2_upsert(struct hash_table_v2 *hash_table,
+                             const char *key,
+                             hash_table_v2_update update,
+                             void *context);
+/* Adds delta to the key's value, inserting it with a value of delta if it
+ * is missing, and returns the value before. Keys that are already there
+ * take no lock, only one atomic add. */
+uint64_t hash_table_v2_fetch_add(struct hash_table_v2 *hash_table,
+                                 const char *key,
+                                 uint64_t delta);
+/* Same as calling add_entry for each key in order, but hashes the whole
+ * batch first and takes each lock once per group of keys it covers */
+void hash_table_v2_add_entries(struct hash_table_v2 *hash_table,
+                               const char *const *keys,
+                               const uint32_t *values,
+                               size_t count);
+/* Bulk loading: every writer fills its own buffer without touching the
+ * table or taking a lock, then hash_table_v2_merge links all buffers in
+ * with threads workers that each own a disjoint range of buckets. Nothing
+ * else may use the table during the merge. Duplicates resolve as if the
+ * buffers were added with add_entry one after another in array order, so
+ * the last write wins. Keys have to stay valid until the merge, even with
+ * copy_keys. Merged buffers are left empty and can be refilled. */
+struct hash_table_v2_bulk;
+struct hash_table_v2_bulk *hash_table_v2_bulk_create(struct hash_table_v2 *hash_table);
+void hash_table_v2_bulk_add(struct hash_table_v2_bulk *bulk,
+                            const char *key,
+                            uint32_t value);
+void hash_table_v2_merge(struct hash_table_v2 *hash_table,
+                         struct hash_table_v2_bulk *const *bulks,
+                         size_t bulk_count,
+                         size_t threads);
+void hash_table_v2_bulk_destroy(struct hash_table_v2_bulk *bulk);
 bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
                             const char *key);
 uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
                                  const char* key);
+uint64_t hash_table_v2_get_value64(struct hash_table_v2 *hash_table,
+                                   const char *key);
+/* Returns false if the key wasn't there. Lookups running at the same time
+ * may still see the entry, its memory is reused once they are all done. */
+bool hash_table_v2_remove(struct hash_table_v2 *hash_table,
+                          const char *key);
+/* Batched lookups, results[i] and values[i] are what contains and
+ * get_value return for keys[i]. Hashing and bucket loads overlap across
+ * keys, so these beat a loop over the single key calls. */
+void hash_table_v2_contains_many(struct hash_table_v2 *hash_table,
+                                 const char *const *keys,
+                                 bool *results,
+                                 size_t count);
+void hash_table_v2_get_values(struct hash_table_v2 *hash_table,
+                              const char *const *keys,
+                              uint32_t *values,
+                              size_t count);
+/* Both at once, values[i] is only written when found[i] is true */
+void hash_table_v2_lookup_many(struct hash_table_v2 *hash_table,
+                               const char *const *keys,
+                               bool *found,
+                               uint64_t *values,
+                               size_t count);
+/* Iteration: every key belongs to one of HASH_TABLE_V2_SLICES slices by
+ * its hash, so threads can each take a range of slices and together
+ * visit the whole table. Keys that are in the table for the whole walk
+ * are visited exactly once, keys added or removed meanwhile may or may not
+ * be. visit may call into the table, including removing the key it got. */
+#define HASH_TABLE_V2_SLICES HASH_TABLE_CAPACITY
+typedef void (*hash_table_v2_visit)(void *context, const char *key, uint64_t value);
+void hash_table_v2_for_each(struct hash_table_v2 *hash_table,
+                            hash_table_v2_visit visit,
+                            void *context);
+/* Visits the slices from first up to but not including last */
+void hash_table_v2_for_each_range(struct hash_table_v2 *hash_table,
+                                  size_t first,
+                                  size_t last,
+                                  hash_table_v2_visit visit,
+                                  void *context);
+/* The hash the calls above compute for key with the table's hash function.
+ * The _with_hash calls take it from the caller instead, so a key that is
+ * looked up and then changed is only hashed once. */
+uint32_t hash_table_v2_hash(struct hash_table_v2 *hash_table, const char *key);
+void hash_table_v2_add_entry_with_hash(struct hash_table_v2 *hash_table,
+                                       const char *key,
+                                       uint32_t hash,
+                                       uint32_t value);
+void hash_table_v2_add_entry64_with_hash(struct hash_table_v2 *hash_table,
+                                         const char *key,
+                                         uint32_t hash,
+                                         uint64_t value);
+uint64_t hash_table_v2_upsert_with_hash(struct hash_table_v2 *hash_table,
+                                        const char *key,
+                                        uint32_t hash,
+                                        hash_table_v2_update update,
+                                        void *context);
+uint64_t hash_table_v2_fetch_add_with_hash(struct hash_table_v2 *hash_table,
+                                           const char *key,
+                                           uint32_t hash,
+                                           uint64_t delta);
+bool hash_table_v2_contains_with_hash(struct hash_table_v2 *hash_table,
+                                      const char *key,
+                                      uint32_t hash);
+uint32_t hash_table_v2_get_value_with_hash(struct hash_table_v2 *hash_table,
+                                           const char *key,
+                                           uint32_t hash);
+uint64_t hash_table_v2_get_value64_with_hash(struct hash_table_v2 *hash_table,
+                                             const char *key,
+                                             uint32_t hash);
+bool hash_table_v2_remove_with_hash(struct hash_table_v2 *hash_table,
+                                    const char *key,
+                                    uint32_t hash);
+/* Where find left off, so reading and then setting the key's value walks
+ * its bucket once. A handle keeps the entry it found from being reclaimed
+ * until it is released, the thread may keep using the table meanwhile. */
+struct hash_table_v2_handle {
+	const char *key;
+	uint32_t key_length;
+	uint32_t hash;
+	size_t epoch;
+	//the key's entry, NULL while it isn't in the table
+	void *entry;
+};
+/* Returns whether the key is in the table, every find needs a release */
+bool hash_table_v2_find(struct hash_table_v2 *hash_table,
+                        const char *key,
+                        uint32_t hash,
+                        struct hash_table_v2_handle *handle);
+/* The key's value, only for handles whose key was found or set */
+uint64_t hash_table_v2_handle_value(const struct hash_table_v2_handle *handle);
+/* Same as add_entry64, but a key that was found is updated with one atomic
+ * step and no lock, unless a resize or remove got to its entry first */
+void hash_table_v2_handle_set(struct hash_table_v2 *hash_table,
+                              struct hash_table_v2_handle *handle,
+                              uint64_t value);
+void hash_table_v2_release(struct hash_table_v2 *hash_table,
+                           struct hash_table_v2_handle *handle);
+/* Writes the lock and chain counters of a HASH_TABLE_STATS build */
+void hash_table_v2_stats(struct hash_table_v2 *hash_table, FILE *out);
 void hash_table_v2_destroy(struct hash_table_v2 *hash_table);
+/* destroy with the per bucket locks split over threads workers, the
+ * entries themselves go with the arena in one piece either way */
+void hash_table_v2_destroy_parallel(struct hash_table_v2 *hash_table, size_t threads);
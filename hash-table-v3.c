@@ -0,0 +1,467 @@
+#include "hash-table-v3.h"
+
+#include "hash-table-epoch.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//the top bits of the hash pick a segment, the low bits a slot inside it
+#define HASH_TABLE_V3_SEGMENT_BITS 6
+#define HASH_TABLE_V3_SEGMENTS (1 << HASH_TABLE_V3_SEGMENT_BITS)
+//a segment doubles once it is more than 3/4 full
+#define HASH_TABLE_V3_MAX_LOAD_NUMERATOR 3
+#define HASH_TABLE_V3_MAX_LOAD_DENOMINATOR 4
+
+//stored hashes 0 and 1 are reserved for empty and removed slots
+#define HASH_TABLE_V3_EMPTY 0
+#define HASH_TABLE_V3_REMOVED 1
+
+/* The hash sits next to the key pointer so a probe can reject most slots
+ * without touching the key bytes. Removing a key leaves a tombstone that
+ * probes walk past, slots are only reused once the segment is rebuilt. */
+struct slot {
+	atomic_uint_least32_t hash;
+	atomic_uint_least32_t value;
+	//the key lives at key_base + key, for tables in memory key_base is 0
+	//and this is just the pointer
+	uintptr_t key;
+};
+
+struct slot_array {
+	//always a power of two
+	size_t capacity;
+	struct slot slots[];
+};
+
+/* Writers lock a segment, readers never do. A segment only ever changes
+ * arrays by building a new one and publishing it, so readers always probe
+ * a fully initialized array. The old one is retired to the epoch. */
+struct segment {
+	_Alignas(CACHE_LINE_SIZE) struct slot_array *_Atomic slots;
+	//slots holding a key or a tombstone
+	size_t used;
+	//slots holding a key
+	size_t live;
+	pthread_mutex_t mutex;
+};
+
+struct hash_table_v3 {
+	struct segment segments[HASH_TABLE_V3_SEGMENTS];
+	struct epoch epoch;
+	uintptr_t key_base;
+	//the snapshot a table opened by hash_table_v3_open_mmap reads from,
+	//its slot arrays and keys all point into it. NULL for other tables
+	void *mapping;
+	size_t mapping_size;
+};
+
+/* A snapshot is the slot arrays exactly as they are in memory, slot keys
+ * being offsets from the start of the file, followed by the key bytes */
+#define HASH_TABLE_V3_SNAPSHOT_MAGIC "HTV3SNAP"
+#define HASH_TABLE_V3_SNAPSHOT_VERSION 1
+//reads back differently on a machine with the other byte order
+#define HASH_TABLE_V3_SNAPSHOT_BYTE_ORDER 0x01020304u
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	//refuses files written with another slot layout
+	uint32_t slot_size;
+	uint32_t segment_count;
+	uint64_t segment_offsets[HASH_TABLE_V3_SEGMENTS];
+};
+
+static struct slot_array *slot_array_create(size_t capacity)
+{
+	struct slot_array *array = calloc(1, sizeof(struct slot_array)
+	                                     + capacity * sizeof(struct slot));
+	assert(array != NULL);
+	array->capacity = capacity;
+	return array;
+}
+
+struct hash_table_v3 *hash_table_v3_create()
+{
+	struct hash_table_v3 *hash_table = calloc(1, sizeof(struct hash_table_v3));
+	assert(hash_table != NULL);
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		struct segment *segment = &hash_table->segments[i];
+		atomic_init(&segment->slots,
+		            slot_array_create(HASH_TABLE_CAPACITY / HASH_TABLE_V3_SEGMENTS));
+		if (pthread_mutex_init(&segment->mutex, NULL) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+	}
+	epoch_init(&hash_table->epoch, hash_table);
+	return hash_table;
+}
+
+static uint32_t get_hash(const char *key)
+{
+	assert(key != NULL);
+	uint32_t hash = bernstein_hash(key);
+	/* 0 and 1 are reserved for empty and removed slots */
+	return hash > HASH_TABLE_V3_REMOVED ? hash : hash + 2;
+}
+
+static struct segment *get_segment(struct hash_table_v3 *hash_table, uint32_t hash)
+{
+	return &hash_table->segments[hash >> (32 - HASH_TABLE_V3_SEGMENT_BITS)];
+}
+
+/* Linear probe for the key, returns its slot or NULL once an empty slot
+ * ends the probe sequence. Found or not is decided by the one load of each
+ * slot's hash, an insert may fill the empty slot right after. */
+static struct slot *get_slot(struct hash_table_v3 *hash_table,
+                             struct slot_array *array,
+                             const char *key,
+                             uint32_t hash)
+{
+	size_t mask = array->capacity - 1;
+	size_t index = hash & mask;
+	while (true) {
+		struct slot *slot = &array->slots[index];
+		uint32_t slot_hash = atomic_load_explicit(&slot->hash, memory_order_acquire);
+		if (slot_hash == HASH_TABLE_V3_EMPTY) {
+			return NULL;
+		}
+		if (slot_hash == hash
+		    && strcmp((const char *) (hash_table->key_base + slot->key), key) == 0) {
+			return slot;
+		}
+		index = (index + 1) & mask;
+	}
+}
+
+/* Called with the segment locked and the key known to be missing. Returns
+ * the empty slot that ends the key's probe sequence, the array always has
+ * one since it is rebuilt before it fills up. */
+static struct slot *get_empty_slot(struct slot_array *array, uint32_t hash)
+{
+	size_t mask = array->capacity - 1;
+	size_t index = hash & mask;
+	while (atomic_load_explicit(&array->slots[index].hash, memory_order_relaxed)
+	       != HASH_TABLE_V3_EMPTY) {
+		index = (index + 1) & mask;
+	}
+	return &array->slots[index];
+}
+
+static void lock_segment(struct segment *segment)
+{
+	if (pthread_mutex_lock(&segment->mutex) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_segment(struct segment *segment)
+{
+	if (pthread_mutex_unlock(&segment->mutex) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void reclaim_slot_array(void *context, void *object)
+{
+	(void) context;
+	free(object);
+}
+
+/* Called with the segment locked. Copies the keys into a fresh array,
+ * twice the size unless tombstones rather than keys filled this one. */
+static void rebuild_segment(struct hash_table_v3 *hash_table, struct segment *segment)
+{
+	struct slot_array *array = atomic_load_explicit(&segment->slots, memory_order_relaxed);
+	size_t capacity = array->capacity;
+	if (segment->live * 2 > capacity) {
+		capacity *= 2;
+	}
+	struct slot_array *next = slot_array_create(capacity);
+	for (size_t i = 0; i < array->capacity; ++i) {
+		struct slot *slot = &array->slots[i];
+		uint32_t hash = atomic_load_explicit(&slot->hash, memory_order_relaxed);
+		if (hash == HASH_TABLE_V3_EMPTY || hash == HASH_TABLE_V3_REMOVED) {
+			continue;
+		}
+		struct slot *destination = get_empty_slot(next, hash);
+		destination->key = slot->key;
+		atomic_store_explicit(&destination->value,
+		                      atomic_load_explicit(&slot->value, memory_order_relaxed),
+		                      memory_order_relaxed);
+		atomic_store_explicit(&destination->hash, hash, memory_order_relaxed);
+	}
+	segment->used = segment->live;
+	atomic_store_explicit(&segment->slots, next, memory_order_release);
+	epoch_retire(&hash_table->epoch, array, reclaim_slot_array);
+}
+
+bool hash_table_v3_contains(struct hash_table_v3 *hash_table,
+                            const char *key)
+{
+	uint32_t hash = get_hash(key);
+	struct segment *segment = get_segment(hash_table, hash);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct slot_array *array = atomic_load_explicit(&segment->slots, memory_order_acquire);
+	bool found = get_slot(hash_table, array, key, hash) != NULL;
+	epoch_exit(&hash_table->epoch, epoch);
+	return found;
+}
+
+void hash_table_v3_add_entry(struct hash_table_v3 *hash_table,
+                             const char *key,
+                             uint32_t value)
+{
+	//snapshots are mapped read-only
+	assert(hash_table->mapping == NULL);
+	uint32_t hash = get_hash(key);
+	struct segment *segment = get_segment(hash_table, hash);
+	lock_segment(segment);
+
+	struct slot_array *array = atomic_load_explicit(&segment->slots, memory_order_relaxed);
+	struct slot *slot = get_slot(hash_table, array, key, hash);
+
+	/* Update the value if it already exists */
+	if (slot != NULL) {
+		atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+		unlock_segment(segment);
+		return;
+	}
+
+	//fill in the slot before the hash makes it visible to readers
+	slot = get_empty_slot(array, hash);
+	slot->key = (uintptr_t) key;
+	atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+	atomic_store_explicit(&slot->hash, hash, memory_order_release);
+
+	++segment->used;
+	++segment->live;
+	if (segment->used * HASH_TABLE_V3_MAX_LOAD_DENOMINATOR
+	    > array->capacity * HASH_TABLE_V3_MAX_LOAD_NUMERATOR) {
+		rebuild_segment(hash_table, segment);
+	}
+
+	unlock_segment(segment);
+}
+
+bool hash_table_v3_remove(struct hash_table_v3 *hash_table,
+                          const char *key)
+{
+	//snapshots are mapped read-only
+	assert(hash_table->mapping == NULL);
+	uint32_t hash = get_hash(key);
+	struct segment *segment = get_segment(hash_table, hash);
+	lock_segment(segment);
+
+	struct slot_array *array = atomic_load_explicit(&segment->slots, memory_order_relaxed);
+	struct slot *slot = get_slot(hash_table, array, key, hash);
+	bool found = slot != NULL;
+	//the key pointer stays, a reader that already matched the hash may
+	//still compare against it
+	if (found) {
+		atomic_store_explicit(&slot->hash, HASH_TABLE_V3_REMOVED, memory_order_release);
+		--segment->live;
+	}
+
+	unlock_segment(segment);
+	return found;
+}
+
+uint32_t hash_table_v3_get_value(struct hash_table_v3 *hash_table,
+                                 const char *key)
+{
+	uint32_t hash = get_hash(key);
+	struct segment *segment = get_segment(hash_table, hash);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct slot_array *array = atomic_load_explicit(&segment->slots, memory_order_acquire);
+	struct slot *slot = get_slot(hash_table, array, key, hash);
+	assert(slot != NULL);
+	uint32_t value = atomic_load_explicit(&slot->value, memory_order_relaxed);
+	epoch_exit(&hash_table->epoch, epoch);
+	return value;
+}
+
+static void write_or_fail(const void *data, size_t size, FILE *file, bool *failed)
+{
+	if (!*failed && fwrite(data, 1, size, file) != size) {
+		*failed = true;
+	}
+}
+
+int hash_table_v3_save(struct hash_table_v3 *hash_table, const char *path)
+{
+	FILE *file = fopen(path, "wb");
+	if (file == NULL) {
+		return errno;
+	}
+	//every segment stays locked so the file is one consistent state
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		lock_segment(&hash_table->segments[i]);
+	}
+
+	struct snapshot_header header = { 0 };
+	memcpy(header.magic, HASH_TABLE_V3_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = HASH_TABLE_V3_SNAPSHOT_VERSION;
+	header.byte_order = HASH_TABLE_V3_SNAPSHOT_BYTE_ORDER;
+	header.slot_size = sizeof(struct slot);
+	header.segment_count = HASH_TABLE_V3_SEGMENTS;
+	uint64_t offset = sizeof(struct snapshot_header);
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		struct slot_array *array = atomic_load_explicit(&hash_table->segments[i].slots,
+		                                                memory_order_relaxed);
+		header.segment_offsets[i] = offset;
+		offset += sizeof(struct slot_array) + array->capacity * sizeof(struct slot);
+	}
+
+	bool failed = false;
+	write_or_fail(&header, sizeof(header), file, &failed);
+	//keys are laid out after the arrays in slot order
+	uint64_t key_offset = offset;
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		struct slot_array *array = atomic_load_explicit(&hash_table->segments[i].slots,
+		                                                memory_order_relaxed);
+		struct slot_array copy_header = { .capacity = array->capacity };
+		write_or_fail(&copy_header, sizeof(copy_header), file, &failed);
+		for (size_t j = 0; j < array->capacity; ++j) {
+			struct slot *slot = &array->slots[j];
+			uint32_t hash = atomic_load_explicit(&slot->hash, memory_order_relaxed);
+			struct slot copy = { .key = 0 };
+			atomic_init(&copy.hash, hash);
+			atomic_init(&copy.value, atomic_load_explicit(&slot->value, memory_order_relaxed));
+			if (hash != HASH_TABLE_V3_EMPTY && hash != HASH_TABLE_V3_REMOVED) {
+				copy.key = key_offset;
+				key_offset += strlen((const char *) (hash_table->key_base + slot->key)) + 1;
+			}
+			write_or_fail(&copy, sizeof(copy), file, &failed);
+		}
+	}
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		struct slot_array *array = atomic_load_explicit(&hash_table->segments[i].slots,
+		                                                memory_order_relaxed);
+		for (size_t j = 0; j < array->capacity; ++j) {
+			struct slot *slot = &array->slots[j];
+			uint32_t hash = atomic_load_explicit(&slot->hash, memory_order_relaxed);
+			if (hash != HASH_TABLE_V3_EMPTY && hash != HASH_TABLE_V3_REMOVED) {
+				const char *key = (const char *) (hash_table->key_base + slot->key);
+				write_or_fail(key, strlen(key) + 1, file, &failed);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		unlock_segment(&hash_table->segments[i]);
+	}
+	int err = failed ? errno : 0;
+	if (fclose(file) != 0 && err == 0) {
+		err = errno;
+	}
+	return err;
+}
+
+/* Only checks what is cheap, the slots and keys are trusted so opening
+ * never has to touch more than the header */
+static bool snapshot_valid(const void *mapping, size_t size)
+{
+	if (size < sizeof(struct snapshot_header)) {
+		return false;
+	}
+	const struct snapshot_header *header = mapping;
+	if (memcmp(header->magic, HASH_TABLE_V3_SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+	    || header->version != HASH_TABLE_V3_SNAPSHOT_VERSION
+	    || header->byte_order != HASH_TABLE_V3_SNAPSHOT_BYTE_ORDER
+	    || header->slot_size != sizeof(struct slot)
+	    || header->segment_count != HASH_TABLE_V3_SEGMENTS) {
+		return false;
+	}
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		uint64_t offset = header->segment_offsets[i];
+		if (offset % _Alignof(struct slot_array) != 0
+		    || offset > size - sizeof(struct slot_array)) {
+			return false;
+		}
+		const struct slot_array *array = (const struct slot_array *) ((const char *) mapping + offset);
+		if (array->capacity == 0 || (array->capacity & (array->capacity - 1)) != 0
+		    || array->capacity > (size - offset - sizeof(struct slot_array)) / sizeof(struct slot)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+struct hash_table_v3 *hash_table_v3_open_mmap(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat status;
+	if (fstat(fd, &status) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	size_t size = status.st_size;
+	void *mapping = size > 0 ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	int err = size > 0 ? errno : EINVAL;
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+	if (!snapshot_valid(mapping, size)) {
+		munmap(mapping, size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	const struct snapshot_header *header = mapping;
+	struct hash_table_v3 *hash_table = calloc(1, sizeof(struct hash_table_v3));
+	assert(hash_table != NULL);
+	hash_table->key_base = (uintptr_t) mapping;
+	hash_table->mapping = mapping;
+	hash_table->mapping_size = size;
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		struct segment *segment = &hash_table->segments[i];
+		atomic_init(&segment->slots,
+		            (struct slot_array *) ((char *) mapping + header->segment_offsets[i]));
+		if (pthread_mutex_init(&segment->mutex, NULL) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+	}
+	epoch_init(&hash_table->epoch, hash_table);
+	return hash_table;
+}
+
+void hash_table_v3_destroy(struct hash_table_v3 *hash_table)
+{
+	epoch_destroy(&hash_table->epoch);
+	if (hash_table->mapping != NULL) {
+		munmap(hash_table->mapping, hash_table->mapping_size);
+	}
+	for (size_t i = 0; i < HASH_TABLE_V3_SEGMENTS; ++i) {
+		struct segment *segment = &hash_table->segments[i];
+		if (hash_table->mapping == NULL) {
+			free(atomic_load(&segment->slots));
+		}
+		if (pthread_mutex_destroy(&segment->mutex) != 0) {
+			perror("pthread_mutex_destroy");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(hash_table);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+
+struct hash_table_v3;
+struct hash_table_v3 *hash_table_v3_create();
+void hash_table_v3_add_entry(struct hash_table_v3 *hash_table,
+                             const char *key,
+                             uint32_t value);
+bool hash_table_v3_contains(struct hash_table_v3 *hash_table,
+                            const char *key);
+uint32_t hash_table_v3_get_value(struct hash_table_v3 *hash_table,
+                                 const char* key);
+/* Returns false if the key wasn't there */
+bool hash_table_v3_remove(struct hash_table_v3 *hash_table,
+                          const char *key);
+/* Writes the table to path in a position independent layout, blocking
+ * writers while it runs. Returns 0 or an errno value. */
+int hash_table_v3_save(struct hash_table_v3 *hash_table, const char *path);
+/* Maps a saved table read-only, contains and get_value work on it right
+ * away and only fault in the pages they touch. add_entry and remove must
+ * not be called on it. Returns NULL with errno set if path isn't a
+ * snapshot written by this build. */
+struct hash_table_v3 *hash_table_v3_open_mmap(const char *path);
+void hash_table_v3_destroy(struct hash_table_v3 *hash_table);
@@ -0,0 +1,359 @@
+#include "hash-table-v4.h"
+
+#include "hash-table-epoch.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+//the top bits of the hash pick a segment, the next ones are the tag and
+//the low bits pick the first group to probe
+#define HASH_TABLE_V4_SEGMENT_BITS 6
+#define HASH_TABLE_V4_SEGMENTS (1 << HASH_TABLE_V4_SEGMENT_BITS)
+#define HASH_TABLE_V4_TAG_SHIFT (32 - HASH_TABLE_V4_SEGMENT_BITS - 7)
+#define HASH_TABLE_V4_GROUP_SIZE 16
+//a segment is rebuilt once more than 7/8 of its slots were ever used
+#define HASH_TABLE_V4_MAX_LOAD_NUMERATOR 7
+#define HASH_TABLE_V4_MAX_LOAD_DENOMINATOR 8
+
+//control bytes of slots without a key have the top bit set, a full slot
+//holds the 7 bit tag of its key
+#define HASH_TABLE_V4_EMPTY 0x80
+#define HASH_TABLE_V4_REMOVED 0xfe
+
+/* Filled in before the control byte makes it visible and left alone
+ * afterwards, except for the value. Removed slots keep their key for
+ * readers that already matched them and are only reused once the
+ * segment is rebuilt. */
+struct slot {
+	const char *key;
+	uint32_t hash;
+	atomic_uint_least32_t value;
+};
+
+struct group {
+	_Alignas(HASH_TABLE_V4_GROUP_SIZE) uint8_t control[HASH_TABLE_V4_GROUP_SIZE];
+	struct slot slots[HASH_TABLE_V4_GROUP_SIZE];
+};
+
+struct group_array {
+	//always a power of two
+	size_t group_count;
+	struct group groups[];
+};
+
+/* Writers lock a segment, readers never do. A rebuild publishes a new,
+ * complete array and retires the old one to the epoch, as in v3. */
+struct segment {
+	_Alignas(CACHE_LINE_SIZE) struct group_array *_Atomic groups;
+	//slots holding a key or a tombstone
+	size_t used;
+	//slots holding a key
+	size_t live;
+	pthread_mutex_t mutex;
+};
+
+struct hash_table_v4 {
+	struct segment segments[HASH_TABLE_V4_SEGMENTS];
+	struct epoch epoch;
+};
+
+/* Bit mask of the slots in a group whose control byte is byte, a slot
+ * takes 1 << MATCH_SHIFT bits of it and only its lowest one is set */
+#if defined(__SSE2__)
+#define MATCH_SHIFT 0
+typedef uint32_t match_mask;
+
+static inline match_mask match_byte(const uint8_t *control, uint8_t byte)
+{
+	__m128i bytes = _mm_load_si128((const __m128i *) control);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(byte)));
+}
+#elif defined(__ARM_NEON)
+#define MATCH_SHIFT 2
+typedef uint64_t match_mask;
+
+/* NEON has no movemask, narrowing the compare gives a nibble per slot */
+static inline match_mask match_byte(const uint8_t *control, uint8_t byte)
+{
+	uint8x16_t equal = vceqq_u8(vld1q_u8(control), vdupq_n_u8(byte));
+	uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(equal), 4);
+	return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x1111111111111111ull;
+}
+#else
+#define MATCH_SHIFT 0
+typedef uint32_t match_mask;
+
+static inline match_mask match_byte(const uint8_t *control, uint8_t byte)
+{
+	match_mask mask = 0;
+	for (size_t i = 0; i < HASH_TABLE_V4_GROUP_SIZE; ++i) {
+		mask |= (match_mask) (control[i] == byte) << i;
+	}
+	return mask;
+}
+#endif
+
+static inline size_t next_match(match_mask *mask)
+{
+	size_t slot = __builtin_ctzll(*mask) >> MATCH_SHIFT;
+	*mask &= *mask - 1;
+	return slot;
+}
+
+static struct group_array *group_array_create(size_t group_count)
+{
+	//malloc's alignment covers the 16 bytes the control bytes are loaded with
+	struct group_array *array = calloc(1, sizeof(struct group_array)
+	                                      + group_count * sizeof(struct group));
+	assert(array != NULL);
+	array->group_count = group_count;
+	for (size_t i = 0; i < group_count; ++i) {
+		memset(array->groups[i].control, HASH_TABLE_V4_EMPTY, HASH_TABLE_V4_GROUP_SIZE);
+	}
+	return array;
+}
+
+struct hash_table_v4 *hash_table_v4_create()
+{
+	struct hash_table_v4 *hash_table = calloc(1, sizeof(struct hash_table_v4));
+	assert(hash_table != NULL);
+	size_t groups = HASH_TABLE_CAPACITY / HASH_TABLE_V4_SEGMENTS / HASH_TABLE_V4_GROUP_SIZE;
+	for (size_t i = 0; i < HASH_TABLE_V4_SEGMENTS; ++i) {
+		struct segment *segment = &hash_table->segments[i];
+		atomic_init(&segment->groups, group_array_create(groups > 0 ? groups : 1));
+		if (pthread_mutex_init(&segment->mutex, NULL) != 0) {
+			perror("pthread_mutex_init");
+			exit(EXIT_FAILURE);
+		}
+	}
+	epoch_init(&hash_table->epoch, hash_table);
+	return hash_table;
+}
+
+/* djb2 puts too little of the key into the top bits the tag comes from */
+static uint32_t get_hash(const char *key)
+{
+	assert(key != NULL);
+	return wyhash(key, strlen(key));
+}
+
+static uint8_t get_tag(uint32_t hash)
+{
+	return (hash >> HASH_TABLE_V4_TAG_SHIFT) & 0x7f;
+}
+
+static struct segment *get_segment(struct hash_table_v4 *hash_table, uint32_t hash)
+{
+	return &hash_table->segments[hash >> (32 - HASH_TABLE_V4_SEGMENT_BITS)];
+}
+
+/* Probes groups in triangular steps, which visits every group of a power
+ * of two array once. Returns the key's slot or NULL once a group with an
+ * empty slot ends the probe. */
+static struct slot *get_slot(struct group_array *array,
+                             const char *key,
+                             uint32_t hash)
+{
+	uint8_t tag = get_tag(hash);
+	size_t mask = array->group_count - 1;
+	size_t index = hash & mask;
+	for (size_t step = 1; step <= array->group_count; ++step) {
+		struct group *group = &array->groups[index];
+		match_mask matches = match_byte(group->control, tag);
+		//pairs with the release store that published the control byte
+		atomic_thread_fence(memory_order_acquire);
+		while (matches != 0) {
+			struct slot *slot = &group->slots[next_match(&matches)];
+			if (slot->hash == hash && strcmp(slot->key, key) == 0) {
+				return slot;
+			}
+		}
+		if (match_byte(group->control, HASH_TABLE_V4_EMPTY) != 0) {
+			return NULL;
+		}
+		index = (index + step) & mask;
+	}
+	return NULL;
+}
+
+/* Called with the segment locked and the key known to be missing. Returns
+ * the first empty slot of the key's probe sequence and its control byte,
+ * the array always has one since it is rebuilt before it fills up. */
+static struct slot *get_empty_slot(struct group_array *array, uint32_t hash, uint8_t **control)
+{
+	size_t mask = array->group_count - 1;
+	size_t index = hash & mask;
+	for (size_t step = 1; ; ++step) {
+		struct group *group = &array->groups[index];
+		match_mask empty = match_byte(group->control, HASH_TABLE_V4_EMPTY);
+		if (empty != 0) {
+			size_t slot = next_match(&empty);
+			*control = &group->control[slot];
+			return &group->slots[slot];
+		}
+		index = (index + step) & mask;
+	}
+}
+
+static void lock_segment(struct segment *segment)
+{
+	if (pthread_mutex_lock(&segment->mutex) != 0) {
+		perror("pthread_mutex_lock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_segment(struct segment *segment)
+{
+	if (pthread_mutex_unlock(&segment->mutex) != 0) {
+		perror("pthread_mutex_unlock");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void reclaim_group_array(void *context, void *object)
+{
+	(void) context;
+	free(object);
+}
+
+/* Called with the segment locked. Copies the keys into a fresh array,
+ * twice the size unless tombstones rather than keys filled this one. */
+static void rebuild_segment(struct hash_table_v4 *hash_table, struct segment *segment)
+{
+	struct group_array *array = atomic_load_explicit(&segment->groups, memory_order_relaxed);
+	size_t group_count = array->group_count;
+	if (segment->live * 2 > group_count * HASH_TABLE_V4_GROUP_SIZE) {
+		group_count *= 2;
+	}
+	struct group_array *next = group_array_create(group_count);
+	for (size_t i = 0; i < array->group_count; ++i) {
+		struct group *group = &array->groups[i];
+		for (size_t j = 0; j < HASH_TABLE_V4_GROUP_SIZE; ++j) {
+			if (group->control[j] & HASH_TABLE_V4_EMPTY) {
+				continue;
+			}
+			struct slot *slot = &group->slots[j];
+			uint8_t *control;
+			struct slot *destination = get_empty_slot(next, slot->hash, &control);
+			destination->key = slot->key;
+			destination->hash = slot->hash;
+			atomic_init(&destination->value,
+			            atomic_load_explicit(&slot->value, memory_order_relaxed));
+			*control = group->control[j];
+		}
+	}
+	segment->used = segment->live;
+	atomic_store_explicit(&segment->groups, next, memory_order_release);
+	epoch_retire(&hash_table->epoch, array, reclaim_group_array);
+}
+
+bool hash_table_v4_contains(struct hash_table_v4 *hash_table,
+                            const char *key)
+{
+	uint32_t hash = get_hash(key);
+	struct segment *segment = get_segment(hash_table, hash);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct group_array *array = atomic_load_explicit(&segment->groups, memory_order_acquire);
+	bool found = get_slot(array, key, hash) != NULL;
+	epoch_exit(&hash_table->epoch, epoch);
+	return found;
+}
+
+void hash_table_v4_add_entry(struct hash_table_v4 *hash_table,
+                             const char *key,
+                             uint32_t value)
+{
+	uint32_t hash = get_hash(key);
+	struct segment *segment = get_segment(hash_table, hash);
+	lock_segment(segment);
+
+	struct group_array *array = atomic_load_explicit(&segment->groups, memory_order_relaxed);
+	struct slot *slot = get_slot(array, key, hash);
+
+	/* Update the value if it already exists */
+	if (slot != NULL) {
+		atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+		unlock_segment(segment);
+		return;
+	}
+
+	//fill in the slot before its control byte makes it visible to readers
+	uint8_t *control;
+	slot = get_empty_slot(array, hash, &control);
+	slot->key = key;
+	slot->hash = hash;
+	atomic_store_explicit(&slot->value, value, memory_order_relaxed);
+	__atomic_store_n(control, get_tag(hash), __ATOMIC_RELEASE);
+
+	++segment->used;
+	++segment->live;
+	if (segment->used * HASH_TABLE_V4_MAX_LOAD_DENOMINATOR
+	    > array->group_count * HASH_TABLE_V4_GROUP_SIZE * HASH_TABLE_V4_MAX_LOAD_NUMERATOR) {
+		rebuild_segment(hash_table, segment);
+	}
+
+	unlock_segment(segment);
+}
+
+bool hash_table_v4_remove(struct hash_table_v4 *hash_table,
+                          const char *key)
+{
+	uint32_t hash = get_hash(key);
+	struct segment *segment = get_segment(hash_table, hash);
+	lock_segment(segment);
+
+	struct group_array *array = atomic_load_explicit(&segment->groups, memory_order_relaxed);
+	struct slot *slot = get_slot(array, key, hash);
+	if (slot != NULL) {
+		//the key stays, a reader that already matched the tag may still
+		//compare against it
+		size_t offset = (char *) slot - (char *) array->groups;
+		struct group *group = &array->groups[offset / sizeof(struct group)];
+		__atomic_store_n(&group->control[slot - group->slots], HASH_TABLE_V4_REMOVED,
+		                 __ATOMIC_RELEASE);
+		--segment->live;
+	}
+
+	unlock_segment(segment);
+	return slot != NULL;
+}
+
+uint32_t hash_table_v4_get_value(struct hash_table_v4 *hash_table,
+                                 const char *key)
+{
+	uint32_t hash = get_hash(key);
+	struct segment *segment = get_segment(hash_table, hash);
+	size_t epoch = epoch_enter(&hash_table->epoch);
+	struct group_array *array = atomic_load_explicit(&segment->groups, memory_order_acquire);
+	struct slot *slot = get_slot(array, key, hash);
+	assert(slot != NULL);
+	uint32_t value = atomic_load_explicit(&slot->value, memory_order_relaxed);
+	epoch_exit(&hash_table->epoch, epoch);
+	return value;
+}
+
+void hash_table_v4_destroy(struct hash_table_v4 *hash_table)
+{
+	epoch_destroy(&hash_table->epoch);
+	for (size_t i = 0; i < HASH_TABLE_V4_SEGMENTS; ++i) {
+		struct segment *segment = &hash_table->segments[i];
+		free(atomic_load(&segment->groups));
+		if (pthread_mutex_destroy(&segment->mutex) != 0) {
+			perror("pthread_mutex_destroy");
+			exit(EXIT_FAILURE);
+		}
+	}
+	free(hash_table);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+
+/* Open addressing in groups of 16 slots, Swiss table style. Every slot has
+ * a control byte holding 7 bits of its key's hash, so a probe compares all
+ * 16 control bytes of a group at once (SSE2 or NEON where available) and
+ * only looks at the slots whose byte matched. Like v3 it is split into
+ * locked segments that readers probe without taking the lock. */
+struct hash_table_v4;
+struct hash_table_v4 *hash_table_v4_create();
+void hash_table_v4_add_entry(struct hash_table_v4 *hash_table,
+                             const char *key,
+                             uint32_t value);
+bool hash_table_v4_contains(struct hash_table_v4 *hash_table,
+                            const char *key);
+uint32_t hash_table_v4_get_value(struct hash_table_v4 *hash_table,
+                                 const char* key);
+/* Returns false if the key wasn't there */
+bool hash_table_v4_remove(struct hash_table_v4 *hash_table,
+                          const char *key);
+void hash_table_v4_destroy(struct hash_table_v4 *hash_table);
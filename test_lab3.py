@@ -1,5 +1,8 @@
+import json
+import os
 import re
 import subprocess
+import tempfile
 import unittest
 
 class TestLab3(unittest.TestCase):
@@ -78,3 +81,355 @@ class TestLab3(unittest.TestCase):
         self.assertEqual(miss_1, 0, msg=f"The missing entries for Hash table v1 should be 0 but got {miss_1} instead.")
         self.assertEqual(miss_2, 0, msg=f"The missing entries for Hash table v2 should be 0 but got {miss_2} instead.")
         
+
+    def test_4(self):
+        print("Running tester code 4...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--v3')).decode()
+        match = re.search(r'Hash table v3: ([\d\,]+) usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash table v3 did not run')
+
+        miss_3 = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(miss_3, 0, msg=f"The missing entries for Hash table v3 should be 0 but got {miss_3} instead.")
+
+    def test_5(self):
+        print("Running tester code 5...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--v3', '--workload', 'lookup')).decode()
+        matches = re.findall(r'Hash table (\w+) lookup: [\d\,]+ usec\n  - [\d\,]+ lookups/s, [\d\,]+ inserts/s, ([\d\,]+) of ([\d\,]+) lookups hit\n', hash_result)
+        self.assertEqual([m[0] for m in matches], ['v1', 'v2', 'v3'], msg='lookup workload did not run on every table')
+
+        for name, hits, lookups in matches:
+            hits = int(hits.replace(",", ""))
+            lookups = int(lookups.replace(",", ""))
+            self.assertEqual(hits, lookups, msg=f"Every lookup in Hash table {name} should hit but only {hits} of {lookups} did.")
+
+    def test_6(self):
+        print("Running tester code 6...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--bulk')).decode()
+        match = re.search(r'Hash table v2: ([\d\,]+) usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash table v2 did not run')
+
+        miss_2 = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(miss_2, 0, msg=f"The missing entries for a bulk loaded Hash table v2 should be 0 but got {miss_2} instead.")
+
+    def test_7(self):
+        print("Running tester code 7...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--v3', '--workload', 'churn')).decode()
+        matches = re.findall(r'Hash table (\w+) churn: [\d\,]+ usec\n(?:  - .*\n)*?  - ([\d\,]+) missing, ([\d\,]+) not removed\n', hash_result)
+        self.assertEqual([m[0] for m in matches], ['v2', 'v3'], msg='churn workload did not run on every table with remove')
+
+        for name, missing, not_removed in matches:
+            missing = int(missing.replace(",", ""))
+            not_removed = int(not_removed.replace(",", ""))
+            self.assertEqual(missing, 0, msg=f"The missing entries for Hash table {name} should be 0 but got {missing} instead.")
+            self.assertEqual(not_removed, 0, msg=f"Removed entries still in Hash table {name} should be 0 but got {not_removed} instead.")
+
+    def test_8(self):
+        print("Running tester code 8...")
+        self.assertTrue(self.make, msg='make failed')
+
+        with tempfile.TemporaryDirectory() as directory:
+            snapshot = os.path.join(directory, 'v3.snapshot')
+            hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--v3', '--snapshot', snapshot)).decode()
+        match = re.search(r'Hash table v3 open: ([\d\,]+) usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash table v3 snapshot was not reopened')
+
+        miss_3 = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(miss_3, 0, msg=f"The missing entries in the mapped Hash table v3 should be 0 but got {miss_3} instead.")
+
+    def test_9(self):
+        print("Running tester code 9...")
+        self.assertTrue(self.make, msg='make failed')
+
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, 'keys.txt')
+            with open(path, 'w') as keys:
+                keys.write('\n'.join(f'tenant/{i % 7}/object-{i * 7919}' for i in range(40000)))
+            hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '--input', path)).decode()
+        match = re.search(r'Input: ([\d\,]+) keys, [\d\,]+ per thread\nHash table base: [\d\,]+ usec\n  - ([\d\,]+) missing\nHash table v1: [\d\,]+ usec\n  - ([\d\,]+) missing\nHash table v2: [\d\,]+ usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='keys from --input were not used')
+
+        count, miss_0, miss_1, miss_2 = (int(group.replace(",", "")) for group in match.groups())
+
+        self.assertEqual(count, 40000, msg=f"All 40000 keys of the input file should be read but got {count} instead.")
+        self.assertEqual(miss_0, 0, msg=f"The missing entries for Hash table base should be 0 but got {miss_0} instead.")
+        self.assertEqual(miss_1, 0, msg=f"The missing entries for Hash table v1 should be 0 but got {miss_1} instead.")
+        self.assertEqual(miss_2, 0, msg=f"The missing entries for Hash table v2 should be 0 but got {miss_2} instead.")
+
+    def test_10(self):
+        print("Running tester code 10...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--fixed')).decode()
+        for width in (8, 16, 32):
+            match = re.search(rf'Hash table fixed{width}: ([\d\,]+) usec\n  - ([\d\,]+) missing\n', hash_result)
+            self.assertIsNotNone(match, msg=f'Hash table fixed{width} did not run')
+
+            miss = int(match.group(2).replace(",", ""))
+
+            self.assertEqual(miss, 0, msg=f"The missing entries for Hash table fixed{width} should be 0 but got {miss} instead.")
+
+        # Keys that fill the whole width and only differ in their last
+        # byte from a key in the other half of the same slice, so a table
+        # that dropped it would remove keys the churn expects to keep
+        for width in (16, 32):
+            with tempfile.TemporaryDirectory() as directory:
+                path = os.path.join(directory, 'keys.txt')
+                with open(path, 'w') as keys:
+                    keys.write('\n'.join('x' * (width - 5) + f'{i % 5000:04d}' + 'abcdefgh'[i // 5000] for i in range(40000)))
+                hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '--input', path, '--fixed', '--workload', 'churn')).decode()
+            match = re.search(rf'Hash table fixed{width} churn: [\d\,]+ usec\n(?:  - .*\n)*?  - ([\d\,]+) missing, ([\d\,]+) not removed\n', hash_result)
+            self.assertIsNotNone(match, msg=f'churn workload did not run on Hash table fixed{width} with {width} byte keys')
+
+            miss = int(match.group(1).replace(",", ""))
+            not_removed = int(match.group(2).replace(",", ""))
+
+            self.assertEqual(miss, 0, msg=f"The missing {width} byte keys in Hash table fixed{width} should be 0 but got {miss} instead.")
+            self.assertEqual(not_removed, 0, msg=f"The {width} byte keys Hash table fixed{width} did not remove should be 0 but got {not_removed} instead.")
+
+    def test_11(self):
+        print("Running tester code 11...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--seqlock', '--workload', 'churn')).decode()
+        match = re.search(r'Hash table v2 churn: [\d\,]+ usec\n(?:  - .*\n)*?  - ([\d\,]+) missing, ([\d\,]+) not removed\n', hash_result)
+        self.assertIsNotNone(match, msg='churn workload did not run on Hash table v2')
+
+        missing = int(match.group(1).replace(",", ""))
+        not_removed = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(missing, 0, msg=f"The missing entries for Hash table v2 with seqlock reads should be 0 but got {missing} instead.")
+        self.assertEqual(not_removed, 0, msg=f"Removed entries still in Hash table v2 with seqlock reads should be 0 but got {not_removed} instead.")
+
+    def test_12(self):
+        print("Running tester code 12...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--v4')).decode()
+        match = re.search(r'Hash table v4: ([\d\,]+) usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash table v4 did not run')
+
+        miss = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(miss, 0, msg=f"The missing entries for Hash table v4 should be 0 but got {miss} instead.")
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--v4', '--workload', 'churn')).decode()
+        match = re.search(r'Hash table v4 churn: [\d\,]+ usec\n(?:  - .*\n)*?  - ([\d\,]+) missing, ([\d\,]+) not removed\n', hash_result)
+        self.assertIsNotNone(match, msg='churn workload did not run on Hash table v4')
+
+        missing = int(match.group(1).replace(",", ""))
+        not_removed = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(missing, 0, msg=f"The missing entries for Hash table v4 after churn should be 0 but got {missing} instead.")
+        self.assertEqual(not_removed, 0, msg=f"Removed entries still in Hash table v4 should be 0 but got {not_removed} instead.")
+
+    def test_13(self):
+        print("Running tester code 13...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--keys', 'zipf', '--workload', 'counters')).decode()
+        match = re.search(r'Hash table v2 counters: [\d\,]+ usec\n(?:  - .*\n)*?  - ([\d\,]+) lost updates\n', hash_result)
+        self.assertIsNotNone(match, msg='counters workload did not run on Hash table v2')
+
+        lost = int(match.group(1).replace(",", ""))
+
+        self.assertEqual(lost, 0, msg=f"The lost updates for Hash table v2 should be 0 but got {lost} instead.")
+
+    def test_14(self):
+        print("Running tester code 14...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--iterate')).decode()
+        match = re.search(r'Hash table v2 iterate: [\d\,]+ usec\n  - ([\d\,]+) of ([\d\,]+) keys visited, ([\d\,]+) wrong values\nHash table v2 destroy: [\d\,]+ usec\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash table v2 iteration did not run')
+
+        visited = int(match.group(1).replace(",", ""))
+        distinct = int(match.group(2).replace(",", ""))
+        wrong = int(match.group(3).replace(",", ""))
+
+        self.assertEqual(visited, distinct, msg=f"Iterating Hash table v2 should visit {distinct} keys but visited {visited} instead.")
+        self.assertEqual(wrong, 0, msg=f"The wrong values seen iterating Hash table v2 should be 0 but got {wrong} instead.")
+
+    def test_15(self):
+        print("Running tester code 15...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '--sweep-threads', '1,2', '--sweep-size', '2000', '--repeat', '3', '--format', 'csv')).decode()
+        lines = hash_result.splitlines()
+        self.assertEqual(lines[0], 'threads,size,table,runs,median_usec,stddev_usec,speedup,efficiency', msg='The sweep did not print its csv header')
+
+        rows = [line.split(',') for line in lines[1:]]
+        self.assertEqual([(row[0], row[2]) for row in rows], [('1', 'base'), ('1', 'v1'), ('1', 'v2'), ('2', 'base'), ('2', 'v1'), ('2', 'v2')], msg='The sweep should report base, v1 and v2 for every thread count')
+        for row in rows:
+            threads, speedup, efficiency = int(row[0]), float(row[6]), float(row[7])
+            threads = 1 if row[2] == 'base' else threads
+            self.assertAlmostEqual(efficiency, speedup / threads, delta=0.002, msg=f"The efficiency should be the speedup over {threads} threads in {row}.")
+
+    def test_16(self):
+        print("Running tester code 16...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--lookaside', '--keys', 'zipf', '--workload', 'lookup')).decode()
+        match = re.search(r'Hash table v2 lookup: [\d\,]+ usec\n  - .*, ([\d\,]+) of ([\d\,]+) lookups hit\n', hash_result)
+        self.assertIsNotNone(match, msg='lookup workload did not run on Hash table v2')
+        hits, lookups = (int(group.replace(",", "")) for group in match.groups())
+        self.assertEqual(hits, lookups, msg=f"All lookups of Hash table v2 with a lookaside cache should hit but {lookups - hits} missed.")
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--lookaside', '--workload', 'churn')).decode()
+        match = re.search(r'Hash table v2 churn: [\d\,]+ usec\n(?:  - .*\n)*?  - ([\d\,]+) missing, ([\d\,]+) not removed\n', hash_result)
+        self.assertIsNotNone(match, msg='churn workload did not run on Hash table v2')
+
+        missing = int(match.group(1).replace(",", ""))
+        not_removed = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(missing, 0, msg=f"The missing entries for Hash table v2 with a lookaside cache should be 0 but got {missing} instead.")
+        self.assertEqual(not_removed, 0, msg=f"Removed entries still in Hash table v2 with a lookaside cache should be 0 but got {not_removed} instead.")
+
+    def test_17(self):
+        print("Running tester code 17...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--find')).decode()
+        match = re.search(r'Hash table v1: [\d\,]+ usec\n  - ([\d\,]+) missing\nHash table v2: [\d\,]+ usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash tables v1 and v2 did not run')
+
+        miss_1, miss_2 = (int(group.replace(",", "")) for group in match.groups())
+
+        self.assertEqual(miss_1, 0, msg=f"The missing entries for Hash table v1 inserting through find should be 0 but got {miss_1} instead.")
+        self.assertEqual(miss_2, 0, msg=f"The missing entries for Hash table v2 inserting through find should be 0 but got {miss_2} instead.")
+
+    def test_18(self):
+        print("Running tester code 18...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--async', '2')).decode()
+        match = re.search(r'Hash table v2 async: [\d\,]+ usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash table v2 async did not run')
+
+        miss = int(match.group(1).replace(",", ""))
+
+        self.assertEqual(miss, 0, msg=f"The missing entries for Hash table v2 async should be 0 but got {miss} instead.")
+
+    def test_19(self):
+        print("Running tester code 19...")
+        self.assertTrue(self.make, msg='make failed')
+
+        sweep = subprocess.check_output(('./hash-table-tester', '--sweep-threads', '1,4', '--sweep-size', '2000', '--repeat', '1', '--format', 'csv', '--lock-sweep')).decode()
+        for table in ('v1-spinlock', 'v1-adaptive', 'v1-mcs', 'v2-spinlock', 'v2-adaptive', 'v2-mcs'):
+            self.assertEqual(len(re.findall(rf'^\d+,2000,{table},', sweep, re.MULTILINE)), 2, msg=f"The sweep did not report {table} for every thread count")
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--lock', 'adaptive', '--v1-lock', 'mcs', '--split-contention', '4')).decode()
+        matches = re.findall(r'Hash table v([12]): [\d\,]+ usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertEqual([version for version, _ in matches], ['1', '2'], msg='Hash tables v1 and v2 did not both run')
+
+        for version, missing in matches:
+            miss = int(missing.replace(",", ""))
+            self.assertEqual(miss, 0, msg=f"The missing entries for Hash table v{version} should be 0 but got {miss} instead.")
+
+    def test_20(self):
+        print("Running tester code 20...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '10000', '--sharded', '4', '--workload', 'lookup')).decode()
+        matches = re.findall(r'Hash table (\w+) lookup: [\d\,]+ usec\n  - [\d\,]+ lookups/s, [\d\,]+ inserts/s, ([\d\,]+) of ([\d\,]+) lookups hit\n', hash_result)
+        self.assertEqual([m[0] for m in matches], ['v2', 'sharded'] * 3, msg='lookup workload did not run on v2 and the sharded table at 1, 2 and 4 threads')
+
+        for name, hits, lookups in matches:
+            hits = int(hits.replace(",", ""))
+            lookups = int(lookups.replace(",", ""))
+            self.assertEqual(hits, lookups, msg=f"Every lookup in Hash table {name} should hit but only {hits} of {lookups} did.")
+
+    def test_21(self):
+        print("Running tester code 21...")
+        self.assertTrue(self.make, msg='make failed')
+
+        # 7 doesn't divide -s, so every thread ends on a short batch. The
+        # 200,000 keys of the second run grow v2 from its 4096 buckets
+        # while the batches go in.
+        for args in (('-t', '1', '-s', '1000', '--batch', '7'),
+                     ('-t', '4', '-s', '50000', '--batch', '7')):
+            hash_result = subprocess.check_output(('./hash-table-tester',) + args).decode()
+            match = re.search(r'Hash table v2: [\d\,]+ usec\n  - ([\d\,]+) missing\n', hash_result)
+            self.assertIsNotNone(match, msg=f"Hash table v2 did not run with {' '.join(args)}")
+
+            miss = int(match.group(1).replace(",", ""))
+
+            self.assertEqual(miss, 0, msg=f"The missing entries for Hash table v2 with {' '.join(args)} should be 0 but got {miss} instead.")
+
+    def test_22(self):
+        print("Running tester code 22...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--workload', 'lookup', '--batch', '7')).decode()
+        match = re.search(r'Hash table v2 lookup: [\d\,]+ usec\n  - .*, ([\d\,]+) of ([\d\,]+) lookups hit\n', hash_result)
+        self.assertIsNotNone(match, msg='lookup workload did not run on Hash table v2')
+
+        hits = int(match.group(1).replace(",", ""))
+        lookups = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(hits, lookups, msg=f"Every batched lookup in Hash table v2 should find its value but only {hits} of {lookups} did.")
+
+    def test_23(self):
+        print("Running tester code 23...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--copy-keys', '--workload', 'churn')).decode()
+        match = re.search(r'Hash table v2 churn: [\d\,]+ usec\n(?:  - .*\n)*?  - ([\d\,]+) missing, ([\d\,]+) not removed\n', hash_result)
+        self.assertIsNotNone(match, msg='churn workload did not run on Hash table v2 with copied keys')
+
+        miss = int(match.group(1).replace(",", ""))
+        not_removed = int(match.group(2).replace(",", ""))
+
+        self.assertEqual(miss, 0, msg=f"The missing entries for Hash table v2 should be 0 but got {miss} instead.")
+        self.assertEqual(not_removed, 0, msg=f"The entries Hash table v2 did not remove should be 0 but got {not_removed} instead.")
+
+    def test_24(self):
+        print("Running tester code 24...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--lock', 'spinlock', '--buckets-per-lock', '16')).decode()
+        match = re.search(r'Hash table v2: [\d\,]+ usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash table v2 did not run with striped spinlocks')
+
+        miss = int(match.group(1).replace(",", ""))
+
+        self.assertEqual(miss, 0, msg=f"The missing entries for Hash table v2 should be 0 but got {miss} instead.")
+
+    def test_25(self):
+        print("Running tester code 25...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '50000', '--hasher', 'wyhash', '--hash-report')).decode()
+        match = re.search(r'Hash table v2: [\d\,]+ usec\n  - ([\d\,]+) missing\n', hash_result)
+        self.assertIsNotNone(match, msg='Hash table v2 did not run with wyhash')
+
+        miss = int(match.group(1).replace(",", ""))
+
+        self.assertEqual(miss, 0, msg=f"The missing entries for Hash table v2 with wyhash should be 0 but got {miss} instead.")
+
+        hashers = re.findall(r'^Hasher (\w+): [\d\,]+ usec, [\d\.]+ MB/s\n  - [\d\,]+ buckets, longest chain \d+\n', hash_result, re.MULTILINE)
+        self.assertEqual(hashers, ['djb2', 'wyhash'], msg='The hash report did not cover every hasher')
+
+    def test_26(self):
+        print("Running tester code 26...")
+        self.assertTrue(self.make, msg='make failed')
+
+        hash_result = subprocess.check_output(('./hash-table-tester', '-t', '4', '-s', '20000', '--workload', 'mixed', '--latency', '--format', 'json')).decode()
+        rows = [json.loads(line) for line in hash_result.splitlines() if line.startswith('{')]
+        self.assertEqual([row['table'] for row in rows], ['v1', 'v2'], msg='mixed workload did not report every table as JSON')
+
+        for row in rows:
+            for kind in ('lookup_latency_ns', 'insert_latency_ns'):
+                latency = row[kind]
+                self.assertEqual(sorted(latency), sorted(('p50', 'p99', 'p999', 'max')), msg=f"{kind} of Hash table {row['table']} does not have every percentile")
+                self.assertTrue(latency['p50'] <= latency['p99'] <= latency['p999'] <= latency['max'], msg=f"{kind} of Hash table {row['table']} is not ordered: {latency}")